@@ -0,0 +1,703 @@
+// Benchmark matrix: containers x item types x distributions x window sizes.
+// One CSV row per measured operation goes to stdout, for regression tracking:
+//   container,item,distribution,window,op,count,ns_per_op,checksum
+// The checksums only depend on the values, so every container of the same
+// item,distribution,window row must print the same ones.
+//
+// Usage: bench [--quick] [--full] [--max-window=N] [--filter=text]
+//   --quick         windows 16 and 256 with few operations, a smoke test
+//   --full          also run the linear sorted_flat_deque on windows above 65536
+//   --max-window=N  skip the windows larger than N
+//   --filter=text   run only the containers, items or distributions containing the text
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "sorted_flat_deque.hpp"
+#include "sorted_flat_array.hpp"
+#include "sorted_flat_deque_bank.hpp"
+#include "sorted_flat_publisher.hpp"
+#include "spsc_ring.hpp"
+#include "sorted_flat_executor.hpp"
+#include "sorted_flat_runs.hpp"
+#include "sorted_flat_histogram.hpp"
+
+struct item64_t {
+    int32_t key;
+    uint8_t payload[60];
+    bool operator<(const item64_t& other) const {
+        return key < other.key;
+    }
+};
+static_assert(sizeof(item64_t) == 64, "sizeof(item64_t) != 64");
+
+template <typename item_t>
+struct item_traits;
+template <>
+struct item_traits<int32_t> {
+    static const char* name() {
+        return "int32";
+    }
+    static int32_t make(const int32_t key) {
+        return key;
+    }
+    static int64_t key(const int32_t item) {
+        return item;
+    }
+};
+template <>
+struct item_traits<double> {
+    static const char* name() {
+        return "double";
+    }
+    static double make(const int32_t key) {
+        return static_cast<double>(key);
+    }
+    static int64_t key(const double item) {
+        return static_cast<int64_t>(item);
+    }
+};
+template <>
+struct item_traits<item64_t> {
+    static const char* name() {
+        return "item64";
+    }
+    static item64_t make(const int32_t key) {
+        item64_t item = item64_t();
+        item.key = key;
+        item.payload[0] = static_cast<uint8_t>(key);
+        return item;
+    }
+    static int64_t key(const item64_t& item) {
+        return item.key;
+    }
+};
+
+enum class distribution : uint8_t {
+    uniform,
+    ramp,
+    sawtooth,
+    duplicates,
+    random_walk,
+};
+static const distribution distributions[] = {
+    distribution::uniform,
+    distribution::ramp,
+    distribution::sawtooth,
+    distribution::duplicates,
+    distribution::random_walk,
+};
+
+const char* distribution_name(const distribution dist) {
+    switch (dist) {
+    case distribution::uniform:
+        return "uniform";
+    case distribution::ramp:
+        return "ramp";
+    case distribution::sawtooth:
+        return "sawtooth";
+    case distribution::duplicates:
+        return "duplicates";
+    default:
+        return "random_walk";
+    }
+}
+
+std::vector<int32_t> generate(const distribution dist, const size_t count, const uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<int32_t> keys(count);
+    int32_t walk = 0;
+    for (size_t i = 0; i < count; ++i) {
+        switch (dist) {
+        case distribution::uniform:
+            keys[i] = static_cast<int32_t>(rng() & 0xFFFFF) - 0x80000;
+            break;
+        case distribution::ramp:
+            keys[i] = static_cast<int32_t>(i);
+            break;
+        case distribution::sawtooth:
+            keys[i] = static_cast<int32_t>(i & 1023);
+            break;
+        case distribution::duplicates:
+            keys[i] = static_cast<int32_t>(rng() & 7);
+            break;
+        default:
+            walk += static_cast<int32_t>(rng() % 33) - 16;
+            keys[i] = walk;
+            break;
+        }
+    }
+    return keys;
+}
+
+struct result_row {
+    std::string container;
+    const char* item;
+    const char* dist;
+    uint32_t window;
+    const char* op;
+    uint64_t count;
+    double ns_per_op;
+    int64_t checksum;
+};
+
+using bench_clock = std::chrono::steady_clock;
+
+double elapsed_ns(const bench_clock::time_point begin, const bench_clock::time_point end) {
+    return std::chrono::duration<double, std::nano>(end - begin).count();
+}
+
+// Fills the window, then measures push_back into the full window (evict + insert),
+// median(), full iterations and pop_front() of up to ops items.
+template <typename window_t, typename item_t>
+void run_case(const std::string& container, const distribution dist, const uint32_t window,
+        const uint32_t ops, const std::vector<int32_t>& keys, std::vector<result_row>& rows) {
+    using traits = item_traits<item_t>;
+    std::vector<item_t> items(keys.size());
+    std::transform(keys.begin(), keys.end(), items.begin(), &traits::make);
+
+    window_t deque;
+    deque.set_max_size(window);
+    deque.push_back(items.begin(), items.begin() + window);
+    result_row row = { container, traits::name(), distribution_name(dist), window,
+        "", 0, 0.0, 0 };
+
+    auto begin = bench_clock::now();
+    for (uint32_t i = 0; i < ops; ++i) {
+        deque.push_back(items[window + i]);
+    }
+    auto end = bench_clock::now();
+    row.op = "push";
+    row.count = ops;
+    row.ns_per_op = elapsed_ns(begin, end) / ops;
+    row.checksum = traits::key(deque.min()) + traits::key(deque.median())
+        + traits::key(deque.max());
+    rows.push_back(row);
+
+    // The volatile pointer keeps median() from being hoisted out of the loop.
+    window_t* volatile target = &deque;
+    int64_t checksum = 0;
+    begin = bench_clock::now();
+    for (uint32_t i = 0; i < ops; ++i) {
+        checksum += traits::key(target->median());
+    }
+    end = bench_clock::now();
+    row.op = "median";
+    row.count = ops;
+    row.ns_per_op = elapsed_ns(begin, end) / ops;
+    row.checksum = checksum;
+    rows.push_back(row);
+
+    const uint32_t passes = std::max<uint32_t>(1, ops / window);
+    checksum = 0;
+    begin = bench_clock::now();
+    for (uint32_t pass = 0; pass < passes; ++pass) {
+        for (auto it = target->begin(); it != target->end(); ++it) {
+            checksum += traits::key(*it);
+        }
+    }
+    end = bench_clock::now();
+    row.op = "iterate";
+    row.count = static_cast<uint64_t>(passes) * window;
+    row.ns_per_op = elapsed_ns(begin, end) / row.count;
+    row.checksum = checksum;
+    rows.push_back(row);
+
+    const uint32_t pops = std::min(window, ops);
+    checksum = 0;
+    begin = bench_clock::now();
+    for (uint32_t i = 0; i < pops; ++i) {
+        checksum += traits::key(deque.pop_front());
+    }
+    end = bench_clock::now();
+    row.op = "pop";
+    row.count = pops;
+    row.ns_per_op = elapsed_ns(begin, end) / pops;
+    row.checksum = checksum;
+    rows.push_back(row);
+}
+
+struct options {
+    bool quick = false;
+    bool full = false;
+    uint32_t max_window = UINT32_MAX;
+    std::string filter;
+};
+
+bool selected(const options& opts, const std::string& container, const char* item,
+        const distribution dist) {
+    if (opts.filter.empty()) {
+        return true;
+    }
+    return container.find(opts.filter) != std::string::npos
+        || std::string(item).find(opts.filter) != std::string::npos
+        || std::string(distribution_name(dist)).find(opts.filter) != std::string::npos;
+}
+
+const char* isa_name(const sorted_flat_array_isa isa) {
+    switch (isa) {
+    case sorted_flat_array_isa::avx2:
+        return "avx2";
+    case sorted_flat_array_isa::sse2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+template <typename item_t>
+void run_array(const options& opts, const distribution dist, const uint32_t window,
+        const uint32_t ops, const std::vector<int32_t>& keys, std::vector<result_row>& rows,
+        std::true_type) {
+    const std::string container = std::string("array_")
+        + isa_name(sorted_flat_array<item_t>::isa());
+    if (selected(opts, container, item_traits<item_t>::name(), dist)) {
+        run_case<sorted_flat_array<item_t>, item_t>(container, dist, window, ops, keys, rows);
+    }
+}
+template <typename item_t>
+void run_array(const options&, const distribution, const uint32_t, const uint32_t,
+        const std::vector<int32_t>&, std::vector<result_row>&, std::false_type) {
+}
+
+// The uniform keys are 20-bit, the sawtooth and duplicates ones fit as well.
+template <typename item_t>
+void run_histogram(const options& opts, const distribution dist, const uint32_t window,
+        const uint32_t ops, const std::vector<int32_t>& keys, std::vector<result_row>& rows,
+        std::true_type) {
+    using histogram_t = sorted_flat_histogram<item_t, sorted_flat_key_range<item_t, -0x80000, 0x7FFFF>>;
+    if ((dist == distribution::uniform || dist == distribution::sawtooth
+            || dist == distribution::duplicates)
+            && selected(opts, "histogram", item_traits<item_t>::name(), dist)) {
+        run_case<histogram_t, item_t>("histogram", dist, window, ops, keys, rows);
+    }
+}
+template <typename item_t>
+void run_histogram(const options&, const distribution, const uint32_t, const uint32_t,
+        const std::vector<int32_t>&, std::vector<result_row>&, std::false_type) {
+}
+
+// One tick updates every series: a sorted_flat_deque_bank against separate deques.
+// The count of push_all and medians is the number of series times the ticks.
+template <typename item_t>
+void run_bank(const options& opts, const distribution dist, const uint32_t window,
+        std::vector<result_row>& rows, std::true_type) {
+    using traits = item_traits<item_t>;
+    const uint32_t series = 1024;
+    const uint32_t ticks = opts.quick ? 8 : 64;
+    const std::string names[] = { "bank1024", "deques1024" };
+    const std::vector<int32_t> keys = generate(dist, series * (window + ticks), window);
+    std::vector<item_t> values(keys.size());
+    std::transform(keys.begin(), keys.end(), values.begin(), &traits::make);
+    std::vector<item_t> medians(series);
+    for (uint32_t kind = 0; kind < 2; ++kind) {
+        if (!selected(opts, names[kind], traits::name(), dist)) {
+            continue;
+        }
+        sorted_flat_deque_bank<item_t> bank;
+        std::vector<sorted_flat_deque<item_t>> deques;
+        const auto push_all = [&](const item_t* tick) {
+            if (kind == 0) {
+                bank.push_all(tick);
+                return;
+            }
+            for (uint32_t i = 0; i < series; ++i) {
+                deques[i].push_back(tick[i]);
+            }
+        };
+        const auto read_medians = [&]() {
+            if (kind == 0) {
+                bank.medians(medians.data());
+                return;
+            }
+            for (uint32_t i = 0; i < series; ++i) {
+                medians[i] = deques[i].median();
+            }
+        };
+        if (kind == 0) {
+            bank.reset(series, window);
+        }
+        else {
+            deques.resize(series);
+            for (auto& deque : deques) {
+                deque.set_max_size(window);
+            }
+        }
+        for (uint32_t tick = 0; tick < window; ++tick) {
+            push_all(values.data() + static_cast<size_t>(tick) * series);
+        }
+        result_row row = { names[kind], traits::name(), distribution_name(dist), window,
+            "push_all", static_cast<uint64_t>(series) * ticks, 0.0, 0 };
+
+        auto begin = bench_clock::now();
+        for (uint32_t tick = window; tick < window + ticks; ++tick) {
+            push_all(values.data() + static_cast<size_t>(tick) * series);
+        }
+        auto end = bench_clock::now();
+        row.ns_per_op = elapsed_ns(begin, end) / row.count;
+        read_medians();
+        for (const item_t& median : medians) {
+            row.checksum += traits::key(median);
+        }
+        rows.push_back(row);
+
+        row.op = "medians";
+        row.checksum = 0;
+        begin = bench_clock::now();
+        for (uint32_t tick = 0; tick < ticks; ++tick) {
+            read_medians();
+            row.checksum += traits::key(medians[tick % series]);
+        }
+        end = bench_clock::now();
+        row.ns_per_op = elapsed_ns(begin, end) / row.count;
+        rows.push_back(row);
+    }
+}
+template <typename item_t>
+void run_bank(const options&, const distribution, const uint32_t, std::vector<result_row>&,
+        std::false_type) {
+}
+
+template <typename item_t>
+void run_item(const options& opts, const distribution dist, const uint32_t window,
+        const uint32_t ops, std::vector<result_row>& rows) {
+    const std::vector<int32_t> keys = generate(dist, window + ops, window);
+    const char* item = item_traits<item_t>::name();
+    // The linear walk is O(n/2) per push, too slow for the largest windows by default.
+    if ((window <= 65536 || opts.full) && selected(opts, "deque", item, dist)) {
+        run_case<sorted_flat_deque<item_t>, item_t>("deque", dist, window, ops, keys, rows);
+    }
+    if ((window <= 65536 || opts.full) && selected(opts, "deque_pow2", item, dist)) {
+        run_case<sorted_flat_deque<item_t, item_t, three_way_less<item_t>, 0,
+            identity_value<item_t>, std::allocator<item_t>, true>, item_t>(
+            "deque_pow2", dist, window, ops, keys, rows);
+    }
+    if (window < 65535 && selected(opts, "deque_u16", item, dist)) {
+        run_case<sorted_flat_deque<item_t, item_t, three_way_less<item_t>, 0,
+            identity_value<item_t>, std::allocator<item_t>, false, uint16_t>, item_t>(
+            "deque_u16", dist, window, ops, keys, rows);
+    }
+    // O(distinct values) per push, so the duplicates stay cheap at any window.
+    if ((window <= 65536 || opts.full || dist == distribution::duplicates)
+            && selected(opts, "runs", item, dist)) {
+        run_case<sorted_flat_runs<item_t>, item_t>("runs", dist, window, ops, keys, rows);
+    }
+    if (selected(opts, "deque_skip6", item, dist)) {
+        run_case<sorted_flat_deque<item_t, item_t, three_way_less<item_t>, 6>, item_t>(
+            "deque_skip6", dist, window, ops, keys, rows);
+    }
+    if (selected(opts, "deque_skip6_split", item, dist)) {
+        run_case<sorted_flat_deque<item_t, item_t, three_way_less<item_t>, 6,
+            identity_value<item_t>, std::allocator<item_t>, false, sorted_flat_position_t, true>,
+            item_t>("deque_skip6_split", dist, window, ops, keys, rows);
+    }
+    run_array<item_t>(opts, dist, window, ops, keys, rows,
+        std::integral_constant<bool, std::is_arithmetic<item_t>::value>());
+    run_histogram<item_t>(opts, dist, window, ops, keys, rows,
+        std::integral_constant<bool, std::is_same<item_t, int32_t>::value>());
+    if (window <= 256) {
+        run_bank<item_t>(opts, dist, window, rows,
+            std::integral_constant<bool, std::is_arithmetic<item_t>::value>());
+    }
+}
+
+// A deque behind a mutex, the baseline for sorted_flat_publisher.
+class locked_deque {
+public:
+    explicit locked_deque(const uint32_t window) {
+        m_deque.set_max_size(window);
+    }
+    void push_back(const int32_t item) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_deque.push_back(item);
+    }
+    sorted_flat_snapshot<int32_t> snapshot() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        sorted_flat_snapshot<int32_t> out{};
+        out.size = m_deque.size();
+        if (!m_deque.empty()) {
+            out.min = m_deque.min();
+            out.median = m_deque.median();
+            out.max = m_deque.max();
+        }
+        return out;
+    }
+
+private:
+    sorted_flat_deque<int32_t> m_deque;
+    mutable std::mutex m_mutex;
+};
+
+// 1 writer pushes while the readers take min/median/max/size snapshots in a loop.
+// The push row is the writer ns/push, the read row is ns/snapshot of one reader.
+template <typename shared_t>
+void run_readers(shared_t& shared, const std::string& container, const uint32_t readers,
+        const uint32_t window, const std::vector<int32_t>& keys, std::vector<result_row>& rows) {
+    std::atomic<bool> started(false);
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> reads(0);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < readers; ++i) {
+        threads.emplace_back([&] {
+            while (!started.load()) {
+            }
+            uint64_t count = 0;
+            int64_t sink = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                sink += shared.snapshot().median;
+                count += 1;
+            }
+            reads += count + (sink == INT64_MIN);
+        });
+    }
+    started = true;
+    const auto begin = bench_clock::now();
+    for (const int32_t key : keys) {
+        shared.push_back(key);
+    }
+    const auto end = bench_clock::now();
+    done = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const double elapsed = elapsed_ns(begin, end);
+    const auto last = shared.snapshot();
+    result_row row = { container, "int32", "uniform", window, "push_concurrent", keys.size(),
+        elapsed / keys.size(), static_cast<int64_t>(last.min) + last.median + last.max };
+    rows.push_back(row);
+    row.op = "read_concurrent";
+    row.count = reads.load();
+    row.ns_per_op = row.count ? elapsed * readers / row.count : 0.0;
+    row.checksum = 0;
+    rows.push_back(row);
+}
+
+void run_publisher(const options& opts, std::vector<result_row>& rows) {
+    const uint32_t window = 1024;
+    const std::vector<int32_t> keys = generate(distribution::uniform,
+        opts.quick ? 20000 : 100000, window);
+    std::vector<uint32_t> readerCounts = { 1, 2, 4, 8, 16, 32 };
+    if (opts.quick) {
+        readerCounts = { 1, 2 };
+    }
+    for (const uint32_t readers : readerCounts) {
+        const std::string suffix = "_r" + std::to_string(readers);
+        if (selected(opts, "publisher" + suffix, "int32", distribution::uniform)) {
+            sorted_flat_deque<int32_t> deque;
+            deque.set_max_size(window);
+            sorted_flat_publisher<sorted_flat_deque<int32_t>> publisher(std::move(deque));
+            run_readers(publisher, "publisher" + suffix, readers, window, keys, rows);
+        }
+        if (selected(opts, "mutex" + suffix, "int32", distribution::uniform)) {
+            locked_deque locked(window);
+            run_readers(locked, "mutex" + suffix, readers, window, keys, rows);
+        }
+    }
+}
+
+// A producer thread pushes into the ring, the consumer drains up to K items at a time
+// into the deque. The push row is the producer ns/push, the drain row is the consumer
+// ns per drained item; with drop, count of the dropped row is the dropped items.
+template <spsc_overflow overflow>
+void run_spsc(const std::string& container, const uint32_t batch,
+        const std::vector<int32_t>& keys, std::vector<result_row>& rows) {
+    const uint32_t window = 4096;
+    spsc_ring<int32_t, overflow> ring(1024);
+    sorted_flat_deque<int32_t> deque;
+    deque.set_max_size(window);
+    std::atomic<bool> produced(false);
+    double produce_ns = 0.0;
+    std::thread producer([&] {
+        const auto begin = bench_clock::now();
+        for (const int32_t key : keys) {
+            ring.push(key);
+        }
+        produce_ns = elapsed_ns(begin, bench_clock::now());
+        produced = true;
+    });
+    uint64_t drained = 0;
+    const auto begin = bench_clock::now();
+    while (true) {
+        const bool last = produced.load();
+        const size_t count = ring.drain(deque, batch);
+        drained += count;
+        if (count == 0) {
+            if (last) {
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+    const double drain_ns = elapsed_ns(begin, bench_clock::now());
+    producer.join();
+    const bool dropping = overflow == spsc_overflow::drop;
+    const int64_t checksum = dropping ? 0 : static_cast<int64_t>(deque.min()) + deque.median()
+        + deque.max();
+    result_row row = { container, "int32", "uniform", window,
+        dropping ? "push_spsc_drop" : "push_spsc", keys.size(), produce_ns / keys.size(),
+        checksum };
+    rows.push_back(row);
+    row.op = dropping ? "drain_spsc_drop" : "drain_spsc";
+    row.count = drained;
+    row.ns_per_op = drained ? drain_ns / drained : 0.0;
+    rows.push_back(row);
+    if (dropping) {
+        row.op = "dropped";
+        row.count = ring.dropped();
+        row.ns_per_op = 0.0;
+        row.checksum = 0;
+        rows.push_back(row);
+    }
+}
+
+void run_spsc_rings(const options& opts, std::vector<result_row>& rows) {
+    const std::vector<int32_t> keys = generate(distribution::uniform,
+        opts.quick ? 20000 : 1000000, 4096);
+    for (const uint32_t batch : { 1, 64, 1024 }) {
+        const std::string suffix = "_k" + std::to_string(batch);
+        if (selected(opts, "spsc_bp" + suffix, "int32", distribution::uniform)) {
+            run_spsc<spsc_overflow::back_pressure>("spsc_bp" + suffix, batch, keys, rows);
+        }
+        if (selected(opts, "spsc_drop" + suffix, "int32", distribution::uniform)) {
+            run_spsc<spsc_overflow::drop>("spsc_drop" + suffix, batch, keys, rows);
+        }
+    }
+}
+
+// Keyed windows updated by 1, 2, 4 .. hardware_concurrency workers. With the skewed keys
+// half of the items go to the first shard, the idle workers steal the other shards.
+void run_executor(const options& opts, std::vector<result_row>& rows, const bool skewed) {
+    const uint32_t window = 64;
+    const uint64_t keyCount = opts.quick ? 1000 : 100000;
+    const size_t batch = 4096;
+    const std::vector<int32_t> values = generate(distribution::uniform,
+        opts.quick ? 50000 : 4000000, 8192);
+    std::vector<std::pair<uint64_t, int32_t>> entries(values.size());
+    std::mt19937 rng(8193);
+    for (size_t i = 0; i < values.size(); ++i) {
+        entries[i].first = rng() % keyCount;
+        entries[i].second = values[i];
+    }
+    const uint32_t hardware = std::max<uint32_t>(1, std::thread::hardware_concurrency());
+    // The same shards for every worker count, so the checksums match.
+    const size_t shardCount = hardware * 8;
+    if (skewed) {
+        for (size_t i = 0; i < entries.size(); i += 2) {
+            entries[i].first -= entries[i].first % shardCount;
+        }
+    }
+    for (uint32_t workers = 1; ; workers *= 2) {
+        workers = std::min(workers, hardware);
+        const std::string container = "executor_w" + std::to_string(workers);
+        if (selected(opts, container, "int32", distribution::uniform)) {
+            sorted_flat_executor<sorted_flat_deque<int32_t>> executor(
+                sorted_flat_deque<int32_t>(window), workers, shardCount);
+            const auto begin = bench_clock::now();
+            for (size_t i = 0; i < entries.size(); i += batch) {
+                executor.submit(entries.begin() + i,
+                    entries.begin() + std::min(entries.size(), i + batch));
+            }
+            executor.wait();
+            const double ns = elapsed_ns(begin, bench_clock::now());
+            int64_t checksum = 0;
+            for (uint64_t key = 0; key < keyCount; key += 97) {
+                const sorted_flat_deque<int32_t>* found = executor.find(key);
+                checksum += found ? found->median() : 0;
+            }
+            result_row row = { container, "int32", "uniform", window,
+                skewed ? "push_keyed_skewed" : "push_keyed", entries.size(),
+                ns / entries.size(), checksum };
+            rows.push_back(row);
+            row.op = skewed ? "steals_skewed" : "steals";
+            row.count = executor.steals();
+            row.ns_per_op = 0.0;
+            row.checksum = 0;
+            rows.push_back(row);
+        }
+        if (workers == hardware) {
+            break;
+        }
+    }
+}
+
+bool report(const std::vector<result_row>& rows) {
+    bool mismatch = false;
+    for (const auto& row : rows) {
+        std::cout << row.container << ',' << row.item << ',' << row.dist << ','
+            << row.window << ',' << row.op << ',' << row.count << ','
+            << row.ns_per_op << ',' << row.checksum << std::endl;
+        for (const auto& other : rows) {
+            if (other.item == row.item && std::string(other.op) == row.op
+                    && other.checksum != row.checksum) {
+                std::cerr << "checksum mismatch: " << row.container << " vs "
+                    << other.container << ' ' << row.item << ' ' << row.dist << ' '
+                    << row.window << ' ' << row.op << std::endl;
+                mismatch = true;
+            }
+        }
+    }
+    return mismatch;
+}
+
+int main(int argc, char** argv) {
+    options opts;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--quick") {
+            opts.quick = true;
+        }
+        else if (arg == "--full") {
+            opts.full = true;
+        }
+        else if (arg.compare(0, 13, "--max-window=") == 0) {
+            opts.max_window = static_cast<uint32_t>(std::strtoul(arg.c_str() + 13, nullptr, 10));
+        }
+        else if (arg.compare(0, 9, "--filter=") == 0) {
+            opts.filter = arg.substr(9);
+        }
+        else {
+            std::cerr << "usage: bench [--quick] [--full] [--max-window=N] [--filter=text]"
+                << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<uint32_t> windows = { 16, 256, 4096, 65536, 1 << 20 };
+    if (opts.quick) {
+        windows = { 16, 256 };
+    }
+
+    std::cout << "container,item,distribution,window,op,count,ns_per_op,checksum" << std::endl;
+    bool mismatch = false;
+    for (const uint32_t window : windows) {
+        if (window > opts.max_window) {
+            continue;
+        }
+        const uint32_t ops = opts.quick ? 2000
+            : std::min<uint32_t>(100000, std::max<uint32_t>(1000, (1u << 26) / window));
+        for (const distribution dist : distributions) {
+            std::vector<result_row> rows;
+            run_item<int32_t>(opts, dist, window, ops, rows);
+            run_item<double>(opts, dist, window, ops, rows);
+            run_item<item64_t>(opts, dist, window, ops, rows);
+            mismatch |= report(rows);
+        }
+    }
+    std::vector<result_row> rows;
+    run_publisher(opts, rows);
+    run_spsc_rings(opts, rows);
+    run_executor(opts, rows, false);
+    run_executor(opts, rows, true);
+    mismatch |= report(rows);
+    return mismatch ? 1 : 0;
+}
@@ -1,9 +1,28 @@
 #pragma once
-#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 
-//NOTE: Destructors of stored items may be called several times.
-template <typename T>
+// The slots are raw storage from the allocator: an item is constructed by push and
+// destroyed by pop or clear(), so clear() is O(size) and T needs no default constructor.
+// A push into a full buffer assigns the new item over the evicted one.
+// Allocator follows the std::vector rules: the copy constructor uses
+// select_on_container_copy_construction(), the assignments and swap() propagate it
+// when the allocator traits say so. swap() of unequal non-propagating allocators
+// is undefined, as for the std containers. std::pmr::polymorphic_allocator<T>
+// keeps the buffer in a memory_resource (C++17).
+// power_of_two rounds the storage up to a power of two, so the offsets wrap with a mask
+// instead of a compare. max_size() stays as requested, capacity() is the storage.
+template <typename T, typename Allocator = std::allocator<T>, bool power_of_two = false>
 class circular_buffer {
+    using traits_t = std::allocator_traits<Allocator>;
+    // Copied with memcpy and dropped without destructor calls.
+    using is_trivial = std::integral_constant<bool, std::is_trivially_copyable<T>::value
+        && std::is_trivially_destructible<T>::value>;
 public:
     #ifdef SORTED_FLAT_DEQUE_POSITION_T
     using position_t = SORTED_FLAT_DEQUE_POSITION_T;
@@ -11,128 +30,146 @@ public:
     using position_t = uint32_t;
     #endif
     using value_type = T;
+    using allocator_type = Allocator;
     using pointer = value_type*;
     using const_pointer = const value_type*;
 
     circular_buffer() {
-        clear();
-        set_max_size(0);
     }
-    circular_buffer(const circular_buffer<T>& other) {
-        *this = other;
+    explicit circular_buffer(const allocator_type& allocator) : m_allocator(allocator) {
     }
-    circular_buffer(circular_buffer<T>&& other) {
-        *this = std::move(other);
+    circular_buffer(const circular_buffer& other)
+            : m_allocator(traits_t::select_on_container_copy_construction(other.m_allocator)) {
+        copy_items(other);
     }
-    circular_buffer(const position_t max_size) {
-        clear();
+    circular_buffer(circular_buffer&& other) : m_allocator(std::move(other.m_allocator)) {
+        take_storage(other);
+    }
+    circular_buffer(const position_t max_size, const allocator_type& allocator = allocator_type())
+            : m_allocator(allocator) {
         set_max_size(max_size);
     }
+    ~circular_buffer() {
+        clear();
+        deallocate();
+    }
 
-    circular_buffer<T>& operator=(const circular_buffer<T>& other) {
+    circular_buffer& operator=(const circular_buffer& other) {
         if (this == &other) {
             return *this;
         }
-        m_buffer = other.m_buffer;
-        m_frontOffset = other.m_frontOffset;
-        m_size = other.m_size;
+        clear();
+        using propagate = typename traits_t::propagate_on_container_copy_assignment;
+        if (propagate::value && m_allocator != other.m_allocator) {
+            deallocate();
+        }
+        assign_allocator(other.m_allocator, propagate());
+        copy_items(other);
         return *this;
     }
-    circular_buffer<T>& operator=(circular_buffer<T>&& other) {
+    circular_buffer& operator=(circular_buffer&& other) {
         if (this == &other) {
             return *this;
         }
-        m_buffer = std::move(other.m_buffer);
-        m_frontOffset = other.m_frontOffset; other.m_frontOffset = 0;
-        m_size = other.m_size; other.m_size = 0;
+        clear();
+        using propagate = typename traits_t::propagate_on_container_move_assignment;
+        if (propagate::value || m_allocator == other.m_allocator) {
+            deallocate();
+            assign_allocator(other.m_allocator, propagate());
+            take_storage(other);
+        }
+        else { // the storage cannot change hands, move the items one by one
+            if (m_capacity != other.m_capacity) {
+                deallocate();
+                allocate(other.m_capacity);
+            }
+            m_maxSize = other.m_maxSize;
+            m_frontOffset = other.m_frontOffset;
+            for (position_t i = 0; i < other.m_size; ++i) {
+                const position_t offset = wrap(other.m_frontOffset + i);
+                construct(offset, std::move(other.m_data[offset]));
+                ++m_size;
+            }
+            other.clear();
+        }
         return *this;
     }
 
+    // An item at an offset >= front_offset() moves to the new front_offset() plus the
+    // same distance, a wrapped item (offset < front_offset()) keeps its offset.
+    // sorted_flat_deque remaps its links by this rule.
     void set_max_size(const position_t max_size, const bool remove_from_front = true) {
-        if (static_cast<position_t>(m_buffer.size()) == max_size) {
+        if (m_maxSize == max_size) {
             return;
         }
-        else if (static_cast<position_t>(m_buffer.size()) > max_size) { // decrease
+        while (m_size > max_size) {
             if (remove_from_front) {
-                while (m_size > max_size) {
-                    pop_front();
-                }
+                destroy_front();
             }
             else {
-                while (m_size > max_size) {
-                    pop_back();
-                }
+                destroy_back();
+            }
+        }
+        m_maxSize = max_size;
+        const position_t capacity = storage_size(max_size);
+        if (m_capacity == capacity) {
+            return;
+        }
+        position_t newFrontOffset;
+        if (m_capacity > capacity) { // decrease
+            if (m_size == 0) {
+                newFrontOffset = 0;
             }
-            if (m_frontOffset == 0) {
+            else if (m_frontOffset + m_size <= capacity) {
                 // fxxxb000 -> fxxxb0
+                // 0fxb0000 -> 0fxb00
+                newFrontOffset = m_frontOffset;
             }
-            else if (m_frontOffset + m_size <= static_cast<position_t>(m_buffer.size())) {
+            else if (m_frontOffset + m_size <= m_capacity) {
                 // 000fxxxb -> 0fxxxb
-                const position_t shiftLeft = m_frontOffset - (max_size - m_size);
-                for (position_t i = m_frontOffset; i < m_frontOffset + m_size; ++i) {
-                    std::swap(m_buffer[i - shiftLeft], m_buffer[i]);
-                }
-                m_frontOffset -= shiftLeft;
+                newFrontOffset = capacity - m_size;
             }
             else {
                 // xb000fxx -> xb0fxx
-                const position_t shiftLeft =
-                    static_cast<position_t>(m_buffer.size()) - max_size;
-                const position_t rightPartOffset = m_frontOffset;
-                const position_t rightPartSize =
-                    static_cast<position_t>(m_buffer.size()) - m_frontOffset;
-                const position_t leftPartOffset = 0;
-                const position_t leftPartSize = m_size - rightPartSize;
-                for (position_t i = rightPartOffset; i < rightPartOffset + rightPartSize; ++i) {
-                    std::swap(m_buffer[i - shiftLeft], m_buffer[i]);
-                }
-                m_frontOffset -= shiftLeft;
+                newFrontOffset = m_frontOffset - (m_capacity - capacity);
             }
-            m_buffer.resize(max_size);
-        }
-        else if (static_cast<position_t>(m_buffer.size()) < max_size) { // increase
-            if (m_buffer.size() <= 1) {
-                // x -> x0
-                m_buffer.resize(max_size);
-                if (m_size == 1) {
-                    std::swap(m_buffer[0], m_buffer[m_buffer.size() - 1]);
-                    m_frontOffset = static_cast<position_t>(m_buffer.size()) - 1;
-                }
+        }
+        else { // increase
+            if (m_capacity <= 1) {
+                // x -> 0x
+                newFrontOffset = m_size == 1 ? capacity - 1 : 0;
             }
-            else if (m_frontOffset + m_size + 1 <= static_cast<position_t>(m_buffer.size())) {
+            else if (m_frontOffset + m_size + 1 <= m_capacity) {
                 // fxxb00 -> fxxb0000
                 // 0fxxb0 -> 0fxxb000
-                m_buffer.resize(max_size);
+                newFrontOffset = m_frontOffset;
             }
-            else { // m_frontOffset + m_size >= m_buffer.size()
+            else {
                 // 00fxxb -> 0000fxxb
                 // xb00fx -> xb0000fx
-                const position_t prevMaxSize = static_cast<position_t>(m_buffer.size());
-                const position_t rightPartSize =
-                    static_cast<position_t>(m_buffer.size()) - m_frontOffset;
-                const position_t shiftRight = max_size - prevMaxSize;
-                m_buffer.resize(max_size);
-                for (position_t i = max_size - 1; i >= max_size - m_size; --i) {
-                    std::swap(m_buffer[i], m_buffer[i - shiftRight]);
-                }
-                m_frontOffset += shiftRight;
+                newFrontOffset = m_frontOffset + (capacity - m_capacity);
             }
         }
+        relocate(capacity, newFrontOffset);
     }
+    // O(size), max_size() stays the same.
     void clear() {
-        const auto maxSize = m_buffer.size();
-        m_buffer.clear();
-        m_buffer.resize(maxSize);
+        while (m_size > 0) {
+            destroy_front();
+        }
         m_frontOffset = 0;
-        m_size = 0;
     }
+    // The storage always has exactly max_size() slots.
     void shrink_to_fit() {
-        m_buffer.shrink_to_fit();
     }
-    void swap(circular_buffer<T>& other) {
-        std::swap(m_buffer, other.m_buffer);
+    void swap(circular_buffer& other) {
+        swap_allocator(other, typename traits_t::propagate_on_container_swap());
+        std::swap(m_data, other.m_data);
+        std::swap(m_capacity, other.m_capacity);
+        std::swap(m_maxSize, other.m_maxSize);
         std::swap(m_frontOffset, other.m_frontOffset);
         std::swap(m_size, other.m_size);
+        std::swap(m_borrowed, other.m_borrowed);
     }
 
     void push_back(T&& item) {
@@ -142,6 +179,26 @@ public:
         push_back_impl(item);
     }
 
+    // Same result as push_back() of every item, memcpy for trivially copyable T.
+    void push_back(const T* items, size_t count) {
+        if (m_maxSize == 0 || count == 0) {
+            return;
+        }
+        if (count > m_maxSize) {
+            items += count - m_maxSize;
+            count = m_maxSize;
+        }
+        const position_t batchSize = static_cast<position_t>(count);
+        if (m_size > m_maxSize - batchSize) {
+            pop_front(m_size - (m_maxSize - batchSize));
+        }
+        const position_t backOffset = wrap(m_frontOffset + m_size);
+        const position_t firstPart = batchSize < m_capacity - backOffset
+            ? batchSize : m_capacity - backOffset;
+        construct_back(backOffset, items, firstPart, is_trivial());
+        construct_back(0, items + firstPart, batchSize - firstPart, is_trivial());
+    }
+
     void push_front(T&& item) {
         push_front_impl(std::move(item));
     }
@@ -149,37 +206,48 @@ public:
         push_front_impl(item);
     }
 
-    T&& pop_back() {
+    T pop_back() {
         if (m_size == 0) {
             throw std::logic_error("m_size == 0");
         }
-        const position_t posToPop = backOffset();
-        --m_size;
-        return std::move(m_buffer.at(posToPop));
+        T item(std::move(back()));
+        destroy_back();
+        return item;
     }
-    T&& pop_front() {
+    T pop_front() {
         if (m_size == 0) {
             throw std::logic_error("m_size == 0");
         }
-        const position_t posToPop = m_frontOffset;
-        ++m_frontOffset;
-        if (m_frontOffset >= static_cast<position_t>(m_buffer.size())) {
-            m_frontOffset = 0;
+        T item(std::move(front()));
+        destroy_front();
+        return item;
+    }
+    // Removes count items from the front, O(1) for trivially copyable T.
+    void pop_front(const size_t count) {
+        if (count > m_size) {
+            throw std::logic_error("count > size()");
+        }
+        destroy_front(static_cast<position_t>(count), is_trivial());
+    }
+    // pop_back() and pop_front() without moving the item out.
+    void discard_back() {
+        if (m_size == 0) {
+            throw std::logic_error("m_size == 0");
         }
-        --m_size;
-        return std::move(m_buffer.at(posToPop));
+        destroy_back();
+    }
+    void discard_front() {
+        if (m_size == 0) {
+            throw std::logic_error("m_size == 0");
+        }
+        destroy_front();
     }
 
     T& at(const position_t pos) {
-        const position_t size = static_cast<position_t>(m_buffer.size());
-        position_t realIndex = m_frontOffset + pos;
-        if (realIndex >= size) {
-            realIndex -= size;
-        }
-        return m_buffer.at(realIndex);
+        return at_offset(wrap(m_frontOffset + pos));
     }
     const T& at(const position_t pos) const {
-        return const_cast<circular_buffer<T>*>(this)->at(pos);
+        return const_cast<circular_buffer*>(this)->at(pos);
     }
     T& operator[](const position_t index) {
         return this->at(index);
@@ -188,16 +256,26 @@ public:
         return this->at(index);
     }
     T& at_offset(const position_t offset) {
-        return m_buffer.at(offset);
+        if (offset >= m_capacity) {
+            throw std::out_of_range("offset >= max_size()");
+        }
+        return m_data[offset];
     }
     const T& at_offset(const position_t offset) const {
-        return const_cast<circular_buffer<T>*>(this)->at_offset(offset);
+        return const_cast<circular_buffer*>(this)->at_offset(offset);
+    }
+    // offset < capacity() is on the caller.
+    T& at_offset_unchecked(const position_t offset) {
+        return m_data[offset];
+    }
+    const T& at_offset_unchecked(const position_t offset) const {
+        return m_data[offset];
     }
     T& front() {
         return this->at_offset(m_frontOffset);
     }
     const T& front() const {
-        return const_cast<circular_buffer<T>*>(this)->front();
+        return const_cast<circular_buffer*>(this)->front();
     }
     position_t front_offset() const {
         return m_frontOffset;
@@ -206,14 +284,86 @@ public:
         return this->at_offset(backOffset());
     }
     const T& back() const {
-        return const_cast<circular_buffer<T>*>(this)->back();
+        return const_cast<circular_buffer*>(this)->back();
     }
     position_t back_offset() const {
         return backOffset();
     }
 
+    // The items in the insertion order are array_one() followed by array_two():
+    // from the front to the end of the storage, then the wrapped part from its start.
+    std::pair<pointer, position_t> array_one() {
+        const position_t count = m_size < m_capacity - m_frontOffset
+            ? m_size : m_capacity - m_frontOffset;
+        return std::pair<pointer, position_t>(m_data + m_frontOffset, count);
+    }
+    std::pair<pointer, position_t> array_two() {
+        const position_t count = m_size - array_one().second;
+        return std::pair<pointer, position_t>(count > 0 ? m_data : nullptr, count);
+    }
+    std::pair<const_pointer, position_t> array_one() const {
+        return const_cast<circular_buffer*>(this)->array_one();
+    }
+    std::pair<const_pointer, position_t> array_two() const {
+        return const_cast<circular_buffer*>(this)->array_two();
+    }
+    // Restores a layout saved from array_one() and array_two() of a buffer with the same
+    // capacity(): clears the buffer, moves the front to front_offset and appends count items.
+    // read(pointer, count) fills the raw storage, once per contiguous part.
+    // Trivially copyable T only.
+    template <typename Read>
+    void restore(const position_t front_offset, const position_t count, Read&& read) {
+        static_assert(is_trivial::value, "restore() requires a trivially copyable T");
+        if (count > m_maxSize
+                || (m_capacity > 0 ? front_offset >= m_capacity : front_offset != 0)) {
+            throw std::out_of_range("front_offset or count is out of the storage");
+        }
+        clear();
+        m_frontOffset = front_offset;
+        const position_t firstPart = count < m_capacity - front_offset
+            ? count : m_capacity - front_offset;
+        if (firstPart > 0) {
+            read(m_data + front_offset, firstPart);
+        }
+        if (count > firstPart) {
+            read(m_data, static_cast<position_t>(count - firstPart));
+        }
+        m_size = count;
+    }
+    // Takes capacity() slots of caller-owned memory, e.g. a mapped file, as the storage
+    // instead of the allocator: count items from front_offset are already there. The memory
+    // is not freed; set_max_size() to another capacity moves the items back to the allocator.
+    // Trivially copyable T only.
+    void borrow(const pointer data, const position_t front_offset, const position_t count) {
+        static_assert(is_trivial::value, "borrow() requires a trivially copyable T");
+        const position_t capacity = storage_size(m_maxSize);
+        if (count > m_maxSize || (capacity > 0 ? front_offset >= capacity : front_offset != 0)) {
+            throw std::out_of_range("front_offset or count is out of the storage");
+        }
+        if (capacity > 0 && data == nullptr) {
+            throw std::invalid_argument("data == nullptr");
+        }
+        clear();
+        deallocate();
+        m_data = data;
+        m_capacity = capacity;
+        m_borrowed = true;
+        m_frontOffset = front_offset;
+        m_size = count;
+    }
+    bool borrowed() const {
+        return m_borrowed;
+    }
+
     position_t max_size() const {
-        return static_cast<position_t>(m_buffer.size());
+        return m_maxSize;
+    }
+    // The number of slots, max_size() rounded up to a power of two with power_of_two.
+    position_t capacity() const {
+        return m_capacity;
+    }
+    allocator_type get_allocator() const {
+        return m_allocator;
     }
     position_t size() const {
         return m_size;
@@ -228,10 +378,10 @@ public:
         using iterator_category = std::random_access_iterator_tag;
 
         iterator() {}
-        iterator(const position_t pos, circular_buffer<T>* ptr) {
+        iterator(const position_t pos, circular_buffer* ptr) {
             assign(pos, ptr);
         }
-        void assign(const position_t pos, circular_buffer<T>* ptr) {
+        void assign(const position_t pos, circular_buffer* ptr) {
             m_pos = pos;
             m_ptr = ptr;
         }
@@ -301,7 +451,7 @@ public:
             return (m_ptr == other.m_ptr) && (m_pos >= other.m_pos);
         }
     private:
-        circular_buffer<T>* m_ptr = nullptr;
+        circular_buffer* m_ptr = nullptr;
         position_t m_pos = 0;
     };
     // RandomAccessIterator
@@ -310,10 +460,10 @@ public:
         using iterator_category = std::random_access_iterator_tag;
 
         const_iterator() {} // construct with null vector pointer
-        const_iterator(const position_t pos, const circular_buffer<T>* ptr) {
+        const_iterator(const position_t pos, const circular_buffer* ptr) {
             assign(pos, ptr);
         }
-        void assign(const position_t pos, const circular_buffer<T>* ptr) {
+        void assign(const position_t pos, const circular_buffer* ptr) {
             m_pos = pos;
             m_ptr = ptr;
         }
@@ -379,7 +529,7 @@ public:
             return (m_ptr == other.m_ptr) && (m_pos >= other.m_pos);
         }
     private:
-        const circular_buffer<value_type>* m_ptr = nullptr;
+        const circular_buffer* m_ptr = nullptr;
         position_t m_pos = 0;
     };
     class reverse_iterator {
@@ -411,36 +561,174 @@ public:
     }
 
 private:
+    // offset < 2 * capacity()
+    position_t wrap(const position_t offset) const {
+        return wrap(offset, std::integral_constant<bool, power_of_two>());
+    }
+    position_t wrap(const position_t offset, std::false_type) const {
+        return offset >= m_capacity ? offset - m_capacity : offset;
+    }
+    position_t wrap(const position_t offset, std::true_type) const {
+        return offset & (m_capacity - 1);
+    }
+    static position_t storage_size(const position_t max_size) {
+        return storage_size(max_size, std::integral_constant<bool, power_of_two>());
+    }
+    static position_t storage_size(const position_t max_size, std::false_type) {
+        return max_size;
+    }
+    static position_t storage_size(const position_t max_size, std::true_type) {
+        if (max_size > static_cast<position_t>(static_cast<position_t>(-1) / 2 + 1)) {
+            throw std::length_error("max_size > the largest power of two in position_t");
+        }
+        position_t capacity = 1;
+        while (capacity < max_size) {
+            capacity <<= 1;
+        }
+        return max_size == 0 ? 0 : capacity;
+    }
+    template <typename... Args>
+    void construct(const position_t offset, Args&&... args) {
+        traits_t::construct(m_allocator, std::addressof(m_data[offset]),
+            std::forward<Args>(args)...);
+    }
+    void destroy_front() {
+        traits_t::destroy(m_allocator, std::addressof(m_data[m_frontOffset]));
+        m_frontOffset = wrap(m_frontOffset + 1);
+        --m_size;
+    }
+    void destroy_front(const position_t count, std::true_type) {
+        m_frontOffset = wrap(m_frontOffset + count);
+        m_size -= count;
+    }
+    void destroy_front(position_t count, std::false_type) {
+        for (; count > 0; --count) {
+            destroy_front();
+        }
+    }
+    // Appends count items at the offset, which is the back without wrapping.
+    void construct_back(const position_t offset, const T* items, const position_t count,
+            std::true_type) {
+        if (count > 0) {
+            std::memcpy(std::addressof(m_data[offset]), items, count * sizeof(T));
+        }
+        m_size += count;
+    }
+    void construct_back(const position_t offset, const T* items, const position_t count,
+            std::false_type) {
+        for (position_t i = 0; i < count; ++i) {
+            construct(offset + i, items[i]);
+            ++m_size;
+        }
+    }
+    void destroy_back() {
+        traits_t::destroy(m_allocator, std::addressof(m_data[backOffset()]));
+        --m_size;
+    }
+    void allocate(const position_t capacity) {
+        m_data = capacity > 0 ? traits_t::allocate(m_allocator, capacity) : nullptr;
+        m_capacity = capacity;
+    }
+    void deallocate() {
+        if (m_data != nullptr && !m_borrowed) {
+            traits_t::deallocate(m_allocator, m_data, m_capacity);
+        }
+        m_data = nullptr;
+        m_capacity = 0;
+        m_borrowed = false;
+    }
+    // Moves the items to new storage of the capacity, the right part (from the front
+    // to the end of the old storage) starts at the new front offset, the wrapped left
+    // part keeps its offsets.
+    void relocate(const position_t capacity, const position_t newFrontOffset) {
+        circular_buffer temp(m_allocator);
+        temp.allocate(capacity);
+        temp.m_frontOffset = newFrontOffset;
+        for (position_t i = 0; i < m_size; ++i) {
+            const position_t offset = wrap(m_frontOffset + i);
+            const position_t newOffset = offset >= m_frontOffset
+                ? newFrontOffset + (offset - m_frontOffset) : offset;
+            temp.construct(newOffset, std::move(m_data[offset]));
+            ++temp.m_size;
+        }
+        clear();
+        std::swap(m_data, temp.m_data);
+        std::swap(m_capacity, temp.m_capacity);
+        std::swap(m_frontOffset, temp.m_frontOffset);
+        std::swap(m_size, temp.m_size);
+        std::swap(m_borrowed, temp.m_borrowed);
+    }
+    // The storage is empty.
+    void copy_items(const circular_buffer& other) {
+        if (m_capacity != other.m_capacity) {
+            deallocate();
+            allocate(other.m_capacity);
+        }
+        m_maxSize = other.m_maxSize;
+        m_frontOffset = other.m_frontOffset;
+        for (position_t i = 0; i < other.m_size; ++i) {
+            const position_t offset = wrap(other.m_frontOffset + i);
+            construct(offset, other.m_data[offset]);
+            ++m_size;
+        }
+    }
+    // The storage is deallocated.
+    void take_storage(circular_buffer& other) {
+        m_data = other.m_data; other.m_data = nullptr;
+        m_capacity = other.m_capacity; other.m_capacity = 0;
+        m_maxSize = other.m_maxSize; other.m_maxSize = 0;
+        m_frontOffset = other.m_frontOffset; other.m_frontOffset = 0;
+        m_size = other.m_size; other.m_size = 0;
+        m_borrowed = other.m_borrowed; other.m_borrowed = false;
+    }
+    void assign_allocator(const Allocator& allocator, std::true_type) {
+        m_allocator = allocator;
+    }
+    void assign_allocator(const Allocator&, std::false_type) {
+    }
+    void swap_allocator(circular_buffer& other, std::true_type) {
+        std::swap(m_allocator, other.m_allocator);
+    }
+    void swap_allocator(circular_buffer&, std::false_type) {
+    }
+
     template <typename ItemT>
-    void push_back_impl(ItemT item) {
-        if (m_buffer.empty()) {
+    void push_back_impl(ItemT&& item) {
+        if (m_maxSize == 0) {
             return;
         }
-        while (m_size >= static_cast<position_t>(m_buffer.size())) {
-            pop_front();
+        if (m_size == m_capacity) {
+            // The evicted front slot becomes the back.
+            m_data[m_frontOffset] = std::forward<ItemT>(item);
+            m_frontOffset = wrap(m_frontOffset + 1);
+            return;
         }
+        // There is a free slot, the item may still refer to the front one.
+        construct(wrap(m_frontOffset + m_size), std::forward<ItemT>(item));
         ++m_size;
-        m_buffer.at(backOffset()) = std::move(item);
+        if (m_size > m_maxSize) {
+            destroy_front();
+        }
     }
     template <typename ItemT>
-    void push_front_impl(ItemT item) {
-        if (m_buffer.empty()) {
+    void push_front_impl(ItemT&& item) {
+        if (m_maxSize == 0) {
             return;
         }
-        while (m_size >= static_cast<position_t>(m_buffer.size())) {
-            pop_back();
-        }
-        if (m_frontOffset == 0) {
-            m_frontOffset = static_cast<position_t>(m_buffer.size() - 1);
-        }
-        else {
-            --m_frontOffset;
+        const position_t frontOffset = m_frontOffset == 0 ? m_capacity - 1 : m_frontOffset - 1;
+        if (m_size == m_capacity) {
+            // The evicted back slot becomes the front.
+            m_data[frontOffset] = std::forward<ItemT>(item);
+            m_frontOffset = frontOffset;
+            return;
         }
-        m_buffer.at(m_frontOffset) = std::move(item);
+        construct(frontOffset, std::forward<ItemT>(item));
+        m_frontOffset = frontOffset;
         ++m_size;
+        if (m_size > m_maxSize) {
+            destroy_back();
+        }
     }
-    std::vector<T>   m_buffer;
-    position_t       m_frontOffset;
     position_t backOffset() const {
         // size=0  front=0 back=0
         // size=1  front=0 back=0
@@ -449,10 +737,15 @@ private:
             return m_frontOffset;
         }
         else {
-            return m_frontOffset + m_size <= static_cast<position_t>(m_buffer.size())
-                ? m_frontOffset + m_size - 1
-                : m_frontOffset + m_size - 1 - static_cast<position_t>(m_buffer.size());
+            return wrap(m_frontOffset + m_size - 1);
         }
     }
-    position_t       m_size;
+
+    Allocator m_allocator;
+    typename traits_t::pointer m_data = nullptr;
+    position_t m_capacity = 0;
+    position_t m_maxSize = 0;
+    position_t m_frontOffset = 0;
+    position_t m_size = 0;
+    bool m_borrowed = false; // m_data is not from m_allocator
 };
@@ -0,0 +1,587 @@
+// sorted_flat_array
+// C++11, the sorted_flat_deque API over one contiguous sorted array, for arithmetic items.
+// Beats the node list on small windows (up to a few thousand items): the insertion
+// point is found by a binary search that ends in a SIMD count, and the shift is
+// one memmove. A circular_buffer of the items in insertion order tells what to evict.
+//
+// push - O(log n + n/2 memmove)
+// pop - O(log n + n/2 memmove)
+// min - O(1)
+// median - O(1)
+// max - O(1)
+// nth, rank - O(1), O(log n)
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "circular_buffer.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#   define SORTED_FLAT_ARRAY_X86
+#   include <immintrin.h>
+#   if defined(_MSC_VER)
+#       include <intrin.h>
+#       define SORTED_FLAT_ARRAY_SSE2
+#       define SORTED_FLAT_ARRAY_AVX2
+#   else
+#       define SORTED_FLAT_ARRAY_SSE2 __attribute__((target("sse2")))
+#       define SORTED_FLAT_ARRAY_AVX2 __attribute__((target("avx2,popcnt")))
+#   endif
+#endif
+
+
+enum class sorted_flat_array_isa : uint8_t {
+    scalar,
+    sse2,
+    avx2,
+};
+
+inline bool sorted_flat_array_isa_supported(const sorted_flat_array_isa isa) {
+    switch (isa) {
+    case sorted_flat_array_isa::scalar:
+        return true;
+    #ifdef SORTED_FLAT_ARRAY_X86
+    case sorted_flat_array_isa::sse2:
+        #if defined(_MSC_VER)
+        return true;
+        #else
+        return __builtin_cpu_supports("sse2");
+        #endif
+    case sorted_flat_array_isa::avx2:
+        #if defined(_MSC_VER)
+        {
+            int info[4] = { 0 };
+            __cpuid(info, 0);
+            if (info[0] < 7) {
+                return false;
+            }
+            __cpuid(info, 1);
+            const bool osxsave = (info[2] & (1 << 27)) != 0;
+            const bool avx = (info[2] & (1 << 28)) != 0;
+            if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+                return false;
+            }
+            __cpuidex(info, 7, 0);
+            return (info[1] & (1 << 5)) != 0;
+        }
+        #else
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+        #endif
+    #endif
+    default:
+        return false;
+    }
+}
+
+// Counts of the items less than (or not greater than, if inclusive) the value
+// in a block, per ISA. Only int32_t, float and double have SIMD kernels.
+template <typename item_t>
+struct sorted_flat_array_kernels {
+    static size_t count_scalar(const item_t* data, const size_t size, const item_t value,
+            const bool inclusive) {
+        size_t count = 0;
+        if (inclusive) {
+            for (size_t i = 0; i < size; ++i) {
+                count += !(value < data[i]);
+            }
+        }
+        else {
+            for (size_t i = 0; i < size; ++i) {
+                count += data[i] < value;
+            }
+        }
+        return count;
+    }
+    static bool has_simd() {
+        return false;
+    }
+    static size_t count_sse2(const item_t* data, const size_t size, const item_t value,
+            const bool inclusive) {
+        return count_scalar(data, size, value, inclusive);
+    }
+    static size_t count_avx2(const item_t* data, const size_t size, const item_t value,
+            const bool inclusive) {
+        return count_scalar(data, size, value, inclusive);
+    }
+};
+
+#ifdef SORTED_FLAT_ARRAY_X86
+inline int sorted_flat_array_popcount(const uint32_t mask) {
+    #if defined(_MSC_VER)
+    return static_cast<int>(__popcnt(mask));
+    #else
+    return __builtin_popcount(mask);
+    #endif
+}
+
+template <>
+struct sorted_flat_array_kernels<int32_t> {
+    static size_t count_scalar(const int32_t* data, const size_t size, const int32_t value,
+            const bool inclusive) {
+        size_t count = 0;
+        for (size_t i = 0; i < size; ++i) {
+            count += inclusive ? data[i] <= value : data[i] < value;
+        }
+        return count;
+    }
+    static bool has_simd() {
+        return true;
+    }
+    SORTED_FLAT_ARRAY_SSE2
+    static size_t count_sse2(const int32_t* data, const size_t size, const int32_t value,
+            const bool inclusive) {
+        // x <= v is x < v + 1, except for the max value.
+        if (inclusive && value == INT32_MAX) {
+            return size;
+        }
+        const int32_t bound = inclusive ? value + 1 : value;
+        const __m128i bounds = _mm_set1_epi32(bound);
+        __m128i counts = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            const __m128i items = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            counts = _mm_sub_epi32(counts, _mm_cmplt_epi32(items, bounds));
+        }
+        int32_t lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), counts);
+        size_t count = static_cast<size_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+        return count + count_scalar(data + i, size - i, value, inclusive);
+    }
+    SORTED_FLAT_ARRAY_AVX2
+    static size_t count_avx2(const int32_t* data, const size_t size, const int32_t value,
+            const bool inclusive) {
+        if (inclusive && value == INT32_MAX) {
+            return size;
+        }
+        const int32_t bound = inclusive ? value + 1 : value;
+        const __m256i bounds = _mm256_set1_epi32(bound);
+        __m256i counts = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            const __m256i items = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(data + i));
+            counts = _mm256_sub_epi32(counts, _mm256_cmpgt_epi32(bounds, items));
+        }
+        int32_t lanes[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), counts);
+        size_t count = 0;
+        for (const int32_t lane : lanes) {
+            count += static_cast<size_t>(lane);
+        }
+        return count + count_scalar(data + i, size - i, value, inclusive);
+    }
+};
+
+template <>
+struct sorted_flat_array_kernels<float> {
+    static size_t count_scalar(const float* data, const size_t size, const float value,
+            const bool inclusive) {
+        size_t count = 0;
+        for (size_t i = 0; i < size; ++i) {
+            count += inclusive ? data[i] <= value : data[i] < value;
+        }
+        return count;
+    }
+    static bool has_simd() {
+        return true;
+    }
+    SORTED_FLAT_ARRAY_SSE2
+    static size_t count_sse2(const float* data, const size_t size, const float value,
+            const bool inclusive) {
+        const __m128 bounds = _mm_set1_ps(value);
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            const __m128 items = _mm_loadu_ps(data + i);
+            const __m128 mask = inclusive
+                ? _mm_cmple_ps(items, bounds)
+                : _mm_cmplt_ps(items, bounds);
+            count += sorted_flat_array_popcount(
+                static_cast<uint32_t>(_mm_movemask_ps(mask)));
+        }
+        return count + count_scalar(data + i, size - i, value, inclusive);
+    }
+    SORTED_FLAT_ARRAY_AVX2
+    static size_t count_avx2(const float* data, const size_t size, const float value,
+            const bool inclusive) {
+        const __m256 bounds = _mm256_set1_ps(value);
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            const __m256 items = _mm256_loadu_ps(data + i);
+            const __m256 mask = inclusive
+                ? _mm256_cmp_ps(items, bounds, _CMP_LE_OQ)
+                : _mm256_cmp_ps(items, bounds, _CMP_LT_OQ);
+            count += sorted_flat_array_popcount(
+                static_cast<uint32_t>(_mm256_movemask_ps(mask)));
+        }
+        return count + count_scalar(data + i, size - i, value, inclusive);
+    }
+};
+
+template <>
+struct sorted_flat_array_kernels<double> {
+    static size_t count_scalar(const double* data, const size_t size, const double value,
+            const bool inclusive) {
+        size_t count = 0;
+        for (size_t i = 0; i < size; ++i) {
+            count += inclusive ? data[i] <= value : data[i] < value;
+        }
+        return count;
+    }
+    static bool has_simd() {
+        return true;
+    }
+    SORTED_FLAT_ARRAY_SSE2
+    static size_t count_sse2(const double* data, const size_t size, const double value,
+            const bool inclusive) {
+        const __m128d bounds = _mm_set1_pd(value);
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 2 <= size; i += 2) {
+            const __m128d items = _mm_loadu_pd(data + i);
+            const __m128d mask = inclusive
+                ? _mm_cmple_pd(items, bounds)
+                : _mm_cmplt_pd(items, bounds);
+            count += sorted_flat_array_popcount(
+                static_cast<uint32_t>(_mm_movemask_pd(mask)));
+        }
+        return count + count_scalar(data + i, size - i, value, inclusive);
+    }
+    SORTED_FLAT_ARRAY_AVX2
+    static size_t count_avx2(const double* data, const size_t size, const double value,
+            const bool inclusive) {
+        const __m256d bounds = _mm256_set1_pd(value);
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            const __m256d items = _mm256_loadu_pd(data + i);
+            const __m256d mask = inclusive
+                ? _mm256_cmp_pd(items, bounds, _CMP_LE_OQ)
+                : _mm256_cmp_pd(items, bounds, _CMP_LT_OQ);
+            count += sorted_flat_array_popcount(
+                static_cast<uint32_t>(_mm256_movemask_pd(mask)));
+        }
+        return count + count_scalar(data + i, size - i, value, inclusive);
+    }
+};
+#endif // SORTED_FLAT_ARRAY_X86
+
+
+template <typename item_t>
+class sorted_flat_array {
+public:
+    static_assert(std::is_arithmetic<item_t>::value, "sorted_flat_array requires an arithmetic item_t");
+    #ifdef SORTED_FLAT_DEQUE_POSITION_T
+    using position_t = SORTED_FLAT_DEQUE_POSITION_T;
+    #else
+    using position_t = uint32_t;
+    #endif
+    using item_type = item_t;
+    using value_type = item_t;
+    using pointer = value_type*;
+    using const_pointer = const value_type*;
+    // The items must stay sorted, so both are read-only.
+    using iterator = const item_t*;
+    using const_iterator = const item_t*;
+    using count_t = size_t (*)(const item_t* data, const size_t size, const item_t value,
+        const bool inclusive);
+
+    sorted_flat_array() {
+        clear();
+    }
+    sorted_flat_array(const position_t max_size) {
+        clear();
+        set_max_size(max_size);
+    }
+
+    // The best ISA is detected on the first use. Returns false if the ISA is not supported
+    // by the CPU, the build or item_t; for benchmarks and tests.
+    static bool set_isa(const sorted_flat_array_isa isa) {
+        if (!sorted_flat_array_isa_supported(isa)
+                || (isa != sorted_flat_array_isa::scalar
+                    && !sorted_flat_array_kernels<item_t>::has_simd())) {
+            return false;
+        }
+        counter() = select_counter(isa);
+        active_isa() = isa;
+        return true;
+    }
+    static sorted_flat_array_isa isa() {
+        counter();
+        return active_isa();
+    }
+
+    void set_max_size(const position_t max_size, const bool remove_from_front = true) {
+        if (max_size == this->max_size()) {
+            return;
+        }
+        if (remove_from_front) {
+            while (size() > max_size) {
+                pop_front();
+            }
+        }
+        else {
+            while (size() > max_size) {
+                pop_back();
+            }
+        }
+        m_fifo.set_max_size(max_size, remove_from_front);
+        m_sorted.resize(max_size);
+    }
+    void clear() {
+        m_fifo.clear();
+    }
+    void shrink_to_fit() {
+        m_fifo.shrink_to_fit();
+        m_sorted.shrink_to_fit();
+    }
+    void swap(sorted_flat_array& other) {
+        m_fifo.swap(other.m_fifo);
+        m_sorted.swap(other.m_sorted);
+    }
+
+    void push_back(const item_t item) {
+        if (max_size() == 0) {
+            return;
+        }
+        if (size() >= max_size()) {
+            replace(m_fifo.front(), item);
+        }
+        else {
+            insert(item);
+        }
+        m_fifo.push_back(item);
+    }
+    void push_front(const item_t item) {
+        if (max_size() == 0) {
+            return;
+        }
+        if (size() >= max_size()) {
+            replace(m_fifo.back(), item);
+        }
+        else {
+            insert(item);
+        }
+        m_fifo.push_front(item);
+    }
+    // Same result as push_back of every item in [first, last) one by one. The evicted
+    // items are removed in one compaction pass, the batch is sorted and merged.
+    // O(n + k*log(k)) instead of O(k*n/2).
+    template <typename ForwardIt>
+    void push_back(ForwardIt first, ForwardIt last) {
+        if (max_size() == 0 || first == last) {
+            return;
+        }
+        auto count = std::distance(first, last);
+        if (count > static_cast<decltype(count)>(max_size())) {
+            std::advance(first, count - static_cast<decltype(count)>(max_size()));
+            count = static_cast<decltype(count)>(max_size());
+        }
+        const position_t batchSize = static_cast<position_t>(count);
+        if (size() > max_size() - batchSize) {
+            pop_front(size() - (max_size() - batchSize));
+        }
+        item_t* data = m_sorted.data();
+        const position_t middle = size();
+        for (position_t i = middle; first != last; ++first, ++i) {
+            data[i] = *first;
+        }
+        m_fifo.push_back(data + middle, batchSize);
+        std::sort(data + middle, data + size());
+        std::inplace_merge(data, data + middle, data + size());
+    }
+    item_t pop_front() {
+        if (empty()) {
+            throw std::logic_error("m_fifo.empty()");
+        }
+        const item_t item = m_fifo.front();
+        erase(item);
+        m_fifo.pop_front();
+        return item;
+    }
+    // Same result as count calls of pop_front(), with one compaction pass.
+    void pop_front(const position_t count) {
+        if (count > size()) {
+            throw std::logic_error("count > size()");
+        }
+        const auto one = m_fifo.array_one();
+        const auto two = m_fifo.array_two();
+        const position_t fromOne = count < one.second ? count : one.second;
+        std::vector<item_t> evicted(one.first, one.first + fromOne);
+        evicted.insert(evicted.end(), two.first, two.first + (count - fromOne));
+        m_fifo.pop_front(count);
+        std::sort(evicted.begin(), evicted.end());
+        item_t* data = m_sorted.data();
+        const position_t prevSize = size() + count;
+        position_t kept = 0;
+        size_t removed = 0;
+        for (position_t i = 0; i < prevSize; ++i) {
+            if (removed < evicted.size() && !(data[i] < evicted[removed])
+                    && !(evicted[removed] < data[i])) {
+                ++removed;
+                continue;
+            }
+            data[kept++] = data[i];
+        }
+    }
+    item_t pop_back() {
+        if (empty()) {
+            throw std::logic_error("m_fifo.empty()");
+        }
+        const item_t item = m_fifo.back();
+        erase(item);
+        m_fifo.pop_back();
+        return item;
+    }
+
+    const item_t& front() const {
+        return m_fifo.front();
+    }
+    const item_t& back() const {
+        return m_fifo.back();
+    }
+    const item_t& min() const {
+        if (empty()) {
+            throw std::logic_error("m_min == position_max");
+        }
+        return m_sorted[0];
+    }
+    const item_t& median() const {
+        if (empty()) {
+            throw std::logic_error("m_middle == position_max");
+        }
+        return m_sorted[(size() - 1) >> 1];
+    }
+    const item_t& max() const {
+        if (empty()) {
+            throw std::logic_error("m_max == position_max");
+        }
+        return m_sorted[size() - 1];
+    }
+    const item_t& nth(const position_t rank) const {
+        if (rank >= size()) {
+            throw std::out_of_range("rank >= size()");
+        }
+        return m_sorted[rank];
+    }
+    position_t count_less(const item_t item) const {
+        return search(item, false);
+    }
+    position_t rank_of(const item_t item) const {
+        return search(item, true);
+    }
+    position_t size() const {
+        return m_fifo.size();
+    }
+    position_t max_size() const {
+        return m_fifo.max_size();
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const_iterator begin() const {
+        return m_sorted.data();
+    }
+    const_iterator median_it() const {
+        return empty() ? end() : m_sorted.data() + ((size() - 1) >> 1);
+    }
+    const_iterator end() const {
+        return m_sorted.data() + size();
+    }
+    const_iterator cbegin() const {
+        return begin();
+    }
+    const_iterator cmedian_it() const {
+        return median_it();
+    }
+    const_iterator cend() const {
+        return end();
+    }
+
+private:
+    // The number of items less than (or not greater than, if inclusive) the item:
+    // a branchless binary search down to a block, then a SIMD count over the block.
+    position_t search(const item_t item, const bool inclusive) const {
+        static const size_t block = 64;
+        const item_t* base = m_sorted.data();
+        size_t length = size();
+        while (length > block) {
+            const size_t half = length >> 1;
+            const bool before = inclusive ? !(item < base[half]) : base[half] < item;
+            base = before ? base + half : base;
+            length -= half;
+        }
+        return static_cast<position_t>(base - m_sorted.data()
+            + counter()(base, length, item, inclusive));
+    }
+    void insert(const item_t item) {
+        item_t* data = m_sorted.data();
+        const position_t pos = search(item, true);
+        std::memmove(data + pos + 1, data + pos, (size() - pos) * sizeof(item_t));
+        data[pos] = item;
+    }
+    void erase(const item_t item) {
+        item_t* data = m_sorted.data();
+        const position_t pos = search(item, false);
+        std::memmove(data + pos, data + pos + 1, (size() - pos - 1) * sizeof(item_t));
+    }
+    // Evict and insert with one memmove over the items between the two positions.
+    void replace(const item_t evicted, const item_t item) {
+        item_t* data = m_sorted.data();
+        const position_t from = search(evicted, false);
+        const position_t to = search(item, true);
+        if (to > from) {
+            std::memmove(data + from, data + from + 1, (to - 1 - from) * sizeof(item_t));
+            data[to - 1] = item;
+        }
+        else {
+            std::memmove(data + to + 1, data + to, (from - to) * sizeof(item_t));
+            data[to] = item;
+        }
+    }
+
+    static sorted_flat_array_isa& active_isa() {
+        static sorted_flat_array_isa isa = sorted_flat_array_isa::scalar;
+        return isa;
+    }
+    static count_t& counter() {
+        static count_t count = detect_counter();
+        return count;
+    }
+    static count_t detect_counter() {
+        if (sorted_flat_array_kernels<item_t>::has_simd()) {
+            if (sorted_flat_array_isa_supported(sorted_flat_array_isa::avx2)) {
+                active_isa() = sorted_flat_array_isa::avx2;
+            }
+            else if (sorted_flat_array_isa_supported(sorted_flat_array_isa::sse2)) {
+                active_isa() = sorted_flat_array_isa::sse2;
+            }
+        }
+        return select_counter(active_isa());
+    }
+    static count_t select_counter(const sorted_flat_array_isa isa) {
+        switch (isa) {
+        case sorted_flat_array_isa::avx2:
+            return &sorted_flat_array_kernels<item_t>::count_avx2;
+        case sorted_flat_array_isa::sse2:
+            return &sorted_flat_array_kernels<item_t>::count_sse2;
+        default:
+            return &sorted_flat_array_kernels<item_t>::count_scalar;
+        }
+    }
+
+    circular_buffer<item_t> m_fifo;
+    std::vector<item_t> m_sorted;
+};
@@ -1,17 +1,52 @@
 // sorted_flat_deque
-// C++11, STL-like API, bidirectional iterator, one memory allocation in the circular buffer.
+// C++11, STL-like API, bidirectional iterator, one memory allocation in the circular buffer
+// (two with split_items).
 //
-// push - O(n/2)
-// pop - O(1)
+// push - O(n/2), O(log n) with skip_levels, O(1) for a monotonic series
+// pop - O(1), O(log n) with skip_levels
+// nth, rank - O(n/4), O(log n) with skip_levels
 // min - O(1)
 // median - O(1)
+// quantile - O(1)
 // max - O(1)
-// average - O(1)
+// sum, mean, variance - O(1)
 //
 // Author: Yurii Blok
 // License: BSL-1.0
 // https://github.com/yurablok/sorted_flat_deque
 // History:
+// v0.6 16-Oct-26   Added skip_levels template parameter (skip-list indexed insertion).
+//                  The comparator is now a compare_t template parameter, three_way_less by default.
+//                  set_comparator() replaces it at runtime for three_way_function.
+//                  Added push_back(first, last) bulk insertion.
+//                  Added quantile cursors: add_quantile(), quantile(), quantile_it().
+//                  Added sum(), mean(), variance(), stddev() and the accessor_t parameter.
+//                  Added nth(), count_less(), rank_of() and const_rank_iterator.
+//                  Added sorted_flat_array, a contiguous backend for arithmetic items.
+//                  Fixed circular_buffer::set_max_size() increase of a wrapped buffer.
+//                  Added CMake build with the tests and bench targets.
+//                  Added pop_front(count) and sorted_flat_time_window (sorted_flat_time_window.hpp).
+//                  set_max_size() now keeps the insertion order.
+//                  Fixed circular_buffer::set_max_size() decrease when no items have to move.
+//                  Added sorted_flat_deque_bank (sorted_flat_deque_bank.hpp).
+//                  Added sorted_flat_publisher (sorted_flat_publisher.hpp), seqlock snapshots.
+//                  Added spsc_ring (spsc_ring.hpp), an SPSC ingestion ring with batched drain.
+//                  Added sorted_flat_executor (sorted_flat_executor.hpp), sharded keyed windows.
+//                  Added the allocator_t parameter to sorted_flat_deque and circular_buffer.
+//                  circular_buffer keeps raw storage: clear() is O(size), every item is
+//                  destroyed once, pop_front() and pop_back() return by value.
+//                  Added the power_of_two mode and unchecked node access in the traversals.
+//                  Added circular_buffer::array_one(), array_two(), bulk push_back and pop_front.
+//                  set_max_size() is O(n): the links are remapped instead of rebuilt.
+//                  Added the offset_t parameter, sorted_flat_offset_t and the split_items layout.
+//                  Added sorted_flat_runs (sorted_flat_runs.hpp), run-length nodes for duplicates.
+//                  Added sorted_flat_histogram (sorted_flat_histogram.hpp), counts and an occupancy
+//                  bitset for small integer ranges.
+//                  push_back() into a full window evicts and links in one pass (linear mode).
+//                  The linear walk starts from the nearest known node, added push_back(hint, item).
+//                  Added save() and load(), binary snapshots with a versioned header.
+//                  Added sorted_flat_mapped (sorted_flat_mapped.hpp), a window in a memory-mapped
+//                  file, and circular_buffer::borrow() for caller-owned storage.
 // v0.5 26-Aug-20   Fixed median offset processing in sorted_flat_deque::pop_front() and pop_back().
 //                  Added sorted_flat_deque::front() and back().
 // v0.4 25-Mar-20   circular_buffer::clear() now does not change max_size().
@@ -22,51 +57,265 @@
 // v0.1 06-Sep-19   First release.
 
 #pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <functional>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
 #include "circular_buffer.hpp"
 
 
-template <typename item_t, typename value_t = item_t>
+// Default three-way comparator: -1, 0, 1 for less, equal, greater.
+// Branchless and inlinable for arithmetic types.
+template <typename T>
+struct three_way_less {
+    int8_t operator()(const T& left, const T& right) const {
+        return static_cast<int8_t>((right < left) - (left < right));
+    }
+};
+// Type-erased comparator, replaceable at runtime via sorted_flat_deque::set_comparator.
+template <typename T>
+using three_way_function = std::function<int8_t(const T& left, const T& right)>;
+
+// Default value accessor when item_t is the value itself.
+template <typename T>
+struct identity_value {
+    const T& operator()(const T& item) const {
+        return item;
+    }
+};
+// Type-erased value accessor, replaceable at runtime via sorted_flat_deque::set_accessor.
+template <typename item_t, typename value_t>
+using value_function = std::function<value_t(const item_t& item)>;
+
+#ifdef SORTED_FLAT_DEQUE_POSITION_T
+using sorted_flat_position_t = SORTED_FLAT_DEQUE_POSITION_T;
+#else
+using sorted_flat_position_t = uint32_t;
+#endif
+// The narrowest offset_t for windows of up to max_capacity items, the largest value
+// of the type is reserved for "no node".
+template <uint64_t max_capacity>
+using sorted_flat_offset_t = typename std::conditional<(max_capacity < UINT8_MAX), uint8_t,
+    typename std::conditional<(max_capacity < UINT16_MAX), uint16_t,
+    typename std::conditional<(max_capacity < UINT32_MAX), uint32_t,
+        uint64_t>::type>::type>::type;
+
+// How sorted_flat_deque::attach_storage() takes over the nodes found in the storage.
+enum class sorted_flat_attach : uint8_t {
+    trust, // O(1), the links and the cursors as saved
+    check, // O(n), the links checked as load() does
+    relink // O(n log n), the items from the saved front offset sorted again, the links
+           // are not read (a change interrupted in the middle may have torn them)
+};
+
+// compare_t is the three-way comparator type. It is three_way_less<item_t> by default,
+// or three_way_function<item_t> when item_t differs from value_t and a comparator
+// has to be provided.
+// skip_levels > 0 enables the indexed mode: every node also carries up to skip_levels
+// "express lane" links (a skip list over the sorted order), so push is O(log n)
+// instead of the O(n/2) walk from the median. Each lane costs 2 * sizeof(position_t)
+// per node; ~log4(max_size) lanes are enough.
+// accessor_t extracts value_t from item_t for sum(), mean() and variance(), which are
+// available for arithmetic value_t. It is identity_value<item_t> by default, or
+// value_function<item_t, value_t> when item_t differs from value_t.
+// allocator_t is rebound to the nodes and the quantile cursors, for example
+// std::pmr::polymorphic_allocator<item_t> to keep many short-lived windows in one
+// memory_resource. Copy, move and swap propagate it as the std containers do.
+// power_of_two rounds the node buffer up to a power of two (see circular_buffer),
+// max_size() stays as requested.
+// offset_t is the type of the links, sizes and ranks. sorted_flat_offset_t<capacity>
+// picks the narrowest one: a node of int16_t takes 6 bytes with uint16_t, 12 with uint32_t.
+// split_items keeps the items in a second circular buffer with the same offsets, so the
+// walks that only follow the links (median and quantile moves, nth(), unlinking) do not
+// load the items. It pays for large item_t, and item_t needs no default constructor.
+template <typename item_t, typename value_t = item_t,
+    typename compare_t = typename std::conditional<std::is_same<item_t, value_t>::value,
+        three_way_less<item_t>, three_way_function<item_t>>::type,
+    uint8_t skip_levels = 0,
+    typename accessor_t = typename std::conditional<std::is_same<item_t, value_t>::value,
+        identity_value<item_t>, value_function<item_t, value_t>>::type,
+    typename allocator_t = std::allocator<item_t>,
+    bool power_of_two = false,
+    typename offset_t = sorted_flat_position_t,
+    bool split_items = false>
 class sorted_flat_deque {
 public:
-    #ifdef SORTED_FLAT_DEQUE_POSITION_T
-    using position_t = SORTED_FLAT_DEQUE_POSITION_T;
-    #else
-    using position_t = uint32_t;
-    #endif
+    using position_t = offset_t;
     static const position_t position_max = static_cast<position_t>(-1);
     using item_type = item_t;
     using value_type = value_t;
     using pointer = value_type*;
     using const_pointer = const value_type*;
-    //using accessor_t = std::function<const value_t& (const item_t& item)>;
-    using comparator_t = std::function<int8_t(const item_t& left, const item_t& right)>;
+    using comparator_t = compare_t;
+    using value_accessor_t = accessor_t;
+    using allocator_type = allocator_t;
+    class iterator;
+    class const_iterator;
 private:
-    struct node {
-        position_t idx(sorted_flat_deque<item_t, value_t>* parent) {
-            return static_cast<position_t>(this - &parent->m_nodes.at_offset(0));
+    static_assert(skip_levels <= 16, "skip_levels > 16");
+    static_assert(std::is_unsigned<offset_t>::value, "offset_t has to be unsigned");
+
+    template <uint8_t levels, typename = void>
+    struct express_links {
+        position_t skipPrev[levels];
+        position_t skipNext[levels];
+        position_t skipWidth[levels]; // base steps to skipNext, or to the end
+        uint8_t skipHeight;
+    };
+    template <typename dummy>
+    struct express_links<0, dummy> {
+    };
+    template <uint8_t levels, typename = void>
+    struct express_heads {
+        express_heads() {
+            for (uint8_t level = 0; level < levels; ++level) {
+                heads[level] = position_max;
+                widths[level] = 1;
+            }
+        }
+        position_t heads[levels];
+        position_t widths[levels]; // from the rank -1 before the min
+        uint32_t seed = 2463534242;
+    };
+    template <typename dummy>
+    struct express_heads<0, dummy> {
+    };
+
+    static const bool stats_enabled = std::is_arithmetic<value_t>::value;
+    template <bool enabled, typename = void>
+    struct value_stats {
+        using sum_t = typename std::conditional<std::is_floating_point<value_t>::value,
+            typename std::common_type<double, value_t>::type,
+            typename std::conditional<std::is_signed<value_t>::value,
+                int64_t, uint64_t>::type>::type;
+        using stat_t = typename std::conditional<std::is_floating_point<value_t>::value,
+            sum_t, double>::type;
+
+        // count is the number of values after the update.
+        void add(const value_t value, const position_t count) {
+            accumulate(static_cast<sum_t>(value), std::is_floating_point<value_t>());
+            const stat_t delta = static_cast<stat_t>(value) - mean;
+            mean += delta / static_cast<stat_t>(count);
+            m2 += delta * (static_cast<stat_t>(value) - mean);
+        }
+        void remove(const value_t value, const position_t count) {
+            if (count == 0) {
+                *this = value_stats();
+                return;
+            }
+            // Unsigned sums wrap around and still come out exact.
+            accumulate(-static_cast<sum_t>(value), std::is_floating_point<value_t>());
+            const stat_t delta = static_cast<stat_t>(value) - mean;
+            mean -= delta / static_cast<stat_t>(count);
+            m2 -= delta * (static_cast<stat_t>(value) - mean);
+            if (m2 < 0) {
+                m2 = 0;
+            }
+        }
+        sum_t sum_value() const {
+            return sum + compensation;
+        }
+        void accumulate(const sum_t value, std::false_type) {
+            sum += value;
+        }
+        void accumulate(const sum_t value, std::true_type) { // Neumaier
+            const sum_t total = sum + value;
+            if (std::abs(sum) >= std::abs(value)) {
+                compensation += (sum - total) + value;
+            }
+            else {
+                compensation += (value - total) + sum;
+            }
+            sum = total;
         }
+
+        sum_t sum = 0;
+        sum_t compensation = 0;
+        stat_t mean = 0;
+        stat_t m2 = 0;
+    };
+    template <typename dummy>
+    struct value_stats<false, dummy> {
+        using sum_t = void;
+        using stat_t = void;
+    };
+
+    template <bool split, typename = void>
+    struct node_item {
         item_t item;
-        //value_t value;
+    };
+    template <typename dummy>
+    struct node_item<true, dummy> {
+    };
+    struct node : express_links<skip_levels>, node_item<split_items> {
         position_t prevOffset;
         position_t nextOffset;
     };
+    // Without split_items the items live in the nodes and m_items only takes the calls.
+    struct no_items {
+        no_items() {
+        }
+        template <typename Allocator>
+        explicit no_items(const Allocator&) {
+        }
+        void set_max_size(const position_t, const bool) {
+        }
+        void clear() {
+        }
+        void shrink_to_fit() {
+        }
+        void swap(no_items&) {
+        }
+        void discard_front() {
+        }
+        void discard_back() {
+        }
+    };
 public:
+    using sum_type = typename value_stats<stats_enabled>::sum_t;
+    using stat_type = typename value_stats<stats_enabled>::stat_t;
+
     sorted_flat_deque() {
         clear();
-        set_comparator(nullptr);
+        set_comparator(comparator_t());
         set_max_size(0);
     }
-    sorted_flat_deque(const sorted_flat_deque<item_t>& other) {
+    explicit sorted_flat_deque(const allocator_t& allocator)
+            : m_nodes(node_allocator_t(allocator)), m_items(item_allocator_t(allocator)),
+            m_quantiles(cursor_allocator_t(allocator)) {
+        clear();
+        set_comparator(comparator_t());
+    }
+    sorted_flat_deque(const sorted_flat_deque& other)
+            : m_nodes(node_traits_t::select_on_container_copy_construction(
+                other.m_nodes.get_allocator())),
+            m_items(item_allocator_t(m_nodes.get_allocator())),
+            m_quantiles(cursor_traits_t::select_on_container_copy_construction(
+                other.m_quantiles.get_allocator())) {
         *this = other;
     }
-    sorted_flat_deque(sorted_flat_deque<item_t>&& other) {
+    sorted_flat_deque(sorted_flat_deque&& other)
+            : m_nodes(other.m_nodes.get_allocator()),
+            m_items(item_allocator_t(m_nodes.get_allocator())),
+            m_quantiles(other.m_quantiles.get_allocator()) {
         *this = std::move(other);
     }
     template <typename ItemT = item_t, typename ValueT = value_t,
         typename = typename std::enable_if<
             std::is_same<ItemT, ValueT>::value == true>::type>
-    sorted_flat_deque(const position_t max_size, const comparator_t comparator = nullptr) {
+    sorted_flat_deque(const position_t max_size, const comparator_t comparator = comparator_t(),
+            const allocator_t& allocator = allocator_t())
+            : m_nodes(node_allocator_t(allocator)), m_items(item_allocator_t(allocator)),
+            m_quantiles(cursor_allocator_t(allocator)) {
         clear();
         set_comparator(comparator);
         set_max_size(max_size);
@@ -75,13 +324,17 @@ public:
         typename = typename std::enable_if<
             std::is_same<ItemT, ValueT>::value == false>::type,
         typename = void> // Just for fix build error.
-    sorted_flat_deque(const position_t max_size, const comparator_t comparator) {
+    sorted_flat_deque(const position_t max_size, const comparator_t comparator,
+            const accessor_t accessor = accessor_t(), const allocator_t& allocator = allocator_t())
+            : m_nodes(node_allocator_t(allocator)), m_items(item_allocator_t(allocator)),
+            m_quantiles(cursor_allocator_t(allocator)) {
         clear();
         set_comparator(comparator);
+        set_accessor(accessor);
         set_max_size(max_size);
     }
 
-    sorted_flat_deque<item_t>& operator=(const sorted_flat_deque<item_t>& other) {
+    sorted_flat_deque& operator=(const sorted_flat_deque& other) {
         if (this == &other) {
             return *this;
         }
@@ -91,10 +344,15 @@ public:
         m_medianPos = other.m_medianPos;
         m_maxOffset = other.m_maxOffset;
         m_nodes = other.m_nodes;
+        m_items = other.m_items;
+        m_express = other.m_express;
+        m_quantiles = other.m_quantiles;
+        m_stats = other.m_stats;
         m_comparator = other.m_comparator;
+        m_accessor = other.m_accessor;
         return *this;
     }
-    sorted_flat_deque<item_t>& operator=(sorted_flat_deque<item_t>&& other) {
+    sorted_flat_deque& operator=(sorted_flat_deque&& other) {
         if (this == &other) {
             return *this;
         }
@@ -104,30 +362,21 @@ public:
         m_medianPos = other.m_medianPos; other.m_medianPos = position_max;
         m_maxOffset = other.m_maxOffset; other.m_maxOffset = position_max;
         m_nodes = std::move(other.m_nodes);
-        m_comparator = other.m_comparator; other.m_comparator = nullptr;
+        m_items = std::move(other.m_items);
+        m_express = other.m_express; other.m_express = express_heads<skip_levels>();
+        m_quantiles = std::move(other.m_quantiles); other.m_quantiles.clear();
+        m_stats = other.m_stats; other.m_stats = value_stats<stats_enabled>();
+        m_comparator = std::move(other.m_comparator);
+        m_accessor = std::move(other.m_accessor);
         return *this;
     }
 
     template <typename ItemT = item_t, typename ValueT = value_t>
         typename std::enable_if<
             std::is_same<ItemT, ValueT>::value == true, void>::
-    type set_comparator(const comparator_t comparator = nullptr) {
-        if (comparator) {
-            m_comparator = comparator;
-        }
-        else {
-            m_comparator = [](const value_t& left, const value_t& right) -> int8_t {
-                if (left < right) {
-                    return -1;
-                }
-                else if (left > right) {
-                    return 1;
-                }
-                else {
-                    return 0;
-                }
-            };
-        }
+    type set_comparator(const comparator_t comparator = comparator_t()) {
+        m_comparator = comparator;
+        set_default_comparator(m_comparator);
     }
     template <typename ItemT = item_t, typename ValueT = value_t>
         typename std::enable_if<
@@ -135,11 +384,26 @@ public:
     type set_comparator(const comparator_t comparator) {
         m_comparator = comparator;
     }
+    // Recomputes the stats of the current items with the new accessor.
+    void set_accessor(const accessor_t accessor) {
+        m_accessor = accessor;
+        m_stats = value_stats<stats_enabled>();
+        position_t count = 0;
+        for (auto it = cbegin(); it != cend(); ++it) {
+            stats_add(*it, ++count);
+        }
+    }
 
+    // O(n) without comparisons: the nodes keep their links, only the offsets of the
+    // nodes moved by circular_buffer::set_max_size() are remapped.
     void set_max_size(const position_t max_size, const bool remove_from_front = true) {
-        if (m_nodes.size() == max_size) {
+        if (m_nodes.max_size() == max_size) {
             return;
         }
+        // The offsets of the rounded up storage have to stay below position_max.
+        if (power_of_two && max_size > static_cast<position_t>(position_max / 2 + 1)) {
+            throw std::length_error("max_size > the largest power of two in position_t");
+        }
         if (m_nodes.size() > max_size) {
             if (remove_from_front) {
                 while (m_size > max_size) {
@@ -152,44 +416,206 @@ public:
                 }
             }
         }
-
-        sorted_flat_deque<item_t, value_t> temp;
-        temp.swap(*this);
-        clear();
-        m_comparator = temp.m_comparator;
+        const position_t oldFrontOffset = m_nodes.front_offset();
         m_nodes.set_max_size(max_size, remove_from_front);
-        for (auto it = temp.begin(); it != temp.end(); ++it) {
-            push_back(std::move(it.extract()));
+        m_items.set_max_size(max_size, remove_from_front);
+        const position_t newFrontOffset = m_nodes.front_offset();
+        if (m_size == 0 || newFrontOffset == oldFrontOffset) {
+            return;
+        }
+        // The nodes from the old front offset to the end of the old storage moved
+        // together, the wrapped ones kept their offsets.
+        const auto remap = [oldFrontOffset, newFrontOffset](position_t& offset) {
+            if (offset != position_max && offset >= oldFrontOffset) {
+                offset = newFrontOffset + (offset - oldFrontOffset);
+            }
+        };
+        for (position_t i = 0; i < m_nodes.size(); ++i) {
+            node& moved = m_nodes.at(i);
+            remap(moved.prevOffset);
+            remap(moved.nextOffset);
+            remap_express(moved, remap, indexed_tag());
+        }
+        remap(m_minOffset);
+        remap(m_medianOffset);
+        remap(m_maxOffset);
+        remap_express(m_express, remap, indexed_tag());
+        for (auto& cursor : m_quantiles) {
+            remap(cursor.offset);
         }
     }
     void clear() {
         m_nodes.clear();
+        m_items.clear();
         m_size = 0;
         m_minOffset = position_max;
         m_medianOffset = position_max;
         m_medianPos = position_max;
         m_maxOffset = position_max;
-        //m_sum = 0;
+        m_express = express_heads<skip_levels>();
+        reset_quantiles();
+        m_stats = value_stats<stats_enabled>();
     }
     void shrink_to_fit() {
         m_nodes.shrink_to_fit();
+        m_items.shrink_to_fit();
     }
-    void swap(sorted_flat_deque<item_t, value_t>& other) {
+    // Undefined for unequal allocators that do not propagate on swap, as for the std containers.
+    void swap(sorted_flat_deque& other) {
         std::swap(m_comparator, other.m_comparator);
-        std::swap(m_nodes, other.m_nodes);
+        std::swap(m_accessor, other.m_accessor);
+        m_nodes.swap(other.m_nodes);
+        m_items.swap(other.m_items);
         std::swap(m_size, other.m_size);
         std::swap(m_minOffset, other.m_minOffset);
         std::swap(m_medianOffset, other.m_medianOffset);
         std::swap(m_medianPos, other.m_medianPos);
         std::swap(m_maxOffset, other.m_maxOffset);
-        //std::swap(m_sum, other.m_sum);
+        std::swap(m_express, other.m_express);
+        m_quantiles.swap(other.m_quantiles);
+        std::swap(m_stats, other.m_stats);
+    }
+
+    // Binary snapshot of the whole state for a fast restart: the node buffer as is (the
+    // links are offsets), the cursors, the stats and the express lanes. load() is a bulk
+    // read into the storage and an O(n) check of the links, without comparisons.
+    // The format is the memory layout, so only the same instantiation on a platform of the
+    // same byte order reads it back; the versioned header checks that. The comparator has
+    // to order the items as when they were saved. Trivially copyable item_t only.
+    void save(std::ostream& stream) const {
+        const auto write = [&stream](const void* data, const size_t size) {
+            stream.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+        };
+        save_snapshot(write);
+        if (!stream) {
+            throw std::runtime_error("the snapshot write failed");
+        }
+    }
+    // The size in bytes of the snapshot.
+    size_t saved_size() const {
+        size_t size = 0;
+        const auto write = [&size](const void*, const size_t bytes) {
+            size += bytes;
+        };
+        save_snapshot(write);
+        return size;
+    }
+    // Writes the snapshot to the memory of size bytes, returns saved_size().
+    size_t save(void* data, const size_t size) const {
+        if (size < saved_size()) {
+            throw std::length_error("size < saved_size()");
+        }
+        char* out = static_cast<char*>(data);
+        const auto write = [&out](const void* bytes, const size_t count) {
+            if (count > 0) {
+                std::memcpy(out, bytes, count);
+            }
+            out += count;
+        };
+        save_snapshot(write);
+        return static_cast<size_t>(out - static_cast<char*>(data));
+    }
+    // Replaces the content, the quantile cursors and max_size() with the snapshot.
+    // A truncated, foreign or inconsistent snapshot throws std::runtime_error
+    // and leaves the deque empty.
+    void load(std::istream& stream) {
+        const auto read = [&stream](void* data, const size_t size) {
+            if (!stream.read(static_cast<char*>(data), static_cast<std::streamsize>(size))) {
+                throw std::runtime_error("the snapshot is truncated");
+            }
+        };
+        load_snapshot(read);
+    }
+    void load(const void* data, const size_t size) {
+        const char* in = static_cast<const char*>(data);
+        const char* const end = in + size;
+        const auto read = [&in, end](void* bytes, const size_t count) {
+            if (static_cast<size_t>(end - in) < count) {
+                throw std::runtime_error("the snapshot is truncated");
+            }
+            if (count > 0) {
+                std::memcpy(bytes, in, count);
+            }
+            in += count;
+        };
+        load_snapshot(read);
+    }
+
+    // Persistent storage (sorted_flat_mapped.hpp): the nodes, and the items with split_items,
+    // live in storage_size() bytes of caller-owned memory aligned to 64, e.g. a mapped file,
+    // instead of the allocator. The nodes keep their offsets there, so the storage and the
+    // state of save_state() together are a snapshot that attach_storage() takes over in place.
+    // set_max_size() to another capacity moves the nodes back to the allocator.
+    // Trivially copyable item_t only.
+    size_t storage_size() const {
+        return storage_nodes_size() + storage_items_size(split_tag());
+    }
+    // Moves the content into the storage.
+    void use_storage(void* storage) {
+        char* const bytes = static_cast<char*>(storage);
+        move_to_storage(m_nodes, reinterpret_cast<node*>(bytes));
+        move_items_to_storage(bytes + storage_nodes_size(), split_tag());
+    }
+    // The snapshot of save() without the nodes: the header, the cursors, the stats
+    // and the express lanes, O(1 + quantiles).
+    size_t state_size() const {
+        size_t size = 0;
+        const auto write = [&size](const void*, const size_t bytes) {
+            size += bytes;
+        };
+        save_state_snapshot(write);
+        return size;
+    }
+    size_t save_state(void* data, const size_t size) const {
+        if (size < state_size()) {
+            throw std::length_error("size < state_size()");
+        }
+        char* out = static_cast<char*>(data);
+        const auto write = [&out](const void* bytes, const size_t count) {
+            std::memcpy(out, bytes, count);
+            out += count;
+        };
+        save_state_snapshot(write);
+        return static_cast<size_t>(out - static_cast<char*>(data));
+    }
+    // Replaces the content with the nodes already in the storage, as described by the state
+    // of save_state(). A foreign or inconsistent state throws std::runtime_error as load().
+    void attach_storage(void* storage, const size_t storage_size, const void* state,
+            const size_t state_size, const sorted_flat_attach mode = sorted_flat_attach::check) {
+        const char* in = static_cast<const char*>(state);
+        const char* const end = in + state_size;
+        const auto read = [&in, end](void* bytes, const size_t count) {
+            if (static_cast<size_t>(end - in) < count) {
+                throw std::runtime_error("the snapshot is truncated");
+            }
+            std::memcpy(bytes, in, count);
+            in += count;
+        };
+        const auto place = [this, storage, storage_size](const position_t frontOffset,
+                const position_t size) {
+            if (this->storage_size() > storage_size) {
+                throw std::runtime_error("the storage is smaller than the snapshot");
+            }
+            char* const bytes = static_cast<char*>(storage);
+            m_nodes.borrow(reinterpret_cast<node*>(bytes), frontOffset, size);
+            borrow_items(bytes + storage_nodes_size(), frontOffset, size, split_tag());
+        };
+        load_snapshot(read, place, mode);
     }
 
     void push_back(item_t&& item) {
-        push_back_impl(std::move(item));
+        push_back_impl(std::move(item), position_max);
     }
     void push_back(const item_t& item) {
-        push_back_impl(item);
+        push_back_impl(item, position_max);
+    }
+    // The hint is an iterator of this deque or end(), like in std::multiset::insert(hint, item)
+    // the walk starts from it when it is nearer to the item than the other known nodes.
+    void push_back(const const_iterator hint, item_t&& item) {
+        push_back_impl(std::move(item), hint.offset());
+    }
+    void push_back(const const_iterator hint, const item_t& item) {
+        push_back_impl(item, hint.offset());
     }
 
     void push_front(item_t&& value) {
@@ -199,191 +625,103 @@ public:
         push_front_impl(item);
     }
 
+    // Same result as push_back of every item in [first, last) one by one, but the front
+    // is evicted at once, the batch is sorted and merged into the list in a single pass,
+    // and the median is found once. O(n + k*log(k)) instead of O(k*n/2).
+    template <typename ForwardIt>
+    void push_back(ForwardIt first, ForwardIt last) {
+        if (max_size() == 0 || first == last) {
+            return;
+        }
+        auto count = std::distance(first, last);
+        if (count > static_cast<decltype(count)>(max_size())) {
+            std::advance(first, count - static_cast<decltype(count)>(max_size()));
+            count = static_cast<decltype(count)>(max_size());
+        }
+        const position_t batchSize = static_cast<position_t>(count);
+        while (size() > max_size() - batchSize) {
+            const position_t offset = m_nodes.front_offset();
+            unlink_links(m_nodes.at_offset_unchecked(offset));
+            m_size -= 1;
+            stats_remove(item_at(offset), m_size);
+            m_nodes.discard_front();
+            m_items.discard_front();
+        }
+
+        std::vector<position_t> batch;
+        batch.reserve(batchSize);
+        for (; first != last; ++first) {
+            push_node_back(*first, split_tag());
+            batch.push_back(m_nodes.back_offset());
+            stats_add(item_at(batch.back()), m_size + static_cast<position_t>(batch.size()));
+        }
+        std::stable_sort(batch.begin(), batch.end(),
+            [this](const position_t left, const position_t right) {
+                return m_comparator(item_at(left), item_at(right)) < 0;
+            });
+        merge_sorted(batch);
+    }
+
     item_t& back() {
-        return m_nodes.back().item;
+        return item_at_checked(m_nodes.back_offset());
     }
     const item_t& back() const {
-        return m_nodes.back().item;
+        return item_at_checked(m_nodes.back_offset());
     }
 
     item_t& front() {
-        return m_nodes.front().item;
+        return item_at_checked(m_nodes.front_offset());
     }
     const item_t& front() const {
-        return m_nodes.front().item;
+        return item_at_checked(m_nodes.front_offset());
     }
 
-    item_t&& pop_front() {
+    item_t pop_front() {
         if (m_nodes.empty() || m_size == 0) {
             throw std::logic_error("m_nodes.empty()");
         }
-        else if (m_size == 1) {
-            m_size = 0;
-            m_minOffset = position_max;
-            m_maxOffset = position_max;
-            m_medianOffset = position_max;
-            m_medianPos = position_max;
-            return std::move(m_nodes.pop_front().item);
-        }
-        auto& to_remove = m_nodes.front();
-        //m_sum -= to_remove.value;
-        if (to_remove.prevOffset != position_max) {
-            m_nodes.at_offset(to_remove.prevOffset).nextOffset = to_remove.nextOffset;
-        }
-        else { // extreme
-            m_minOffset = to_remove.nextOffset;
-        }
-        if (to_remove.nextOffset != position_max) {
-            m_nodes.at_offset(to_remove.nextOffset).prevOffset = to_remove.prevOffset;
-        }
-        else { // extreme
-            m_maxOffset = to_remove.prevOffset;
-        }
-
-        //                5->L        4->R      3->L      2->R      offset
-        // F MR B   123M45(-3L)->12M45(-2)->14M5(-4L)->1M5(-1)->5M  pos
-        if (m_medianOffset == m_nodes.front_offset()) { // MR
-            if (m_size & 1) {
-                m_medianOffset = to_remove.prevOffset;
-                m_medianPos -= 1;
-            }
-            else {
-                m_medianOffset = to_remove.nextOffset;
-            }
+        unlink_node(m_nodes.front_offset());
+        return pop_front_item(split_tag());
+    }
+    // Same result as count calls of pop_front(), but the median and the quantile
+    // cursors are moved to their new positions once, after all items are unlinked.
+    void pop_front(position_t count) {
+        if (count > m_size) {
+            throw std::logic_error("count > size()");
+        }
+        if (count == m_size) {
+            clear();
+            return;
         }
-        else {
-            int8_t cmp = m_comparator(to_remove.item,
-                m_nodes.at_offset(m_medianOffset).item);
-            const node* caret_left = &to_remove;
-            const node* caret_right = &to_remove;
-            while (cmp == 0) {
-                // M <-CL R CR-> M
-                if (m_medianOffset == caret_left->prevOffset) { // BR
-                    cmp = 1;
-                    break;
-                }
-                if (caret_right->nextOffset == m_medianOffset) { // FR
-                    cmp = -1;
-                    break;
-                }
-                if (caret_left->prevOffset != position_max) {
-                    caret_left = &m_nodes.at_offset(caret_left->prevOffset);
-                }
-                if (caret_right->nextOffset != position_max) {
-                    caret_right = &m_nodes.at_offset(caret_right->nextOffset);
-                }
-            }
-            //                5->         4->R      3->       2->R      offset
-            // FR M B   123M45(-2L)->13M45(-1)->34M5(-3L)->4M5(-4)->5M  pos
-            if (cmp < 0) {
-                if (m_size & 1) {
-                    m_medianPos -= 1;
-                }
-                else {
-                    m_medianOffset = m_nodes.at_offset(m_medianOffset).nextOffset;
-                }
-            }
-            //                5->L        4->       3->L      2->       offset
-            // F M BR   123M45(-4L)->12M35(-3)->12M5(-5L)->1M2(-2)->1M  pos
-            else {
-                if (m_size & 1) {
-                    m_medianOffset = m_nodes.at_offset(m_medianOffset).prevOffset;
-                    m_medianPos -= 1;
-                }
+        for (; count > 0; --count) {
+            const position_t offset = m_nodes.front_offset();
+            unlink_links(m_nodes.at_offset_unchecked(offset));
+            m_size -= 1;
+            stats_remove(item_at(offset), m_size);
+            unlink_cursor(offset, m_medianOffset, m_medianPos);
+            for (auto& cursor : m_quantiles) {
+                unlink_cursor(offset, cursor.offset, cursor.pos);
             }
+            m_nodes.discard_front();
+            m_items.discard_front();
         }
-        m_size -= 1;
-        return std::move(m_nodes.pop_front().item);
+        update_median_pos();
+        update_quantiles_pos();
     }
-    item_t&& pop_back() {
+    item_t pop_back() {
         if (m_nodes.empty() || m_size == 0) {
             throw std::logic_error("m_nodes.empty()");
         }
-        else if (m_size == 1) {
-            m_size = 0;
-            m_minOffset = position_max;
-            m_maxOffset = position_max;
-            m_medianOffset = position_max;
-            m_medianPos = position_max;
-            return std::move(m_nodes.pop_back().item);
-        }
-        auto& to_remove = m_nodes.back();
-        //m_sum -= to_remove.value;
-        if (to_remove.prevOffset != position_max) {
-            m_nodes.at_offset(to_remove.prevOffset).nextOffset = to_remove.nextOffset;
-        }
-        else { // extreme
-            m_minOffset = to_remove.nextOffset;
-        }
-        if (to_remove.nextOffset != position_max) {
-            m_nodes.at_offset(to_remove.nextOffset).prevOffset = to_remove.prevOffset;
-        }
-        else { // extreme
-            m_maxOffset = to_remove.prevOffset;
-        }
-
-        //                5->L        4->R      3->L      2->R      offset
-        // F MR B   123M45(-3L)->12M45(-2)->14M5(-4L)->1M5(-1)->5M  pos
-        if (m_medianOffset == m_nodes.back_offset()) { // MR
-            if (m_size & 1) {
-                m_medianOffset = to_remove.prevOffset;
-                m_medianPos -= 1;
-            }
-            else {
-                m_medianOffset = to_remove.nextOffset;
-            }
-        }
-        else {
-            int8_t cmp = m_comparator(to_remove.item,
-                m_nodes.at_offset(m_medianOffset).item);
-            const node* caret_left = &to_remove;
-            const node* caret_right = &to_remove;
-            while (cmp == 0) {
-                // M <-CL R CR-> M
-                if (m_medianOffset == caret_left->prevOffset) { // BR
-                    cmp = 1;
-                    break;
-                }
-                if (caret_right->nextOffset == m_medianOffset) { // FR
-                    cmp = -1;
-                    break;
-                }
-                if (caret_left->prevOffset != position_max) {
-                    caret_left = &m_nodes.at_offset(caret_left->prevOffset);
-                }
-                if (caret_right->nextOffset != position_max) {
-                    caret_right = &m_nodes.at_offset(caret_right->nextOffset);
-                }
-            }
-            //                5->         4->R      3->       2->R      offset
-            // FR M B   123M45(-2L)->13M45(-1)->34M5(-3L)->4M5(-4)->5M  pos
-            if (cmp < 0) {
-                if (m_size & 1) {
-                    m_medianPos -= 1;
-                }
-                else {
-                    m_medianOffset = m_nodes.at_offset(m_medianOffset).nextOffset;
-                }
-            }
-            //                5->L        4->       3->L      2->       offset
-            // F M BR   123M45(-4L)->12M35(-3)->12M5(-5L)->1M2(-2)->1M  pos
-            else {
-                if (m_size & 1) {
-                    m_medianOffset = m_nodes.at_offset(m_medianOffset).prevOffset;
-                    m_medianPos -= 1;
-                }
-            }
-        }
-        m_size -= 1;
-        return std::move(m_nodes.pop_back().item);
+        unlink_node(m_nodes.back_offset());
+        return pop_back_item(split_tag());
     }
-    
+
     item_t& min() const {
         if (m_minOffset == position_max) {
             throw std::logic_error("m_min == position_max");
         }
         else {
-            return m_nodes.at_offset(m_minOffset).item;
+            return item_at(m_minOffset);
         }
     }
     item_t& median() const {
@@ -391,7 +729,7 @@ public:
             throw std::logic_error("m_middle == position_max");
         }
         else {
-            return m_nodes.at_offset(m_medianOffset).item;
+            return item_at(m_medianOffset);
         }
     }
     item_t& max() const {
@@ -399,12 +737,81 @@ public:
             throw std::logic_error("m_max == position_max");
         }
         else {
-            return m_nodes.at_offset(m_maxOffset).item;
+            return item_at(m_maxOffset);
+        }
+    }
+    // Quantile cursors are kept like the median, O(1) amortized per push/pop each.
+    // The cursor of fraction q points to the item at position floor(q * (size() - 1)),
+    // so q = 0.5 is the median, 0 is the min and 1 is the max.
+    position_t add_quantile(const double fraction) {
+        if (!(fraction >= 0.0 && fraction <= 1.0)) {
+            throw std::invalid_argument("fraction is out of [0, 1]");
+        }
+        quantile_cursor cursor;
+        cursor.scale = static_cast<uint64_t>(std::ceil(fraction * 4294967296.0));
+        m_quantiles.push_back(cursor);
+        place_quantiles();
+        return static_cast<position_t>(m_quantiles.size() - 1);
+    }
+    void set_quantiles(const std::vector<double>& fractions) {
+        clear_quantiles();
+        for (const double fraction : fractions) {
+            add_quantile(fraction);
+        }
+    }
+    void clear_quantiles() {
+        m_quantiles.clear();
+    }
+    position_t quantiles_count() const {
+        return static_cast<position_t>(m_quantiles.size());
+    }
+    item_t& quantile(const position_t index) const {
+        const position_t offset = m_quantiles.at(index).offset;
+        if (offset == position_max) {
+            throw std::logic_error("quantile offset == position_max");
+        }
+        return item_at(offset);
+    }
+    // Order statistics: O(log n) in the indexed mode (skip_levels > 0), otherwise
+    // a walk from the nearest of the min, median, max and quantile cursors.
+    // nth(0) is the min, nth(size() - 1) is the max.
+    item_t& nth(const position_t rank) const {
+        return item_at(offset_of_rank(rank));
+    }
+    // The number of items less than the item.
+    position_t count_less(const item_t& item) const {
+        return count_before(item, 1, indexed_tag());
+    }
+    // The number of items not greater than the item, that is the rank
+    // a pushed copy of the item would get.
+    position_t rank_of(const item_t& item) const {
+        return count_before(item, 0, indexed_tag());
+    }
+
+    // Running stats of the window values, arithmetic value_t only.
+    // Integral values are summed exactly in 64 bits, floating ones with Neumaier
+    // compensation. variance() is the population variance kept by Welford's update.
+    sum_type sum() const {
+        static_assert(stats_enabled, "sum() requires an arithmetic value_t");
+        return m_stats.sum_value();
+    }
+    stat_type mean() const {
+        static_assert(stats_enabled, "mean() requires an arithmetic value_t");
+        if (m_size == 0) {
+            throw std::logic_error("m_size == 0");
+        }
+        return static_cast<stat_type>(m_stats.sum_value()) / static_cast<stat_type>(m_size);
+    }
+    stat_type variance() const {
+        static_assert(stats_enabled, "variance() requires an arithmetic value_t");
+        if (m_size == 0) {
+            throw std::logic_error("m_size == 0");
         }
+        return m_stats.m2 / static_cast<stat_type>(m_size);
+    }
+    stat_type stddev() const {
+        return std::sqrt(variance());
     }
-    //value_t average() const {
-    //    return m_sum / static_cast<value_t>(m_nodes.size());
-    //}
     position_t size() const {
         return m_size;
     }
@@ -414,29 +821,36 @@ public:
     bool empty() const {
         return m_size == 0;
     }
+    allocator_t get_allocator() const {
+        return allocator_t(m_nodes.get_allocator());
+    }
 
     // BidirectionalIterator
     class iterator {
     public:
         using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = item_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = item_t*;
+        using reference = item_t&;
 
         iterator() {}
-        iterator(const position_t nodeIdx, sorted_flat_deque<item_t, value_t>* ptr) {
+        iterator(const position_t nodeIdx, sorted_flat_deque* ptr) {
             assign(nodeIdx, ptr);
         }
-        void assign(const position_t nodeIdx, sorted_flat_deque<item_t, value_t>* ptr) {
+        void assign(const position_t nodeIdx, sorted_flat_deque* ptr) {
             m_nodeIdx = nodeIdx;
             m_ptr = ptr;
         }
         //TODO: make this iterator compatible with std::make_move_iterator
         item_t&& extract() {
-            return std::move(m_ptr->m_nodes.at_offset(m_nodeIdx).item);
+            return std::move(m_ptr->item_at_checked(m_nodeIdx));
         }
         item_t& operator*() const {
-            return m_ptr->m_nodes.at_offset(m_nodeIdx).item;
+            return m_ptr->item_at_checked(m_nodeIdx);
         }
         item_t* operator->() const {
-            return &m_ptr->m_nodes.at_offset(m_nodeIdx).item;
+            return &m_ptr->item_at_checked(m_nodeIdx);
         }
         bool operator==(const iterator& other) const {
             return (m_nodeIdx == other.m_nodeIdx) && (m_ptr == other.m_ptr);
@@ -449,7 +863,7 @@ public:
             if (m_nodeIdx == position_max) {
                 throw std::logic_error("m_nodeIdx == position_max");
             }
-            m_nodeIdx = m_ptr->m_nodes.at_offset(m_nodeIdx).nextOffset;
+            m_nodeIdx = m_ptr->m_nodes.at_offset_unchecked(m_nodeIdx).nextOffset;
             return *this;
         }
         iterator operator++(int) { // Postfix increment
@@ -466,10 +880,10 @@ public:
                 m_nodeIdx = m_ptr->m_maxOffset;
                 return *this;
             }
-            if (m_ptr->m_nodes.at_offset(m_nodeIdx).prevOffset == position_max) {
+            if (m_ptr->m_nodes.at_offset_unchecked(m_nodeIdx).prevOffset == position_max) {
                 throw std::logic_error("prevOffset == position_max");
             }
-            m_nodeIdx = m_ptr->m_nodes.at_offset(m_nodeIdx).prevOffset;
+            m_nodeIdx = m_ptr->m_nodes.at_offset_unchecked(m_nodeIdx).prevOffset;
             return *this;
         }
         iterator operator--(int) { // Postfix decrement
@@ -481,6 +895,9 @@ public:
         position_t offset() const {
             return m_nodeIdx;
         }
+        operator const_iterator() const {
+            return const_iterator(m_nodeIdx, m_ptr);
+        }
 
         //TODO:
         // it  < it  -> ?
@@ -504,27 +921,31 @@ public:
         // end >= end -> true
         //bool operator>=(const iterator& other) const;
     private:
-        sorted_flat_deque<item_t, value_t>* m_ptr = nullptr;
+        sorted_flat_deque* m_ptr = nullptr;
         position_t m_nodeIdx = position_max;
     };
     // BidirectionalIterator
     class const_iterator {
     public:
         using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = item_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const item_t*;
+        using reference = const item_t&;
 
         const_iterator() {}
-        const_iterator(const position_t nodeIdx, const sorted_flat_deque<item_t, value_t>* ptr) {
+        const_iterator(const position_t nodeIdx, const sorted_flat_deque* ptr) {
             assign(nodeIdx, ptr);
         }
-        void assign(const position_t nodeIdx, const sorted_flat_deque<item_t, value_t>* ptr) {
+        void assign(const position_t nodeIdx, const sorted_flat_deque* ptr) {
             m_nodeIdx = nodeIdx;
             m_ptr = ptr;
         }
         const item_t& operator*() const {
-            return m_ptr->m_nodes.at_offset(m_nodeIdx).item;
+            return m_ptr->item_at_checked(m_nodeIdx);
         }
         const item_t* operator->() const {
-            return &m_ptr->m_nodes.at_offset(m_nodeIdx).item;
+            return &m_ptr->item_at_checked(m_nodeIdx);
         }
         bool operator==(const const_iterator& other) const {
             return (m_nodeIdx == other.m_nodeIdx) && (m_ptr == other.m_ptr);
@@ -537,7 +958,7 @@ public:
             if (m_nodeIdx == position_max) {
                 throw std::logic_error("m_nodeIdx == position_max");
             }
-            m_nodeIdx = m_ptr->m_nodes.at_offset(m_nodeIdx).nextOffset;
+            m_nodeIdx = m_ptr->m_nodes.at_offset_unchecked(m_nodeIdx).nextOffset;
             return *this;
         }
         const_iterator operator++(int) { // Postfix increment
@@ -554,10 +975,10 @@ public:
                 m_nodeIdx = m_ptr->m_maxOffset;
                 return *this;
             }
-            if (m_ptr->m_nodes.at_offset(m_nodeIdx).prevOffset == position_max) {
+            if (m_ptr->m_nodes.at_offset_unchecked(m_nodeIdx).prevOffset == position_max) {
                 throw std::logic_error("prevOffset == position_max");
             }
-            m_nodeIdx = m_ptr->m_nodes.at_offset(m_nodeIdx).prevOffset;
+            m_nodeIdx = m_ptr->m_nodes.at_offset_unchecked(m_nodeIdx).prevOffset;
             return *this;
         }
         const_iterator operator--(int) { // Postfix decrement
@@ -570,138 +991,388 @@ public:
             return m_nodeIdx;
         }
     private:
-        const sorted_flat_deque<item_t, value_t>* m_ptr = nullptr;
+        const sorted_flat_deque* m_ptr = nullptr;
         position_t m_nodeIdx = position_max;
     };
-    //class reverse_iterator {
-    //    //TODO: reverse_iterator
-    //    //std::reverse_iterator<iterator>
-    //};
-    //class const_reverse_iterator {
-    //    //TODO: const_reverse_iterator
-    //    //std::reverse_iterator<const_iterator>
-    //};
-
-    iterator begin() {
-        return iterator(m_minOffset, this);
-    }
-    iterator median_it() {
-        return iterator(m_medianOffset, this);
-    }
-    iterator end() {
-        return iterator(position_max, this);
-    }
-    const_iterator begin() const {
-        return const_iterator(m_minOffset, this);
-    }
-    const_iterator median_it() const {
-        return const_iterator(m_medianOffset, this);
-    }
-    const_iterator end() const {
-        return const_iterator(position_max, this);
-    }
-    const_iterator cbegin() const {
-        return const_iterator(m_minOffset, this);
-    }
-    const_iterator cmedian_it() const {
-        return const_iterator(m_medianOffset, this);
-    }
-    const_iterator cend() const {
-        return const_iterator(position_max, this);
-    }
+    // RandomAccessIterator over the ranks, jumps are nth() lookups.
+    class const_rank_iterator {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = item_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const item_t*;
+        using reference = const item_t&;
 
-private:
-    template <typename ItemT>
-    void push_back_impl(ItemT item) {
-        if (max_size() == 0) {
-            return;
+        const_rank_iterator() {}
+        const_rank_iterator(const position_t rank, const position_t nodeIdx,
+                const sorted_flat_deque* ptr) {
+            assign(rank, nodeIdx, ptr);
+        }
+        void assign(const position_t rank, const position_t nodeIdx,
+                const sorted_flat_deque* ptr) {
+            m_rank = rank;
+            m_nodeIdx = nodeIdx;
+            m_ptr = ptr;
         }
-        //m_sum += m_accessor(value);
-        while (size() >= max_size()) {
-            pop_front();
+        const item_t& operator*() const {
+            return m_ptr->item_at_checked(m_nodeIdx);
+        }
+        const item_t* operator->() const {
+            return &m_ptr->item_at_checked(m_nodeIdx);
+        }
+        const item_t& operator[](const difference_type offset) const {
+            return *(*this + offset);
+        }
+        bool operator==(const const_rank_iterator& other) const {
+            return (m_rank == other.m_rank) && (m_ptr == other.m_ptr);
+        }
+        bool operator!=(const const_rank_iterator& other) const {
+            return (m_rank != other.m_rank) || (m_ptr != other.m_ptr);
+        }
+        bool operator<(const const_rank_iterator& other) const {
+            return m_rank < other.m_rank;
+        }
+        bool operator<=(const const_rank_iterator& other) const {
+            return m_rank <= other.m_rank;
+        }
+        bool operator>(const const_rank_iterator& other) const {
+            return m_rank > other.m_rank;
+        }
+        bool operator>=(const const_rank_iterator& other) const {
+            return m_rank >= other.m_rank;
         }
-        m_nodes.push_back(node());
 
-        auto& back = m_nodes.back();
-        const auto back_offset = m_nodes.back_offset();
-        if (m_medianOffset == position_max) {
-            back.nextOffset = position_max;
-            back.prevOffset = position_max;
-            //back.value = m_accessor(value);
-            back.item = std::move(item);
+        const_rank_iterator& operator++() { // Prefix increment
+            if (m_nodeIdx == position_max) {
+                throw std::logic_error("m_nodeIdx == position_max");
+            }
+            m_nodeIdx = m_ptr->m_nodes.at_offset_unchecked(m_nodeIdx).nextOffset;
+            m_rank += 1;
+            return *this;
+        }
+        const_rank_iterator operator++(int) { // Postfix increment
+            const_rank_iterator temp = *this;
+            this->operator++();
+            return temp;
+        }
+        const_rank_iterator& operator--() { // Prefix decrement
+            if (m_rank == 0) {
+                throw std::logic_error("m_rank == 0");
+            }
+            m_nodeIdx = m_nodeIdx == position_max
+                ? m_ptr->m_maxOffset
+                : m_ptr->m_nodes.at_offset_unchecked(m_nodeIdx).prevOffset;
+            m_rank -= 1;
+            return *this;
+        }
+        const_rank_iterator operator--(int) { // Postfix decrement
+            const_rank_iterator temp = *this;
+            this->operator--();
+            return temp;
+        }
+        const_rank_iterator& operator+=(const difference_type offset) {
+            m_rank = static_cast<position_t>(static_cast<difference_type>(m_rank) + offset);
+            m_nodeIdx = m_rank >= m_ptr->m_size
+                ? position_max
+                : m_ptr->offset_of_rank(m_rank);
+            return *this;
+        }
+        const_rank_iterator& operator-=(const difference_type offset) {
+            return this->operator+=(-offset);
+        }
+        const_rank_iterator operator+(const difference_type offset) const {
+            const_rank_iterator temp = *this;
+            return temp += offset;
+        }
+        const_rank_iterator operator-(const difference_type offset) const {
+            const_rank_iterator temp = *this;
+            return temp -= offset;
+        }
+        difference_type operator-(const const_rank_iterator& other) const {
+            return static_cast<difference_type>(m_rank)
+                - static_cast<difference_type>(other.m_rank);
+        }
 
-            m_size = 1;
-            m_minOffset = back_offset;
-            m_maxOffset = back_offset;
-            m_medianOffset = back_offset;
-            m_medianPos = 0;
-            return;
+        position_t rank() const {
+            return m_rank;
+        }
+        position_t offset() const {
+            return m_nodeIdx;
         }
+    private:
+        const sorted_flat_deque* m_ptr = nullptr;
+        position_t m_rank = 0;
+        position_t m_nodeIdx = position_max;
+    };
+    //class reverse_iterator {
+    //    //TODO: reverse_iterator
+    //    //std::reverse_iterator<iterator>
+    //};
+    //class const_reverse_iterator {
+    //    //TODO: const_reverse_iterator
+    //    //std::reverse_iterator<const_iterator>
+    //};
 
-        // O OM
-        // O N OM
-        if (m_comparator(item, m_nodes.at_offset(m_medianOffset).item) < 0) { // <
-            node* carriage = &m_nodes.at_offset(m_medianOffset);
-            m_medianPos += 1;
-            while (true) {
-                if (m_comparator(item, carriage->item) >= 0) { // >=
-                    back.nextOffset = carriage->nextOffset;
-                    back.prevOffset = carriage->idx(this);
-                    //back.value = m_accessor(value);
-                    back.item = std::move(item);
+    iterator begin() {
+        return iterator(m_minOffset, this);
+    }
+    iterator median_it() {
+        return iterator(m_medianOffset, this);
+    }
+    iterator end() {
+        return iterator(position_max, this);
+    }
+    const_iterator begin() const {
+        return const_iterator(m_minOffset, this);
+    }
+    const_iterator median_it() const {
+        return const_iterator(m_medianOffset, this);
+    }
+    const_iterator end() const {
+        return const_iterator(position_max, this);
+    }
+    const_iterator cbegin() const {
+        return const_iterator(m_minOffset, this);
+    }
+    const_iterator cmedian_it() const {
+        return const_iterator(m_medianOffset, this);
+    }
+    iterator quantile_it(const position_t index) {
+        return iterator(m_quantiles.at(index).offset, this);
+    }
+    const_iterator quantile_it(const position_t index) const {
+        return const_iterator(m_quantiles.at(index).offset, this);
+    }
+    const_iterator cquantile_it(const position_t index) const {
+        return const_iterator(m_quantiles.at(index).offset, this);
+    }
+    iterator nth_it(const position_t rank) {
+        return iterator(offset_of_rank(rank), this);
+    }
+    const_iterator nth_it(const position_t rank) const {
+        return const_iterator(offset_of_rank(rank), this);
+    }
+    const_rank_iterator rank_begin() const {
+        return const_rank_iterator(0, m_minOffset, this);
+    }
+    const_rank_iterator rank_end() const {
+        return const_rank_iterator(m_size, position_max, this);
+    }
+    const_iterator cend() const {
+        return const_iterator(position_max, this);
+    }
 
-                    carriage->nextOffset = back_offset;
-                    m_nodes.at_offset(back.nextOffset).prevOffset = back_offset;
+private:
+    // An empty three_way_function falls back to three_way_less.
+    static void set_default_comparator(three_way_function<item_t>& comparator) {
+        if (!comparator) {
+            comparator = three_way_less<item_t>();
+        }
+    }
+    template <typename Compare>
+    static void set_default_comparator(Compare&) {
+    }
 
-                    m_size += 1;
-                    break;
-                }
-                else if (carriage->prevOffset == position_max) { // left
-                    carriage->prevOffset = back_offset;
-                    back.nextOffset = carriage->idx(this);
-                    back.prevOffset = position_max;
-                    //back.value = m_accessor(value);
-                    back.item = std::move(item);
-
-                    m_size += 1;
-                    m_minOffset = back_offset;
-                    break;
+    using indexed_tag = std::integral_constant<bool, (skip_levels > 0)>;
+    using split_tag = std::integral_constant<bool, split_items>;
+
+    // The item of a linked node, offset < capacity() is on the caller.
+    item_t& item_at(const position_t offset) const {
+        return item_at(offset, split_tag());
+    }
+    item_t& item_at(const position_t offset, std::false_type) const {
+        return m_nodes.at_offset_unchecked(offset).item;
+    }
+    item_t& item_at(const position_t offset, std::true_type) const {
+        return m_items.at_offset_unchecked(offset);
+    }
+    // For the iterators, front() and back(), throws std::out_of_range as at_offset().
+    item_t& item_at_checked(const position_t offset) const {
+        return item_at_checked(offset, split_tag());
+    }
+    item_t& item_at_checked(const position_t offset, std::false_type) const {
+        return m_nodes.at_offset(offset).item;
+    }
+    item_t& item_at_checked(const position_t offset, std::true_type) const {
+        return m_items.at_offset(offset);
+    }
+    // Both buffers are pushed and popped together, so they keep the same offsets.
+    template <typename ItemT>
+    void push_node_back(ItemT&& item, std::false_type) {
+        m_nodes.push_back(node());
+        m_nodes.back().item = std::forward<ItemT>(item);
+    }
+    template <typename ItemT>
+    void push_node_back(ItemT&& item, std::true_type) {
+        m_items.push_back(std::forward<ItemT>(item));
+        m_nodes.push_back(node());
+    }
+    template <typename ItemT>
+    void push_node_front(ItemT&& item, std::false_type) {
+        m_nodes.push_front(node());
+        m_nodes.front().item = std::forward<ItemT>(item);
+    }
+    template <typename ItemT>
+    void push_node_front(ItemT&& item, std::true_type) {
+        m_items.push_front(std::forward<ItemT>(item));
+        m_nodes.push_front(node());
+    }
+    item_t pop_front_item(std::false_type) {
+        return std::move(m_nodes.pop_front().item);
+    }
+    item_t pop_front_item(std::true_type) {
+        m_nodes.discard_front();
+        return m_items.pop_front();
+    }
+    item_t pop_back_item(std::false_type) {
+        return std::move(m_nodes.pop_back().item);
+    }
+    item_t pop_back_item(std::true_type) {
+        m_nodes.discard_back();
+        return m_items.pop_back();
+    }
+
+    // Without a hint, the finger is the previous back item, next to the new one
+    // in a trending series.
+    template <typename ItemT>
+    void push_back_impl(ItemT item, position_t finger) {
+        if (max_size() == 0) {
+            return;
+        }
+        if (finger == position_max && !m_nodes.empty()) {
+            finger = m_nodes.back_offset();
+        }
+        if (size() >= max_size()) {
+            replace_oldest(std::move(item), finger, indexed_tag());
+            return;
+        }
+        push_node_back(std::move(item), split_tag());
+        link_node(m_nodes.back_offset(), finger);
+    }
+    // The express lanes already find the place in O(log n).
+    template <typename ItemT>
+    void replace_oldest(ItemT item, const position_t, std::true_type) {
+        unlink_node(m_nodes.front_offset());
+        m_nodes.discard_front();
+        m_items.discard_front();
+        push_node_back(std::move(item), split_tag());
+        link_node(m_nodes.back_offset(), position_max);
+    }
+    // Evicts the front and links the item in one pass, the size stays the same and so do
+    // the desired cursor positions. When the evicted node is between nearest_start() and
+    // the place of the item (a periodic series), the walk starts from the evicted node:
+    // a cursor passed by the walk changes its pos by one and takes a single step at most,
+    // ties need no side_of() scan. Otherwise the walk starts from nearest_start().
+    template <typename ItemT>
+    void replace_oldest(ItemT item, position_t finger, std::false_type) {
+        const position_t evictedOffset = m_nodes.front_offset();
+        const node& evicted = m_nodes.at_offset_unchecked(evictedOffset);
+        const bool toLeft = m_comparator(item, item_at(m_medianOffset)) < 0;
+        if (finger == evictedOffset) {
+            finger = position_max;
+        }
+        bool walkLeft;
+        const position_t start = nearest_start(item, toLeft, finger, walkLeft, std::false_type());
+        const bool walkRight = m_comparator(item, item_at(evictedOffset)) >= 0;
+        const bool fromEvicted = start == evictedOffset || (walkLeft
+            ? !walkRight && m_comparator(item_at(evictedOffset), item_at(start)) <= 0
+            : walkRight && m_comparator(item_at(evictedOffset), item_at(start)) >= 0);
+        stats_remove(item_at(evictedOffset), m_size - 1);
+        if (!fromEvicted) {
+            unlink_links(m_nodes.at_offset_unchecked(evictedOffset));
+            const position_t medianOffset = m_medianOffset;
+            unlink_cursor(evictedOffset, m_medianOffset, m_medianPos);
+            for (auto& cursor : m_quantiles) {
+                unlink_cursor(evictedOffset, cursor.offset, cursor.pos);
+            }
+            m_nodes.discard_front();
+            m_items.discard_front();
+            push_node_back(std::move(item), split_tag());
+            const position_t offset = m_nodes.back_offset();
+            stats_add(item_at(offset), m_size);
+            if (m_medianOffset == medianOffset
+                    ? toLeft : m_comparator(item_at(offset), item_at(m_medianOffset)) < 0) {
+                m_medianPos += 1;
+            }
+            for (auto& cursor : m_quantiles) {
+                if (m_comparator(item_at(offset), item_at(cursor.offset)) < 0) {
+                    cursor.pos += 1;
                 }
-                carriage = &m_nodes.at_offset(carriage->prevOffset);
             }
+            link_sorted(m_nodes.at_offset_unchecked(offset), offset, start, walkLeft,
+                std::false_type());
+            update_median_pos();
+            update_quantiles_pos();
+            return;
         }
-        // OM O
-        // OM N O
-        else {
-            node* carriage = &m_nodes.at_offset(m_medianOffset);
-            while (true) {
-                if (m_comparator(item, carriage->item) < 0) { // <
-                    back.nextOffset = carriage->idx(this);
-                    back.prevOffset = carriage->prevOffset;
-                    //back.value = m_accessor(value);
-                    back.item = std::move(item);
-
-                    carriage->prevOffset = back_offset;
-                    m_nodes.at_offset(back.prevOffset).nextOffset = back_offset;
 
-                    m_size += 1;
-                    break;
-                }
-                if (carriage->nextOffset == position_max) { // right
-                    carriage->nextOffset = m_nodes.back_offset();
-                    back.nextOffset = position_max;
-                    back.prevOffset = carriage->idx(this);
-                    //back.value = m_accessor(value);
-                    back.item = std::move(item);
-
-                    m_size += 1;
-                    m_maxOffset = back_offset;
-                    break;
+        // The neighbours of the new node, the evicted one excluded.
+        position_t prevOffset = evicted.prevOffset;
+        position_t nextOffset = evicted.nextOffset;
+        position_t firstPassed = position_max;
+        const position_t step = walkRight ? position_t(-1) : position_t(1);
+        while (true) {
+            const position_t carriageOffset = walkRight ? nextOffset : prevOffset;
+            if (carriageOffset == position_max
+                    || (m_comparator(item, item_at(carriageOffset)) < 0) != !walkRight) {
+                break;
+            }
+            if (firstPassed == position_max) {
+                firstPassed = carriageOffset;
+            }
+            if (carriageOffset == m_medianOffset) {
+                m_medianPos += step;
+            }
+            for (auto& cursor : m_quantiles) {
+                if (cursor.offset == carriageOffset) {
+                    cursor.pos += step;
                 }
-                carriage = &m_nodes.at_offset(carriage->nextOffset);
+            }
+            const node& carriage = m_nodes.at_offset_unchecked(carriageOffset);
+            if (walkRight) {
+                prevOffset = carriageOffset;
+                nextOffset = carriage.nextOffset;
+            }
+            else {
+                nextOffset = carriageOffset;
+                prevOffset = carriage.prevOffset;
+            }
+        }
+        unlink_links(m_nodes.at_offset_unchecked(evictedOffset));
+        m_nodes.discard_front();
+        m_items.discard_front();
+        push_node_back(std::move(item), split_tag());
+        const position_t offset = m_nodes.back_offset();
+        stats_add(item_at(offset), m_size);
+
+        node& inserted = m_nodes.at_offset_unchecked(offset);
+        inserted.prevOffset = prevOffset;
+        inserted.nextOffset = nextOffset;
+        if (prevOffset != position_max) {
+            m_nodes.at_offset_unchecked(prevOffset).nextOffset = offset;
+        }
+        else {
+            m_minOffset = offset;
+        }
+        if (nextOffset != position_max) {
+            m_nodes.at_offset_unchecked(nextOffset).prevOffset = offset;
+        }
+        else {
+            m_maxOffset = offset;
+        }
+        // A cursor on the evicted node keeps its pos, the node of that rank is now
+        // the first passed one or the new one.
+        const position_t replacement = firstPassed != position_max ? firstPassed : offset;
+        if (m_medianOffset == evictedOffset) {
+            m_medianOffset = replacement;
+        }
+        for (auto& cursor : m_quantiles) {
+            if (cursor.offset == evictedOffset) {
+                cursor.offset = replacement;
             }
         }
         update_median_pos();
+        update_quantiles_pos();
     }
     template <typename ItemT>
     void push_front_impl(ItemT item) {
@@ -709,107 +1380,1104 @@ private:
             return;
         }
         while (size() >= max_size()) {
-            pop_back();
+            unlink_node(m_nodes.back_offset());
+            m_nodes.discard_back();
+            m_items.discard_back();
         }
-        m_nodes.push_front(node());
+        const position_t finger = m_nodes.empty() ? position_max : m_nodes.front_offset();
+        push_node_front(std::move(item), split_tag());
+        link_node(m_nodes.front_offset(), finger);
+    }
 
-        auto& front = m_nodes.front();
-        const auto front_offset = m_nodes.front_offset();
+    void link_node(const position_t offset, const position_t finger) {
+        node& inserted = m_nodes.at_offset_unchecked(offset);
+        const item_t& item = item_at(offset);
+        stats_add(item, m_size + 1);
         if (m_medianOffset == position_max) {
-            front.nextOffset = position_max;
-            front.prevOffset = position_max;
-            front.item = std::move(item);
+            inserted.nextOffset = position_max;
+            inserted.prevOffset = position_max;
 
             m_size = 1;
-            m_minOffset = front_offset;
-            m_maxOffset = front_offset;
-            m_medianOffset = front_offset;
+            m_minOffset = offset;
+            m_maxOffset = offset;
+            m_medianOffset = offset;
             m_medianPos = 0;
+            link_first_express(inserted, offset, indexed_tag());
+            for (auto& cursor : m_quantiles) {
+                cursor.offset = offset;
+                cursor.pos = 0;
+            }
             return;
         }
-
+        const bool toLeft = m_comparator(item, item_at(m_medianOffset)) < 0;
+        if (toLeft) {
+            m_medianPos += 1;
+        }
+        for (auto& cursor : m_quantiles) {
+            if (m_comparator(item, item_at(cursor.offset)) < 0) {
+                cursor.pos += 1;
+            }
+        }
+        bool walkLeft;
+        const position_t start = nearest_start(item, toLeft, finger, walkLeft, indexed_tag());
+        link_sorted(inserted, offset, start, walkLeft, indexed_tag());
+        m_size += 1;
+        update_median_pos();
+        update_quantiles_pos();
+    }
+    // The start of the linear walk. The known ranks (min, median, quantile cursors, max)
+    // bracket the place of the item: lower is the last one not greater than the item,
+    // upper the first greater one. The finger's rank is unknown, it is taken when it is
+    // inside the bracket, as the previous item of a trending series is. Then the walk
+    // goes right from lower or the finger, or left from upper or the finger.
+    // A monotonic series starts from the max or the min, O(1).
+    position_t nearest_start(const item_t& item, const bool toLeft, const position_t finger,
+            bool& walkLeft, std::false_type) const {
+        position_t lower = m_minOffset;
+        position_t lowerPos = 0;
+        position_t upper = m_maxOffset;
+        position_t upperPos = m_size - 1;
+        if (toLeft) {
+            if (m_comparator(item, item_at(m_minOffset)) < 0) {
+                walkLeft = true;
+                return m_minOffset;
+            }
+            upper = m_medianOffset;
+            upperPos = m_medianPos;
+        }
+        else {
+            if (m_comparator(item, item_at(m_maxOffset)) >= 0) {
+                walkLeft = false;
+                return m_maxOffset;
+            }
+            lower = m_medianOffset;
+            lowerPos = m_medianPos;
+        }
+        for (const auto& cursor : m_quantiles) {
+            if (cursor.pos <= lowerPos || cursor.pos >= upperPos) {
+                continue;
+            }
+            if (m_comparator(item, item_at(cursor.offset)) >= 0) {
+                lower = cursor.offset;
+                lowerPos = cursor.pos;
+            }
+            else {
+                upper = cursor.offset;
+                upperPos = cursor.pos;
+            }
+        }
+        if (finger != position_max) {
+            if (m_comparator(item, item_at(finger)) >= 0) {
+                if (m_comparator(item_at(finger), item_at(lower)) >= 0) {
+                    walkLeft = false;
+                    return finger;
+                }
+            }
+            else if (m_comparator(item_at(finger), item_at(upper)) <= 0) {
+                walkLeft = true;
+                return finger;
+            }
+        }
+        // Away from the median, as the walk from the median would go.
+        walkLeft = toLeft;
+        return toLeft ? upper : lower;
+    }
+    position_t nearest_start(const item_t&, const bool toLeft, const position_t, bool& walkLeft,
+            std::true_type) const {
+        walkLeft = toLeft;
+        return m_medianOffset;
+    }
+    // Linear walk from the start, which is greater than the item (toLeft)
+    // or not greater than it.
+    void link_sorted(node& inserted, const position_t offset, const position_t start,
+            const bool toLeft, std::false_type) {
         // O OM
         // O N OM
-        if (m_comparator(item, m_nodes.at_offset(m_medianOffset).item) < 0) { // <
-            node* carriage = &m_nodes.at_offset(m_medianOffset);
-            m_medianPos += 1;
+        const item_t& item = item_at(offset);
+        position_t carriageOffset = start;
+        if (toLeft) { // <
             while (true) {
-                if (m_comparator(item, carriage->item) >= 0) { // >=
-                    front.nextOffset = carriage->nextOffset;
-                    front.prevOffset = carriage->idx(this);
-                    //back.value = m_accessor(value);
-                    front.item = std::move(item);
-
-                    carriage->nextOffset = front_offset;
-                    m_nodes.at_offset(front.nextOffset).prevOffset = front_offset;
+                node& carriage = m_nodes.at_offset_unchecked(carriageOffset);
+                if (m_comparator(item, item_at(carriageOffset)) >= 0) { // >=
+                    inserted.nextOffset = carriage.nextOffset;
+                    inserted.prevOffset = carriageOffset;
 
-                    m_size += 1;
+                    carriage.nextOffset = offset;
+                    m_nodes.at_offset_unchecked(inserted.nextOffset).prevOffset = offset;
                     break;
                 }
-                else if (carriage->prevOffset == position_max) { // left
-                    carriage->prevOffset = front_offset;
-                    front.nextOffset = carriage->idx(this);
-                    front.prevOffset = position_max;
-                    //back.value = m_accessor(value);
-                    front.item = std::move(item);
-
-                    m_size += 1;
-                    m_minOffset = front_offset;
+                else if (carriage.prevOffset == position_max) { // left
+                    carriage.prevOffset = offset;
+                    inserted.nextOffset = carriageOffset;
+                    inserted.prevOffset = position_max;
+
+                    m_minOffset = offset;
                     break;
                 }
-                carriage = &m_nodes.at_offset(carriage->prevOffset);
+                carriageOffset = carriage.prevOffset;
             }
         }
         // OM O
         // OM N O
         else {
-            node* carriage = &m_nodes.at_offset(m_medianOffset);
             while (true) {
-                if (m_comparator(item, carriage->item) < 0) { // <
-                    front.nextOffset = carriage->idx(this);
-                    front.prevOffset = carriage->prevOffset;
-                    //back.value = m_accessor(value);
-                    front.item = std::move(item);
-
-                    carriage->prevOffset = front_offset;
-                    m_nodes.at_offset(front.prevOffset).nextOffset = front_offset;
+                node& carriage = m_nodes.at_offset_unchecked(carriageOffset);
+                if (m_comparator(item, item_at(carriageOffset)) < 0) { // <
+                    inserted.nextOffset = carriageOffset;
+                    inserted.prevOffset = carriage.prevOffset;
 
-                    m_size += 1;
+                    carriage.prevOffset = offset;
+                    m_nodes.at_offset_unchecked(inserted.prevOffset).nextOffset = offset;
                     break;
                 }
-                if (carriage->nextOffset == position_max) { // right
-                    carriage->nextOffset = m_nodes.front_offset();
-                    front.nextOffset = position_max;
-                    front.prevOffset = carriage->idx(this);
-                    //back.value = m_accessor(value);
-                    front.item = std::move(item);
-
-                    m_size += 1;
-                    m_maxOffset = front_offset;
+                if (carriage.nextOffset == position_max) { // right
+                    carriage.nextOffset = offset;
+                    inserted.nextOffset = position_max;
+                    inserted.prevOffset = carriageOffset;
+
+                    m_maxOffset = offset;
                     break;
                 }
-                carriage = &m_nodes.at_offset(carriage->nextOffset);
+                carriageOffset = carriage.nextOffset;
             }
         }
-        update_median_pos();
+    }
+    // Top-down search through the express lanes, then a short walk on the base list.
+    // The new node goes after all equal items, the same place the linear walk puts it.
+    void link_sorted(node& inserted, const position_t offset, const position_t /*start*/,
+            const bool /*toLeft*/, std::true_type) {
+        position_t update[skip_levels > 0 ? skip_levels : 1];
+        position_t updateRank[skip_levels > 0 ? skip_levels : 1];
+        position_t prevRank = 0;
+        const position_t prev = find_prev(item_at(offset), 0, update, updateRank, prevRank);
+        const position_t next = prev == position_max
+            ? m_minOffset
+            : m_nodes.at_offset_unchecked(prev).nextOffset;
+        inserted.prevOffset = prev;
+        inserted.nextOffset = next;
+        if (prev == position_max) {
+            m_minOffset = offset;
+        }
+        else {
+            m_nodes.at_offset_unchecked(prev).nextOffset = offset;
+        }
+        if (next == position_max) {
+            m_maxOffset = offset;
+        }
+        else {
+            m_nodes.at_offset_unchecked(next).prevOffset = offset;
+        }
+
+        link_express(update, inserted, offset);
+        link_widths(update, updateRank, inserted, prevRank + 1);
+    }
+    // Returns the last node x for which m_comparator(item, x) >= threshold, i.e.
+    // threshold 0 - the last not greater than the item, 1 - the last less than it.
+    // Also fills the per-lane predecessors with their ranks. position_max stands for
+    // the head, its rank is position_max too, so +1 wraps to the rank 0.
+    position_t find_prev(const item_t& item, const int8_t threshold,
+            position_t* update, position_t* updateRank, position_t& prevRank) const {
+        position_t prev = position_max;
+        position_t rank = position_max;
+        for (uint8_t level = skip_levels; level-- > 0; ) {
+            position_t next = lane_next(prev, level);
+            while (next != position_max
+                    && m_comparator(item, item_at(next)) >= threshold) {
+                rank += lane_width(prev, level);
+                prev = next;
+                next = m_nodes.at_offset_unchecked(prev).skipNext[level];
+            }
+            update[level] = prev;
+            updateRank[level] = rank;
+        }
+        position_t next = prev == position_max
+            ? m_minOffset
+            : m_nodes.at_offset_unchecked(prev).nextOffset;
+        while (next != position_max
+                && m_comparator(item, item_at(next)) >= threshold) {
+            rank += 1;
+            prev = next;
+            next = m_nodes.at_offset_unchecked(prev).nextOffset;
+        }
+        prevRank = rank;
+        return prev;
+    }
+    position_t lane_next(const position_t offset, const uint8_t level) const {
+        return offset == position_max
+            ? m_express.heads[level]
+            : m_nodes.at_offset_unchecked(offset).skipNext[level];
+    }
+    position_t lane_width(const position_t offset, const uint8_t level) const {
+        return offset == position_max
+            ? m_express.widths[level]
+            : m_nodes.at_offset_unchecked(offset).skipWidth[level];
+    }
+    position_t& lane_width(const position_t offset, const uint8_t level) {
+        return offset == position_max
+            ? m_express.widths[level]
+            : m_nodes.at_offset_unchecked(offset).skipWidth[level];
+    }
+    // The predecessors split their spans around the new node of the given rank,
+    // the spans above it grow by one.
+    void link_widths(const position_t* update, const position_t* updateRank,
+            node& inserted, const position_t rank) {
+        for (uint8_t level = 0; level < skip_levels; ++level) {
+            position_t& prevWidth = lane_width(update[level], level);
+            if (level < inserted.skipHeight) {
+                const position_t width = prevWidth;
+                prevWidth = rank - updateRank[level];
+                inserted.skipWidth[level] = width - prevWidth + 1;
+            }
+            else {
+                prevWidth += 1;
+            }
+        }
+    }
+    // Recomputes all spans with one walk, after the bulk merge.
+    void rebuild_widths(std::false_type) {
+    }
+    void rebuild_widths(std::true_type) {
+        express_heads<skip_levels> lanePrevs;
+        position_t lanePrevRanks[skip_levels];
+        std::fill(lanePrevRanks, lanePrevRanks + skip_levels, position_max);
+        position_t rank = 0;
+        for (position_t offset = m_minOffset; offset != position_max;
+                offset = m_nodes.at_offset_unchecked(offset).nextOffset, ++rank) {
+            const node& passed = m_nodes.at_offset_unchecked(offset);
+            for (uint8_t level = 0; level < passed.skipHeight; ++level) {
+                lane_width(lanePrevs.heads[level], level) = rank - lanePrevRanks[level];
+                lanePrevs.heads[level] = offset;
+                lanePrevRanks[level] = rank;
+            }
+        }
+        for (uint8_t level = 0; level < skip_levels; ++level) {
+            lane_width(lanePrevs.heads[level], level) = m_size - lanePrevRanks[level];
+        }
+    }
+    // Splices the sorted batch of unlinked nodes into the list in one pass,
+    // each new node goes after all equal items, and places the median.
+    void merge_sorted(const std::vector<position_t>& batch) {
+        const position_t newSize = m_size + static_cast<position_t>(batch.size());
+        const position_t desiredMedianPos = (newSize - 1) >> 1;
+        express_heads<skip_levels> lanePrevs; // the last passed node of every lane
+        position_t prev = position_max;
+        position_t next = m_minOffset;
+        position_t pos = position_max; // of prev, +1 wraps to 0
+        m_medianOffset = position_max;
+        for (const position_t offset : batch) {
+            node& inserted = m_nodes.at_offset_unchecked(offset);
+            const item_t& item = item_at(offset);
+            while (next != position_max && m_comparator(item, item_at(next)) >= 0) {
+                prev = next;
+                next = m_nodes.at_offset_unchecked(prev).nextOffset;
+                pass_express(lanePrevs, prev, indexed_tag());
+                if (++pos == desiredMedianPos) {
+                    m_medianOffset = prev;
+                }
+            }
+            inserted.prevOffset = prev;
+            inserted.nextOffset = next;
+            if (prev == position_max) {
+                m_minOffset = offset;
+            }
+            else {
+                m_nodes.at_offset_unchecked(prev).nextOffset = offset;
+            }
+            if (next == position_max) {
+                m_maxOffset = offset;
+            }
+            else {
+                m_nodes.at_offset_unchecked(next).prevOffset = offset;
+            }
+            link_express(lanePrevs, inserted, offset, indexed_tag());
+            prev = offset;
+            if (++pos == desiredMedianPos) {
+                m_medianOffset = prev;
+            }
+        }
+        while (m_medianOffset == position_max) {
+            prev = next;
+            next = m_nodes.at_offset_unchecked(prev).nextOffset;
+            if (++pos == desiredMedianPos) {
+                m_medianOffset = prev;
+            }
+        }
+        m_size = newSize;
+        m_medianPos = desiredMedianPos;
+        rebuild_widths(indexed_tag());
+        place_quantiles();
+    }
+    void pass_express(express_heads<skip_levels>&, const position_t, std::false_type) {
+    }
+    void pass_express(express_heads<skip_levels>& lanePrevs, const position_t offset,
+            std::true_type) {
+        const node& passed = m_nodes.at_offset_unchecked(offset);
+        for (uint8_t level = 0; level < passed.skipHeight; ++level) {
+            lanePrevs.heads[level] = offset;
+        }
+    }
+    void link_express(express_heads<skip_levels>&, node&, const position_t,
+            std::false_type) {
+    }
+    void link_express(express_heads<skip_levels>& lanePrevs, node& inserted,
+            const position_t offset, std::true_type) {
+        link_express(lanePrevs.heads, inserted, offset);
+        for (uint8_t level = 0; level < inserted.skipHeight; ++level) {
+            lanePrevs.heads[level] = offset;
+        }
+    }
+    template <typename Remap>
+    void remap_express(node&, const Remap&, std::false_type) {
+    }
+    template <typename Remap>
+    void remap_express(node& moved, const Remap& remap, std::true_type) {
+        for (uint8_t level = 0; level < moved.skipHeight; ++level) {
+            remap(moved.skipPrev[level]);
+            remap(moved.skipNext[level]);
+        }
+    }
+    template <typename Remap>
+    void remap_express(express_heads<skip_levels>&, const Remap&, std::false_type) {
+    }
+    template <typename Remap>
+    void remap_express(express_heads<skip_levels>& heads, const Remap& remap, std::true_type) {
+        for (uint8_t level = 0; level < skip_levels; ++level) {
+            remap(heads.heads[level]);
+        }
+    }
+    // Links the node into the lanes after the given per-lane predecessors.
+    void link_express(const position_t* update, node& inserted, const position_t offset) {
+        inserted.skipHeight = random_height();
+        for (uint8_t level = 0; level < inserted.skipHeight; ++level) {
+            const position_t levelPrev = update[level];
+            const position_t levelNext = levelPrev == position_max
+                ? m_express.heads[level]
+                : m_nodes.at_offset_unchecked(levelPrev).skipNext[level];
+            inserted.skipPrev[level] = levelPrev;
+            inserted.skipNext[level] = levelNext;
+            if (levelPrev == position_max) {
+                m_express.heads[level] = offset;
+            }
+            else {
+                m_nodes.at_offset_unchecked(levelPrev).skipNext[level] = offset;
+            }
+            if (levelNext != position_max) {
+                m_nodes.at_offset_unchecked(levelNext).skipPrev[level] = offset;
+            }
+        }
+    }
+    void link_first_express(node&, const position_t, std::false_type) {
+    }
+    void link_first_express(node& inserted, const position_t offset, std::true_type) {
+        position_t update[skip_levels]; // the head, its rank is position_max too
+        std::fill(update, update + skip_levels, position_max);
+        link_express(update, inserted, offset);
+        link_widths(update, update, inserted, 0);
+    }
+    void unlink_express(node&, std::false_type) {
+    }
+    void unlink_express(node& removed, std::true_type) {
+        for (uint8_t level = 0; level < removed.skipHeight; ++level) {
+            if (removed.skipPrev[level] == position_max) {
+                m_express.heads[level] = removed.skipNext[level];
+            }
+            else {
+                m_nodes.at_offset_unchecked(removed.skipPrev[level]).skipNext[level] =
+                    removed.skipNext[level];
+            }
+            if (removed.skipNext[level] != position_max) {
+                m_nodes.at_offset_unchecked(removed.skipNext[level]).skipPrev[level] =
+                    removed.skipPrev[level];
+            }
+            lane_width(removed.skipPrev[level], level) += removed.skipWidth[level] - 1;
+        }
+        // The lanes above the node: find the span over it by walking left
+        // on the lane below until a taller node, ~4 steps per lane.
+        if (removed.skipHeight == skip_levels) {
+            return;
+        }
+        position_t caret = removed.skipHeight == 0
+            ? removed.prevOffset
+            : removed.skipPrev[removed.skipHeight - 1];
+        for (uint8_t level = removed.skipHeight; level < skip_levels; ++level) {
+            while (caret != position_max && m_nodes.at_offset_unchecked(caret).skipHeight <= level) {
+                caret = level == 0
+                    ? m_nodes.at_offset_unchecked(caret).prevOffset
+                    : m_nodes.at_offset_unchecked(caret).skipPrev[level - 1];
+            }
+            lane_width(caret, level) -= 1;
+        }
+    }
+    // Geometric height with p = 1/4, so every lane skips ~4 nodes of the lane below.
+    uint8_t random_height() {
+        uint32_t x = m_express.seed; // xorshift32
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        m_express.seed = x;
+        uint8_t height = 0;
+        while (height < skip_levels && (x & 3) == 0) {
+            ++height;
+            x >>= 2;
+        }
+        return height;
+    }
+
+    // Unlinks from the base list and the express lanes, the median is left as is.
+    void unlink_links(node& to_remove) {
+        if (to_remove.prevOffset != position_max) {
+            m_nodes.at_offset_unchecked(to_remove.prevOffset).nextOffset = to_remove.nextOffset;
+        }
+        else { // extreme
+            m_minOffset = to_remove.nextOffset;
+        }
+        if (to_remove.nextOffset != position_max) {
+            m_nodes.at_offset_unchecked(to_remove.nextOffset).prevOffset = to_remove.prevOffset;
+        }
+        else { // extreme
+            m_maxOffset = to_remove.prevOffset;
+        }
+        unlink_express(to_remove, indexed_tag());
+    }
+    void unlink_node(const position_t offset) {
+        if (m_size == 1) {
+            m_size = 0;
+            m_minOffset = position_max;
+            m_maxOffset = position_max;
+            m_medianOffset = position_max;
+            m_medianPos = position_max;
+            unlink_express(m_nodes.at_offset_unchecked(offset), indexed_tag());
+            reset_quantiles();
+            m_stats = value_stats<stats_enabled>();
+            return;
+        }
+        auto& to_remove = m_nodes.at_offset_unchecked(offset);
+        stats_remove(item_at(offset), m_size - 1);
+        unlink_links(to_remove);
+
+        //                5->L        4->R      3->L      2->R      offset
+        // F MR B   123M45(-3L)->12M45(-2)->14M5(-4L)->1M5(-1)->5M  pos
+        if (m_medianOffset == offset) { // MR
+            if (m_size & 1) {
+                m_medianOffset = to_remove.prevOffset;
+                m_medianPos -= 1;
+            }
+            else {
+                m_medianOffset = to_remove.nextOffset;
+            }
+        }
+        else {
+            const int8_t cmp = side_of(offset, m_medianOffset);
+            //                5->         4->R      3->       2->R      offset
+            // FR M B   123M45(-2L)->13M45(-1)->34M5(-3L)->4M5(-4)->5M  pos
+            if (cmp < 0) {
+                if (m_size & 1) {
+                    m_medianPos -= 1;
+                }
+                else {
+                    m_medianOffset = m_nodes.at_offset_unchecked(m_medianOffset).nextOffset;
+                }
+            }
+            //                5->L        4->       3->L      2->       offset
+            // F M BR   123M45(-4L)->12M35(-3)->12M5(-5L)->1M2(-2)->1M  pos
+            else {
+                if (m_size & 1) {
+                    m_medianOffset = m_nodes.at_offset_unchecked(m_medianOffset).prevOffset;
+                    m_medianPos -= 1;
+                }
+            }
+        }
+        m_size -= 1;
+
+        for (auto& cursor : m_quantiles) {
+            if (cursor.offset == offset) {
+                if (to_remove.nextOffset != position_max) {
+                    cursor.offset = to_remove.nextOffset;
+                }
+                else {
+                    cursor.offset = to_remove.prevOffset;
+                    cursor.pos -= 1;
+                }
+            }
+            else if (side_of(offset, cursor.offset) < 0) {
+                cursor.pos -= 1;
+            }
+        }
+        update_quantiles_pos();
+    }
+    // Keeps the cursor on a linked node and its pos equal to the rank of that node.
+    void unlink_cursor(const position_t offset, position_t& cursorOffset,
+            position_t& cursorPos) const {
+        const node& removed = m_nodes.at_offset_unchecked(offset);
+        if (cursorOffset == offset) {
+            if (removed.nextOffset != position_max) {
+                cursorOffset = removed.nextOffset;
+            }
+            else {
+                cursorOffset = removed.prevOffset;
+                cursorPos -= 1;
+            }
+        }
+        else if (side_of(offset, cursorOffset) < 0) {
+            cursorPos -= 1;
+        }
+    }
+    // -1 if the unlinked node was to the left of the cursor, 1 if to the right.
+    int8_t side_of(const position_t offset, const position_t cursorOffset) const {
+        const node& removed = m_nodes.at_offset_unchecked(offset);
+        int8_t cmp = m_comparator(item_at(offset), item_at(cursorOffset));
+        const node* caret_left = &removed;
+        const node* caret_right = &removed;
+        while (cmp == 0) {
+            // M <-CL R CR-> M
+            if (cursorOffset == caret_left->prevOffset) { // BR
+                cmp = 1;
+                break;
+            }
+            if (caret_right->nextOffset == cursorOffset) { // FR
+                cmp = -1;
+                break;
+            }
+            if (caret_left->prevOffset != position_max) {
+                caret_left = &m_nodes.at_offset_unchecked(caret_left->prevOffset);
+            }
+            if (caret_right->nextOffset != position_max) {
+                caret_right = &m_nodes.at_offset_unchecked(caret_right->nextOffset);
+            }
+        }
+        return cmp;
     }
     void update_median_pos() {
         const position_t desiredMedianPos = (size() ? size() - 1 : 0) >> 1;
         while (m_medianPos > desiredMedianPos) { // <-
-            m_medianOffset = m_nodes.at_offset(m_medianOffset).prevOffset;
+            m_medianOffset = m_nodes.at_offset_unchecked(m_medianOffset).prevOffset;
             m_medianPos -= 1;
         }
         while (m_medianPos < desiredMedianPos) { // ->
-            m_medianOffset = m_nodes.at_offset(m_medianOffset).nextOffset;
+            m_medianOffset = m_nodes.at_offset_unchecked(m_medianOffset).nextOffset;
             m_medianPos += 1;
         }
     }
+    void update_quantiles_pos() {
+        for (auto& cursor : m_quantiles) {
+            const position_t desiredPos = cursor.desired_pos(size());
+            while (cursor.pos > desiredPos) { // <-
+                cursor.offset = m_nodes.at_offset_unchecked(cursor.offset).prevOffset;
+                cursor.pos -= 1;
+            }
+            while (cursor.pos < desiredPos) { // ->
+                cursor.offset = m_nodes.at_offset_unchecked(cursor.offset).nextOffset;
+                cursor.pos += 1;
+            }
+        }
+    }
+    position_t offset_of_rank(const position_t rank) const {
+        if (rank >= m_size) {
+            throw std::out_of_range("rank >= size()");
+        }
+        return offset_of_rank(rank, indexed_tag());
+    }
+    position_t offset_of_rank(const position_t rank, std::false_type) const {
+        position_t offset = m_minOffset;
+        position_t pos = 0;
+        const auto distance = [rank](const position_t from) {
+            return from > rank ? from - rank : rank - from;
+        };
+        if (distance(m_size - 1) < distance(pos)) {
+            offset = m_maxOffset;
+            pos = m_size - 1;
+        }
+        if (distance(m_medianPos) < distance(pos)) {
+            offset = m_medianOffset;
+            pos = m_medianPos;
+        }
+        for (const auto& cursor : m_quantiles) {
+            if (distance(cursor.pos) < distance(pos)) {
+                offset = cursor.offset;
+                pos = cursor.pos;
+            }
+        }
+        for (; pos > rank; --pos) {
+            offset = m_nodes.at_offset_unchecked(offset).prevOffset;
+        }
+        for (; pos < rank; ++pos) {
+            offset = m_nodes.at_offset_unchecked(offset).nextOffset;
+        }
+        return offset;
+    }
+    position_t offset_of_rank(const position_t rank, std::true_type) const {
+        position_t offset = position_max;
+        position_t pos = position_max;
+        for (uint8_t level = skip_levels; level-- > 0; ) {
+            position_t next = lane_next(offset, level);
+            while (next != position_max
+                    && static_cast<position_t>(pos + lane_width(offset, level)) <= rank) {
+                pos += lane_width(offset, level);
+                offset = next;
+                next = m_nodes.at_offset_unchecked(offset).skipNext[level];
+            }
+        }
+        for (; pos != rank; ++pos) {
+            offset = offset == position_max
+                ? m_minOffset
+                : m_nodes.at_offset_unchecked(offset).nextOffset;
+        }
+        return offset;
+    }
+    // The number of items x for which m_comparator(item, x) >= threshold.
+    position_t count_before(const item_t& item, const int8_t threshold,
+            std::false_type) const {
+        if (m_size == 0) {
+            return 0;
+        }
+        position_t offset = m_medianOffset;
+        position_t pos = m_medianPos;
+        if (m_comparator(item, item_at(offset)) >= threshold) { // ->
+            while (true) {
+                const position_t next = m_nodes.at_offset_unchecked(offset).nextOffset;
+                if (next == position_max
+                        || m_comparator(item, item_at(next)) < threshold) {
+                    return pos + 1;
+                }
+                offset = next;
+                pos += 1;
+            }
+        }
+        while (true) { // <-
+            const position_t prev = m_nodes.at_offset_unchecked(offset).prevOffset;
+            if (prev == position_max) {
+                return 0;
+            }
+            if (m_comparator(item, item_at(prev)) >= threshold) {
+                return pos;
+            }
+            offset = prev;
+            pos -= 1;
+        }
+    }
+    position_t count_before(const item_t& item, const int8_t threshold,
+            std::true_type) const {
+        position_t update[skip_levels > 0 ? skip_levels : 1];
+        position_t updateRank[skip_levels > 0 ? skip_levels : 1];
+        position_t prevRank = 0;
+        find_prev(item, threshold, update, updateRank, prevRank);
+        return prevRank + 1;
+    }
+    // Places all cursors from scratch with one walk from the min.
+    void place_quantiles() {
+        reset_quantiles();
+        if (m_quantiles.empty() || m_size == 0) {
+            return;
+        }
+        position_t placed = 0;
+        position_t pos = 0;
+        for (position_t offset = m_minOffset; placed < m_quantiles.size();
+                offset = m_nodes.at_offset_unchecked(offset).nextOffset, ++pos) {
+            for (auto& cursor : m_quantiles) {
+                if (cursor.offset == position_max && cursor.desired_pos(m_size) == pos) {
+                    cursor.offset = offset;
+                    cursor.pos = pos;
+                    placed += 1;
+                }
+            }
+        }
+    }
+    void reset_quantiles() {
+        for (auto& cursor : m_quantiles) {
+            cursor.offset = position_max;
+            cursor.pos = position_max;
+        }
+    }
+
+    struct quantile_cursor {
+        position_t desired_pos(const position_t size) const {
+            return size ? static_cast<position_t>(((size - 1) * scale) >> 32) : 0;
+        }
+        uint64_t scale = 0; // fraction * 2^32
+        position_t offset = position_max;
+        position_t pos = position_max;
+    };
+
+    // The fixed-width header of save(), without padding.
+    struct snapshot_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t byteOrder;
+        uint32_t itemSize;
+        uint32_t nodeSize;
+        uint32_t statsSize;
+        uint32_t expressSize;
+        uint8_t positionSize;
+        uint8_t skipLevels;
+        uint8_t splitItems;
+        uint8_t powerOfTwo;
+        uint64_t maxSize;
+        uint64_t capacity;
+        uint64_t size;
+        uint64_t frontOffset;
+        uint64_t minOffset;
+        uint64_t medianOffset;
+        uint64_t medianPos;
+        uint64_t maxOffset;
+        uint64_t quantiles;
+    };
+    static snapshot_header snapshot_layout() {
+        snapshot_header header = {};
+        header.magic = 0x51444653; // "SFDQ"
+        header.version = 1;
+        header.byteOrder = 0x01020304;
+        header.itemSize = sizeof(item_t);
+        header.nodeSize = sizeof(node);
+        header.statsSize = sizeof(value_stats<stats_enabled>);
+        header.expressSize = sizeof(express_heads<skip_levels>);
+        header.positionSize = sizeof(position_t);
+        header.skipLevels = skip_levels;
+        header.splitItems = split_items;
+        header.powerOfTwo = power_of_two;
+        return header;
+    }
+    template <typename Write>
+    void save_snapshot(const Write& write) const {
+        save_state_snapshot(write);
+        write(m_nodes.array_one().first, m_nodes.array_one().second * sizeof(node));
+        write(m_nodes.array_two().first, m_nodes.array_two().second * sizeof(node));
+        save_items(write, split_tag());
+    }
+    template <typename Write>
+    void save_state_snapshot(const Write& write) const {
+        static_assert(std::is_trivially_copyable<item_t>::value,
+            "save() requires a trivially copyable item_t");
+        snapshot_header header = snapshot_layout();
+        header.maxSize = max_size();
+        header.capacity = m_nodes.capacity();
+        header.size = m_size;
+        header.frontOffset = m_nodes.front_offset();
+        header.minOffset = m_minOffset;
+        header.medianOffset = m_medianOffset;
+        header.medianPos = m_medianPos;
+        header.maxOffset = m_maxOffset;
+        header.quantiles = m_quantiles.size();
+        write(&header, sizeof(header));
+        for (const auto& cursor : m_quantiles) {
+            write(&cursor.scale, sizeof(cursor.scale));
+            write(&cursor.offset, sizeof(cursor.offset));
+            write(&cursor.pos, sizeof(cursor.pos));
+        }
+        write(&m_stats, sizeof(m_stats));
+        write(&m_express, sizeof(m_express));
+    }
+    template <typename Write>
+    void save_items(const Write&, std::false_type) const {
+    }
+    template <typename Write>
+    void save_items(const Write& write, std::true_type) const {
+        write(m_items.array_one().first, m_items.array_one().second * sizeof(item_t));
+        write(m_items.array_two().first, m_items.array_two().second * sizeof(item_t));
+    }
+    template <typename Read>
+    void load_snapshot(const Read& read) {
+        const auto place = [this, &read](const position_t frontOffset, const position_t size) {
+            m_nodes.restore(frontOffset, size, [&read](node* nodes, const position_t count) {
+                read(nodes, count * sizeof(node));
+            });
+            load_items(read, frontOffset, size, split_tag());
+        };
+        load_snapshot(read, place, sorted_flat_attach::check);
+    }
+    // place(front offset, size) puts the nodes into the storage.
+    template <typename Read, typename Place>
+    void load_snapshot(const Read& read, const Place& place, const sorted_flat_attach mode) {
+        static_assert(std::is_trivially_copyable<item_t>::value,
+            "load() requires a trivially copyable item_t");
+        snapshot_header header;
+        read(&header, sizeof(header));
+        const snapshot_header layout = snapshot_layout();
+        if (header.magic != layout.magic || header.version != layout.version
+                || header.byteOrder != layout.byteOrder || header.itemSize != layout.itemSize
+                || header.nodeSize != layout.nodeSize || header.statsSize != layout.statsSize
+                || header.expressSize != layout.expressSize
+                || header.positionSize != layout.positionSize
+                || header.skipLevels != layout.skipLevels
+                || header.splitItems != layout.splitItems
+                || header.powerOfTwo != layout.powerOfTwo) {
+            throw std::runtime_error("the snapshot is of another version or layout");
+        }
+        if (header.maxSize > position_max || header.size > header.maxSize) {
+            throw std::runtime_error("the snapshot size is out of range");
+        }
+        clear();
+        m_quantiles.clear();
+        try {
+            set_max_size(static_cast<position_t>(header.maxSize));
+            if (header.capacity != m_nodes.capacity()) {
+                throw std::runtime_error("the snapshot capacity differs");
+            }
+            if (header.capacity > 0 ? header.frontOffset >= header.capacity
+                    : header.frontOffset != 0) {
+                throw std::runtime_error("the snapshot front offset is out of range");
+            }
+            for (uint64_t i = 0; i < header.quantiles; ++i) {
+                quantile_cursor cursor;
+                read(&cursor.scale, sizeof(cursor.scale));
+                read(&cursor.offset, sizeof(cursor.offset));
+                read(&cursor.pos, sizeof(cursor.pos));
+                // A fraction above 1 would place the cursor past the max.
+                if (cursor.scale > (uint64_t(1) << 32)) {
+                    throw std::runtime_error("the snapshot quantile is out of range");
+                }
+                m_quantiles.push_back(cursor);
+            }
+            read(&m_stats, sizeof(m_stats));
+            read(&m_express, sizeof(m_express));
+            const position_t frontOffset = static_cast<position_t>(header.frontOffset);
+            const position_t size = static_cast<position_t>(header.size);
+            place(frontOffset, size);
+            m_size = size;
+            m_minOffset = static_cast<position_t>(header.minOffset);
+            m_medianOffset = static_cast<position_t>(header.medianOffset);
+            m_medianPos = static_cast<position_t>(header.medianPos);
+            m_maxOffset = static_cast<position_t>(header.maxOffset);
+            if (mode == sorted_flat_attach::check) {
+                check_snapshot();
+            }
+            else if (mode == sorted_flat_attach::relink) {
+                relink();
+            }
+            else {
+                check_cursors();
+            }
+        }
+        catch (...) {
+            clear();
+            m_quantiles.clear();
+            throw;
+        }
+    }
+    template <typename Read>
+    void load_items(const Read&, const position_t, const position_t, std::false_type) {
+    }
+    template <typename Read>
+    void load_items(const Read& read, const position_t frontOffset, const position_t size,
+            std::true_type) {
+        m_items.restore(frontOffset, size, [&read](item_t* items, const position_t count) {
+            read(items, count * sizeof(item_t));
+        });
+    }
+    // Walks the list from the min: every link within the stored nodes and consistent both
+    // ways, the cursors at their ranks, the express lanes and widths as rebuild_widths()
+    // would make them. The order of the items is not checked, that takes comparisons.
+    void check_snapshot() const {
+        const auto fail = []() {
+            throw std::runtime_error("the snapshot links are inconsistent");
+        };
+        check_cursors();
+        express_heads<skip_levels> lanePrevs; // the last checked node of every lane
+        position_t lanePrevRanks[skip_levels > 0 ? skip_levels : 1];
+        std::fill(lanePrevRanks, lanePrevRanks + sizeof(lanePrevRanks) / sizeof(position_t),
+            position_max);
+        position_t prev = position_max;
+        position_t rank = 0;
+        for (position_t offset = m_minOffset; offset != position_max; ++rank) {
+            if (rank >= m_size || !stored(offset)) {
+                fail();
+            }
+            const node& checked = m_nodes.at_offset_unchecked(offset);
+            if (checked.prevOffset != prev
+                    || (rank == m_medianPos) != (offset == m_medianOffset)) {
+                fail();
+            }
+            for (const auto& cursor : m_quantiles) {
+                if (cursor.pos == rank && cursor.offset != offset) {
+                    fail();
+                }
+            }
+            if (!check_express(checked, offset, rank, lanePrevs, lanePrevRanks, indexed_tag())) {
+                fail();
+            }
+            prev = offset;
+            offset = checked.nextOffset;
+        }
+        if (rank != m_size || prev != m_maxOffset
+                || !check_express_ends(lanePrevs, lanePrevRanks, indexed_tag())) {
+            fail();
+        }
+    }
+    // The O(1) part of check_snapshot(): the cursors point to stored nodes at their ranks.
+    void check_cursors() const {
+        bool valid = true;
+        if (m_size == 0) {
+            valid = m_minOffset == position_max && m_medianOffset == position_max
+                && m_maxOffset == position_max && m_medianPos == position_max;
+        }
+        else {
+            valid = m_medianPos == ((m_size - 1) >> 1) && stored(m_minOffset)
+                && stored(m_medianOffset) && stored(m_maxOffset);
+        }
+        for (const auto& cursor : m_quantiles) {
+            const bool linked = m_size > 0 && cursor.pos < m_size
+                && cursor.pos == cursor.desired_pos(m_size) && stored(cursor.offset);
+            valid = valid && (linked || (m_size == 0 && cursor.offset == position_max));
+        }
+        if (!valid) {
+            throw std::runtime_error("the snapshot links are inconsistent");
+        }
+    }
+    bool stored(const position_t offset) const {
+        if (offset >= m_nodes.capacity()) {
+            return false;
+        }
+        const position_t front = m_nodes.front_offset();
+        return (offset >= front ? offset - front : offset + (m_nodes.capacity() - front))
+            < m_size;
+    }
+    // Sorts the items from the front offset again, without reading the links.
+    void relink() {
+        std::vector<item_t> items;
+        items.reserve(m_size);
+        for (position_t i = 0; i < m_size; ++i) {
+            items.push_back(item_at_pos(i, split_tag()));
+        }
+        clear();
+        push_back(items.begin(), items.end());
+    }
+    const item_t& item_at_pos(const position_t pos, std::false_type) const {
+        return m_nodes.at(pos).item;
+    }
+    const item_t& item_at_pos(const position_t pos, std::true_type) const {
+        return m_items.at(pos);
+    }
+    size_t storage_nodes_size() const {
+        return (static_cast<size_t>(m_nodes.capacity()) * sizeof(node) + 63) / 64 * 64;
+    }
+    size_t storage_items_size(std::false_type) const {
+        return 0;
+    }
+    size_t storage_items_size(std::true_type) const {
+        return static_cast<size_t>(m_items.capacity()) * sizeof(item_t);
+    }
+    template <typename Buffer, typename T>
+    static void move_to_storage(Buffer& buffer, T* storage) {
+        const position_t frontOffset = buffer.front_offset();
+        const position_t size = buffer.size();
+        if (size > 0 && buffer.array_one().first != storage + frontOffset) {
+            std::memcpy(storage + frontOffset, buffer.array_one().first,
+                buffer.array_one().second * sizeof(T));
+            if (buffer.array_two().second > 0) {
+                std::memcpy(storage, buffer.array_two().first,
+                    buffer.array_two().second * sizeof(T));
+            }
+        }
+        buffer.borrow(storage, frontOffset, size);
+    }
+    void move_items_to_storage(char*, std::false_type) {
+    }
+    void move_items_to_storage(char* storage, std::true_type) {
+        move_to_storage(m_items, reinterpret_cast<item_t*>(storage));
+    }
+    void borrow_items(char*, const position_t, const position_t, std::false_type) {
+    }
+    void borrow_items(char* storage, const position_t frontOffset, const position_t size,
+            std::true_type) {
+        m_items.borrow(reinterpret_cast<item_t*>(storage), frontOffset, size);
+    }
+    bool check_express(const node&, const position_t, const position_t,
+            express_heads<skip_levels>&, position_t*, std::false_type) const {
+        return true;
+    }
+    bool check_express(const node& checked, const position_t offset, const position_t rank,
+            express_heads<skip_levels>& lanePrevs, position_t* lanePrevRanks,
+            std::true_type) const {
+        if (checked.skipHeight > skip_levels) {
+            return false;
+        }
+        for (uint8_t level = 0; level < checked.skipHeight; ++level) {
+            const position_t lanePrev = lanePrevs.heads[level];
+            const position_t expected = lanePrev == position_max
+                ? m_express.heads[level] : m_nodes.at_offset_unchecked(lanePrev).skipNext[level];
+            if (expected != offset || checked.skipPrev[level] != lanePrev
+                    || lane_width(lanePrev, level)
+                        != static_cast<position_t>(rank - lanePrevRanks[level])) {
+                return false;
+            }
+            lanePrevs.heads[level] = offset;
+            lanePrevRanks[level] = rank;
+        }
+        return true;
+    }
+    bool check_express_ends(const express_heads<skip_levels>&, const position_t*,
+            std::false_type) const {
+        return true;
+    }
+    bool check_express_ends(const express_heads<skip_levels>& lanePrevs,
+            const position_t* lanePrevRanks, std::true_type) const {
+        for (uint8_t level = 0; level < skip_levels; ++level) {
+            const position_t lanePrev = lanePrevs.heads[level];
+            const position_t next = lanePrev == position_max
+                ? m_express.heads[level] : m_nodes.at_offset_unchecked(lanePrev).skipNext[level];
+            if (next != position_max || lane_width(lanePrev, level)
+                    != static_cast<position_t>(m_size - lanePrevRanks[level])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void stats_add(const item_t& item, const position_t count) {
+        stats_add(item, count, std::integral_constant<bool, stats_enabled>());
+    }
+    void stats_add(const item_t&, const position_t, std::false_type) {
+    }
+    void stats_add(const item_t& item, const position_t count, std::true_type) {
+        if (has_accessor(m_accessor)) {
+            m_stats.add(static_cast<value_t>(m_accessor(item)), count);
+        }
+    }
+    void stats_remove(const item_t& item, const position_t count) {
+        stats_remove(item, count, std::integral_constant<bool, stats_enabled>());
+    }
+    void stats_remove(const item_t&, const position_t, std::false_type) {
+    }
+    void stats_remove(const item_t& item, const position_t count, std::true_type) {
+        if (has_accessor(m_accessor)) {
+            m_stats.remove(static_cast<value_t>(m_accessor(item)), count);
+        }
+    }
+    // The stats stay empty until a value_function is set.
+    static bool has_accessor(const value_function<item_t, value_t>& accessor) {
+        return static_cast<bool>(accessor);
+    }
+    template <typename Accessor>
+    static bool has_accessor(const Accessor&) {
+        return true;
+    }
+
+    using node_allocator_t = typename std::allocator_traits<allocator_t>::template rebind_alloc<node>;
+    using node_traits_t = std::allocator_traits<node_allocator_t>;
+    using cursor_allocator_t =
+        typename std::allocator_traits<allocator_t>::template rebind_alloc<quantile_cursor>;
+    using cursor_traits_t = std::allocator_traits<cursor_allocator_t>;
+    using item_allocator_t = typename std::allocator_traits<allocator_t>::template rebind_alloc<item_t>;
+    using item_store_t = typename std::conditional<split_items,
+        circular_buffer<item_t, item_allocator_t, power_of_two>, no_items>::type;
+
     comparator_t m_comparator;
-    mutable circular_buffer<node> m_nodes;
+    accessor_t m_accessor;
+    mutable circular_buffer<node, node_allocator_t, power_of_two> m_nodes;
+    mutable item_store_t m_items; // the same offsets as m_nodes
     position_t m_size = 0;
     position_t m_minOffset = position_max;
     position_t m_medianOffset = position_max;
     position_t m_medianPos = position_max;
     position_t m_maxOffset = position_max;
-    //value_t m_sum = 0;
+    express_heads<skip_levels> m_express;
+    std::vector<quantile_cursor, cursor_allocator_t> m_quantiles;
+    value_stats<stats_enabled> m_stats;
 };
+
+template <typename item_t, typename value_t, typename compare_t, uint8_t skip_levels,
+    typename accessor_t, typename allocator_t, bool power_of_two, typename offset_t,
+    bool split_items>
+const typename sorted_flat_deque<item_t, value_t, compare_t, skip_levels, accessor_t,
+    allocator_t, power_of_two, offset_t, split_items>::position_t sorted_flat_deque<item_t,
+    value_t, compare_t, skip_levels, accessor_t, allocator_t, power_of_two, offset_t,
+    split_items>::position_max;
@@ -0,0 +1,315 @@
+// sorted_flat_deque_bank
+// C++11, N sorted windows of the same capacity in one structure-of-arrays arena,
+// for arithmetic items. All windows are pushed and popped together, so the insertion
+// order bookkeeping (front, size, median position) is shared, and items, links and
+// min/median/max offsets each live in one contiguous array.
+//
+// push_all - O(N * n/2)
+// pop_front_all - O(N)
+// medians, mins, maxs - O(N)
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+template <typename item_t>
+class sorted_flat_deque_bank {
+public:
+    static_assert(std::is_arithmetic<item_t>::value, "sorted_flat_deque_bank requires an arithmetic item_t");
+    #ifdef SORTED_FLAT_DEQUE_POSITION_T
+    using position_t = SORTED_FLAT_DEQUE_POSITION_T;
+    #else
+    using position_t = uint32_t;
+    #endif
+    using item_type = item_t;
+    using value_type = item_t;
+    static const position_t position_max = static_cast<position_t>(-1);
+
+    sorted_flat_deque_bank() {
+    }
+    sorted_flat_deque_bank(const size_t series_count, const position_t max_size) {
+        reset(series_count, max_size);
+    }
+
+    // Drops all items and reallocates the arena.
+    void reset(const size_t series_count, const position_t max_size) {
+        const size_t total = series_count * max_size;
+        m_seriesCount = series_count;
+        m_maxSize = max_size;
+        m_items.assign(total, item_t());
+        m_prevOffsets.assign(total, position_max);
+        m_nextOffsets.assign(total, position_max);
+        m_minOffsets.assign(series_count, position_max);
+        m_medianOffsets.assign(series_count, position_max);
+        m_maxOffsets.assign(series_count, position_max);
+        m_shifts.assign(series_count, 0);
+        m_frontOffset = 0;
+        m_size = 0;
+        m_medianPos = position_max;
+    }
+    void clear() {
+        std::fill(m_minOffsets.begin(), m_minOffsets.end(), position_max);
+        std::fill(m_medianOffsets.begin(), m_medianOffsets.end(), position_max);
+        std::fill(m_maxOffsets.begin(), m_maxOffsets.end(), position_max);
+        m_frontOffset = 0;
+        m_size = 0;
+        m_medianPos = position_max;
+    }
+
+    // Pushes values[i] into the window i, evicting the oldest item of every window
+    // when they are full.
+    void push_all(const item_t* values) {
+        if (m_maxSize == 0 || m_seriesCount == 0) {
+            return;
+        }
+        position_t offset;
+        if (m_size == m_maxSize) {
+            offset = m_frontOffset;
+            unlink_all(offset);
+            m_frontOffset = offset + 1 == m_maxSize ? 0 : offset + 1;
+        }
+        else {
+            offset = m_frontOffset + m_size;
+            if (offset >= m_maxSize) {
+                offset -= m_maxSize;
+            }
+            std::fill(m_shifts.begin(), m_shifts.end(), 0);
+        }
+        link_all(offset, values);
+        fix_medians();
+    }
+    // Removes the oldest item of every window.
+    void pop_front_all() {
+        if (m_size == 0) {
+            throw std::logic_error("m_size == 0");
+        }
+        unlink_all(m_frontOffset);
+        m_frontOffset = m_frontOffset + 1 == m_maxSize ? 0 : m_frontOffset + 1;
+        fix_medians();
+    }
+
+    void medians(item_t* out) const {
+        gather(m_medianOffsets, out);
+    }
+    void mins(item_t* out) const {
+        gather(m_minOffsets, out);
+    }
+    void maxs(item_t* out) const {
+        gather(m_maxOffsets, out);
+    }
+    item_t min(const size_t series) const {
+        return at(series, m_minOffsets);
+    }
+    item_t median(const size_t series) const {
+        return at(series, m_medianOffsets);
+    }
+    item_t max(const size_t series) const {
+        return at(series, m_maxOffsets);
+    }
+    // The items of the window in ascending order.
+    template <typename OutputIt>
+    OutputIt copy_sorted(const size_t series, OutputIt out) const {
+        if (series >= m_seriesCount) {
+            throw std::out_of_range("series >= series_count()");
+        }
+        const size_t base = series * m_maxSize;
+        for (position_t offset = m_minOffsets[series]; offset != position_max;
+                offset = m_nextOffsets[base + offset]) {
+            *out++ = m_items[base + offset];
+        }
+        return out;
+    }
+
+    size_t series_count() const {
+        return m_seriesCount;
+    }
+    // The size of every window.
+    position_t size() const {
+        return m_size;
+    }
+    position_t max_size() const {
+        return m_maxSize;
+    }
+    bool empty() const {
+        return m_size == 0;
+    }
+
+private:
+    // Unlinks the item at the offset from every window. m_shifts gets the change
+    // of the rank of every median.
+    void unlink_all(const position_t offset) {
+        const size_t maxSize = m_maxSize;
+        const item_t* items = m_items.data();
+        const position_t* medianOffsets = m_medianOffsets.data();
+        int8_t* shifts = m_shifts.data();
+        // Insertion always goes after the equal items and the evicted item is the oldest,
+        // so an evicted item equal to the median is to the left of it.
+        for (size_t series = 0; series < m_seriesCount; ++series) {
+            const size_t base = series * maxSize;
+            const bool left = !(items[base + medianOffsets[series]] < items[base + offset]);
+            shifts[series] = -static_cast<int8_t>(left && medianOffsets[series] != offset);
+        }
+        position_t* prevOffsets = m_prevOffsets.data();
+        position_t* nextOffsets = m_nextOffsets.data();
+        for (size_t series = 0; series < m_seriesCount; ++series) {
+            const size_t base = series * maxSize;
+            const position_t prev = prevOffsets[base + offset];
+            const position_t next = nextOffsets[base + offset];
+            if (m_medianOffsets[series] == offset) {
+                if (next != position_max) {
+                    m_medianOffsets[series] = next;
+                }
+                else {
+                    m_medianOffsets[series] = prev;
+                    shifts[series] -= 1;
+                }
+            }
+            if (prev != position_max) {
+                nextOffsets[base + prev] = next;
+            }
+            else {
+                m_minOffsets[series] = next;
+            }
+            if (next != position_max) {
+                prevOffsets[base + next] = prev;
+            }
+            else {
+                m_maxOffsets[series] = prev;
+            }
+        }
+        m_size -= 1;
+    }
+    // Links values[i] at the offset into the window i, walking from its median.
+    void link_all(const position_t offset, const item_t* values) {
+        const size_t maxSize = m_maxSize;
+        item_t* items = m_items.data();
+        position_t* prevOffsets = m_prevOffsets.data();
+        position_t* nextOffsets = m_nextOffsets.data();
+        if (m_size == 0) {
+            for (size_t series = 0; series < m_seriesCount; ++series) {
+                const size_t base = series * maxSize;
+                items[base + offset] = values[series];
+                prevOffsets[base + offset] = position_max;
+                nextOffsets[base + offset] = position_max;
+                m_minOffsets[series] = offset;
+                m_medianOffsets[series] = offset;
+                m_maxOffsets[series] = offset;
+                m_shifts[series] = 0;
+            }
+            m_size = 1;
+            m_medianPos = 0;
+            return;
+        }
+        for (size_t series = 0; series < m_seriesCount; ++series) {
+            const size_t base = series * maxSize;
+            const item_t value = values[series];
+            items[base + offset] = value;
+            position_t current = m_medianOffsets[series];
+            position_t prev;
+            position_t next;
+            if (value < items[base + current]) {
+                m_shifts[series] += 1;
+                // <- before the first greater
+                while (prevOffsets[base + current] != position_max
+                        && value < items[base + prevOffsets[base + current]]) {
+                    current = prevOffsets[base + current];
+                }
+                prev = prevOffsets[base + current];
+                next = current;
+            }
+            else {
+                // -> after the last not greater
+                while (nextOffsets[base + current] != position_max
+                        && !(value < items[base + nextOffsets[base + current]])) {
+                    current = nextOffsets[base + current];
+                }
+                prev = current;
+                next = nextOffsets[base + current];
+            }
+            prevOffsets[base + offset] = prev;
+            nextOffsets[base + offset] = next;
+            if (prev != position_max) {
+                nextOffsets[base + prev] = offset;
+            }
+            else {
+                m_minOffsets[series] = offset;
+            }
+            if (next != position_max) {
+                prevOffsets[base + next] = offset;
+            }
+            else {
+                m_maxOffsets[series] = offset;
+            }
+        }
+        m_size += 1;
+    }
+    // Moves every median by at most one item to the desired position.
+    void fix_medians() {
+        if (m_size == 0) {
+            m_medianPos = position_max;
+            return;
+        }
+        const position_t desiredMedianPos = (m_size - 1) >> 1;
+        // The rank of the median is m_medianPos + shift, the difference is -1, 0 or 1.
+        const int diff = static_cast<int>(desiredMedianPos) - static_cast<int>(m_medianPos);
+        const size_t maxSize = m_maxSize;
+        const position_t* prevOffsets = m_prevOffsets.data();
+        const position_t* nextOffsets = m_nextOffsets.data();
+        const int8_t* shifts = m_shifts.data();
+        position_t* medianOffsets = m_medianOffsets.data();
+        for (size_t series = 0; series < m_seriesCount; ++series) {
+            const size_t base = series * maxSize;
+            const position_t median = medianOffsets[series];
+            const int move = diff - shifts[series];
+            const position_t prev = prevOffsets[base + median];
+            const position_t next = nextOffsets[base + median];
+            medianOffsets[series] = move > 0 ? next : (move < 0 ? prev : median);
+        }
+        m_medianPos = desiredMedianPos;
+    }
+    void gather(const std::vector<position_t>& offsets, item_t* out) const {
+        if (m_size == 0) {
+            throw std::logic_error("m_size == 0");
+        }
+        const size_t maxSize = m_maxSize;
+        const item_t* items = m_items.data();
+        const position_t* offsetsData = offsets.data();
+        for (size_t series = 0; series < m_seriesCount; ++series) {
+            out[series] = items[series * maxSize + offsetsData[series]];
+        }
+    }
+    item_t at(const size_t series, const std::vector<position_t>& offsets) const {
+        if (series >= m_seriesCount) {
+            throw std::out_of_range("series >= series_count()");
+        }
+        if (m_size == 0) {
+            throw std::logic_error("m_size == 0");
+        }
+        return m_items[series * m_maxSize + offsets[series]];
+    }
+
+    std::vector<item_t> m_items;
+    std::vector<position_t> m_prevOffsets;
+    std::vector<position_t> m_nextOffsets;
+    std::vector<position_t> m_minOffsets;
+    std::vector<position_t> m_medianOffsets;
+    std::vector<position_t> m_maxOffsets;
+    std::vector<int8_t> m_shifts; // the rank change of every median in the current step
+    size_t m_seriesCount = 0;
+    position_t m_maxSize = 0;
+    position_t m_frontOffset = 0;
+    position_t m_size = 0;
+    position_t m_medianPos = position_max;
+};
+
+template <typename item_t>
+const typename sorted_flat_deque_bank<item_t>::position_t
+    sorted_flat_deque_bank<item_t>::position_max;
@@ -0,0 +1,261 @@
+// sorted_flat_executor
+// C++11, many keyed sorted_flat_deque windows partitioned into shards and updated
+// by a pool of worker threads. A shard is processed by one worker at a time, so the
+// windows need no locks. Every worker has a queue of the shards with pending items,
+// and an idle worker steals whole shards from the other queues when load is skewed.
+//
+// submit - O(k) for k items, plus one queue push per shard that becomes pending
+// window update - same as deque_t push_back, on a worker thread
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Every new key gets a copy of the prototype deque (with its max_size, quantiles etc).
+// submit() may be called from one thread at a time. The windows may be read with
+// find() and for_each() only after wait() and until the next submit().
+template <typename deque_t, typename key_t = uint64_t, typename hash_t = std::hash<key_t>>
+class sorted_flat_executor {
+public:
+    using deque_type = deque_t;
+    using item_type = typename deque_t::item_type;
+    using key_type = key_t;
+    using entry_type = std::pair<key_t, item_type>;
+
+    // worker_count == 0 is std::thread::hardware_concurrency().
+    // shard_count == 0 is 8 shards per worker, enough granularity for stealing.
+    sorted_flat_executor(deque_t prototype, size_t worker_count = 0, size_t shard_count = 0)
+            : m_prototype(std::move(prototype)) {
+        if (worker_count == 0) {
+            worker_count = std::thread::hardware_concurrency();
+            if (worker_count == 0) {
+                worker_count = 1;
+            }
+        }
+        if (shard_count == 0) {
+            shard_count = worker_count * 8;
+        }
+        m_shards.reserve(shard_count);
+        for (size_t i = 0; i < shard_count; ++i) {
+            m_shards.emplace_back(new shard());
+        }
+        m_scratch.resize(shard_count);
+        m_workers.reserve(worker_count);
+        for (size_t i = 0; i < worker_count; ++i) {
+            m_workers.emplace_back(new worker());
+        }
+        for (size_t i = 0; i < worker_count; ++i) {
+            m_workers[i]->thread = std::thread(&sorted_flat_executor::run_worker, this, i);
+        }
+    }
+    sorted_flat_executor(const sorted_flat_executor&) = delete;
+    sorted_flat_executor& operator=(const sorted_flat_executor&) = delete;
+    ~sorted_flat_executor() {
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_stop = true;
+        }
+        m_sleepCv.notify_all();
+        for (auto& w : m_workers) {
+            w->thread.join();
+        }
+    }
+
+    // Routes the (key, item) pairs to their shards. The items of one key are applied
+    // in the submission order.
+    template <typename InputIt>
+    void submit(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            m_scratch[shard_of(first->first)].push_back(*first);
+        }
+        for (size_t index = 0; index < m_shards.size(); ++index) {
+            std::vector<entry_type>& entries = m_scratch[index];
+            if (entries.empty()) {
+                continue;
+            }
+            m_pending.fetch_add(entries.size());
+            shard& s = *m_shards[index];
+            bool schedule;
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (s.inbox.empty()) {
+                    s.inbox.swap(entries);
+                }
+                else {
+                    s.inbox.insert(s.inbox.end(), entries.begin(), entries.end());
+                }
+                schedule = !s.scheduled;
+                s.scheduled = true;
+            }
+            entries.clear();
+            if (schedule) {
+                enqueue(index % m_workers.size(), index);
+            }
+        }
+    }
+    void submit(const entry_type& entry) {
+        submit(&entry, &entry + 1);
+    }
+    // Blocks until every submitted item is applied.
+    void wait() {
+        std::unique_lock<std::mutex> lock(m_idleMutex);
+        m_idleCv.wait(lock, [this] { return m_pending.load() == 0; });
+    }
+
+    // nullptr if the key was never submitted.
+    const deque_t* find(const key_t& key) const {
+        const shard& s = *m_shards[shard_of(key)];
+        const auto it = s.windows.find(key);
+        return it == s.windows.end() ? nullptr : &it->second;
+    }
+    // function(const key_t&, const deque_t&) for every window, shard by shard.
+    template <typename Function>
+    void for_each(Function function) const {
+        for (const auto& s : m_shards) {
+            for (const auto& window : s->windows) {
+                function(window.first, window.second);
+            }
+        }
+    }
+    size_t window_count() const {
+        size_t count = 0;
+        for (const auto& s : m_shards) {
+            count += s->windows.size();
+        }
+        return count;
+    }
+    size_t shard_of(const key_t& key) const {
+        return m_hash(key) % m_shards.size();
+    }
+    size_t shard_count() const {
+        return m_shards.size();
+    }
+    size_t worker_count() const {
+        return m_workers.size();
+    }
+    // Shards taken from the queue of another worker so far.
+    uint64_t steals() const {
+        return m_steals.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct shard {
+        std::mutex mutex;
+        std::vector<entry_type> inbox; // guarded by mutex
+        bool scheduled = false;        // guarded by mutex, in a queue or being processed
+        // Touched only by the worker that processes the shard.
+        std::vector<entry_type> work;
+        std::unordered_map<key_t, deque_t, hash_t> windows;
+    };
+    struct worker {
+        std::mutex mutex;
+        std::deque<size_t> shards; // the owner pops the back, thieves pop the front
+        std::thread thread;
+    };
+
+    void enqueue(const size_t worker_index, const size_t shard_index) {
+        // Counted before it can be taken, so m_queued never goes below zero.
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_queued.fetch_add(1);
+        }
+        worker& w = *m_workers[worker_index];
+        {
+            std::lock_guard<std::mutex> lock(w.mutex);
+            w.shards.push_back(shard_index);
+        }
+        m_sleepCv.notify_one();
+    }
+    bool take(const size_t worker_index, size_t& shard_index) {
+        {
+            worker& w = *m_workers[worker_index];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            if (!w.shards.empty()) {
+                shard_index = w.shards.back();
+                w.shards.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < m_workers.size(); ++i) {
+            worker& victim = *m_workers[(worker_index + i) % m_workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.shards.empty()) {
+                shard_index = victim.shards.front();
+                victim.shards.pop_front();
+                m_steals.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+    void run_worker(const size_t worker_index) {
+        while (true) {
+            size_t shard_index;
+            if (take(worker_index, shard_index)) {
+                m_queued.fetch_sub(1);
+                process(*m_shards[shard_index]);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_sleepCv.wait(lock, [this] { return m_stop || m_queued > 0; });
+            if (m_stop && m_queued == 0) {
+                return;
+            }
+        }
+    }
+    // Applies the inbox until it stays empty, then releases the shard.
+    void process(shard& s) {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                if (s.inbox.empty()) {
+                    s.scheduled = false;
+                    return;
+                }
+                s.work.swap(s.inbox);
+            }
+            for (const entry_type& entry : s.work) {
+                auto it = s.windows.find(entry.first);
+                if (it == s.windows.end()) {
+                    it = s.windows.emplace(entry.first, m_prototype).first;
+                }
+                it->second.push_back(entry.second);
+            }
+            const size_t applied = s.work.size();
+            s.work.clear();
+            if (m_pending.fetch_sub(applied) == applied) {
+                std::lock_guard<std::mutex> lock(m_idleMutex);
+                m_idleCv.notify_all();
+            }
+        }
+    }
+
+    const deque_t m_prototype;
+    hash_t m_hash;
+    std::vector<std::unique_ptr<shard>> m_shards;
+    std::vector<std::unique_ptr<worker>> m_workers;
+    std::vector<std::vector<entry_type>> m_scratch; // submit() partitions
+    std::atomic<uint64_t> m_pending{ 0 };           // submitted, not yet applied items
+    std::atomic<uint64_t> m_steals{ 0 };
+    std::mutex m_sleepMutex;
+    std::condition_variable m_sleepCv;
+    std::atomic<size_t> m_queued{ 0 }; // shards in the worker queues, grows under m_sleepMutex
+    bool m_stop = false;               // guarded by m_sleepMutex
+    std::mutex m_idleMutex;
+    std::condition_variable m_idleCv;
+};
@@ -0,0 +1,689 @@
+// sorted_flat_histogram
+// C++11, the sorted_flat_deque API for integer items from a small known range (8/16-bit
+// samples, quantized values). The sorted state is a count per value plus a hierarchical
+// occupancy bitset, so nothing is compared: the median and the quantile cursors step
+// over the empty values with ctz/clz scans. A circular_buffer of the items in insertion
+// order tells what to evict.
+//
+// push - O(1 + cursors)
+// pop - O(1 + cursors)
+// min - O(levels)
+// median - O(1)
+// quantile - O(1)
+// max - O(levels)
+// nth, rank - O(d/2) for d distinct values
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "circular_buffer.hpp"
+#include "sorted_flat_deque.hpp"
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#endif
+
+
+// The keys of sorted_flat_histogram, min_key and max_key inclusive: [-100, 100) is
+// sorted_flat_key_range<int8_t, -100, 99>.
+template <typename T, T min_value = std::numeric_limits<T>::min(),
+    T max_value = std::numeric_limits<T>::max()>
+struct sorted_flat_key_range {
+    static_assert(std::is_integral<T>::value, "sorted_flat_key_range requires an integral T");
+    static_assert(min_value <= max_value, "min_value > max_value");
+    using item_type = T;
+    static const T min_key = min_value;
+    static const T max_key = max_value;
+};
+
+inline int sorted_flat_histogram_ctz(const uint64_t word) {
+    #if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return static_cast<int>(index);
+    #elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanForward(&index, static_cast<unsigned long>(word))) {
+        return static_cast<int>(index);
+    }
+    _BitScanForward(&index, static_cast<unsigned long>(word >> 32));
+    return static_cast<int>(index) + 32;
+    #else
+    return __builtin_ctzll(word);
+    #endif
+}
+// The index of the highest set bit.
+inline int sorted_flat_histogram_msb(const uint64_t word) {
+    #if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, word);
+    return static_cast<int>(index);
+    #elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanReverse(&index, static_cast<unsigned long>(word >> 32))) {
+        return static_cast<int>(index) + 32;
+    }
+    _BitScanReverse(&index, static_cast<unsigned long>(word));
+    return static_cast<int>(index);
+    #else
+    return 63 - __builtin_clzll(word);
+    #endif
+}
+
+// The words of a level of sorted_flat_histogram_bitset<bits>.
+constexpr size_t sorted_flat_histogram_words(const size_t bits, const uint8_t level) {
+    return level == 0 ? (bits + 63) / 64 : (sorted_flat_histogram_words(bits, level - 1) + 63) / 64;
+}
+constexpr uint8_t sorted_flat_histogram_levels(const size_t bits, const uint8_t level = 0) {
+    return sorted_flat_histogram_words(bits, level) <= 1
+        ? level + 1 : sorted_flat_histogram_levels(bits, level + 1);
+}
+constexpr size_t sorted_flat_histogram_offset(const size_t bits, const uint8_t level) {
+    return level == 0 ? 0 : sorted_flat_histogram_offset(bits, level - 1)
+        + sorted_flat_histogram_words(bits, level - 1);
+}
+
+// A bit per value, and every level above has a bit per non-zero word of the level below,
+// up to a single word. next() and prev() go up until a word has a bit, then down.
+template <size_t bits>
+class sorted_flat_histogram_bitset {
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    sorted_flat_histogram_bitset() : m_words(offset(levels), 0) {
+    }
+
+    void set(const size_t index) {
+        for (uint8_t level = 0; level < levels; ++level) {
+            uint64_t& word = m_words[offset(level) + (index >> (6 * level) >> 6)];
+            const bool wasEmpty = word == 0;
+            word |= uint64_t(1) << ((index >> (6 * level)) & 63);
+            if (!wasEmpty) {
+                return;
+            }
+        }
+    }
+    void reset(const size_t index) {
+        for (uint8_t level = 0; level < levels; ++level) {
+            uint64_t& word = m_words[offset(level) + (index >> (6 * level) >> 6)];
+            word &= ~(uint64_t(1) << ((index >> (6 * level)) & 63));
+            if (word != 0) {
+                return;
+            }
+        }
+    }
+    void clear() {
+        std::fill(m_words.begin(), m_words.end(), 0);
+    }
+    // The first set bit >= index, npos if none.
+    size_t next(const size_t index) const {
+        return index >= bits ? npos : next(0, index);
+    }
+    // The last set bit <= index, npos if none.
+    size_t prev(const size_t index) const {
+        return index == npos ? npos : prev(0, index < bits ? index : bits - 1);
+    }
+
+private:
+    static const uint8_t levels = sorted_flat_histogram_levels(bits);
+    static size_t words(const uint8_t level) {
+        return sorted_flat_histogram_words(bits, level);
+    }
+    static size_t offset(const uint8_t level) {
+        return sorted_flat_histogram_offset(bits, level);
+    }
+
+    size_t next(const uint8_t level, const size_t index) const {
+        const size_t word = index >> 6;
+        if (level == levels || word >= words(level)) {
+            return npos;
+        }
+        const uint64_t found = m_words[offset(level) + word] & (~uint64_t(0) << (index & 63));
+        if (found != 0) {
+            return (word << 6) + sorted_flat_histogram_ctz(found);
+        }
+        const size_t upper = next(level + 1, word + 1);
+        if (upper == npos) {
+            return npos;
+        }
+        return (upper << 6) + sorted_flat_histogram_ctz(m_words[offset(level) + upper]);
+    }
+    size_t prev(const uint8_t level, const size_t index) const {
+        const size_t word = index >> 6;
+        const uint64_t found = m_words[offset(level) + word] & (~uint64_t(0) >> (63 - (index & 63)));
+        if (found != 0) {
+            return (word << 6) + sorted_flat_histogram_msb(found);
+        }
+        if (word == 0) {
+            return npos;
+        }
+        const size_t upper = prev(level + 1, word - 1);
+        if (upper == npos) {
+            return npos;
+        }
+        return (upper << 6) + sorted_flat_histogram_msb(m_words[offset(level) + upper]);
+    }
+
+    std::vector<uint64_t> m_words; // level 0 first
+};
+
+template <size_t bits>
+const size_t sorted_flat_histogram_bitset<bits>::npos;
+template <size_t bits>
+const uint8_t sorted_flat_histogram_bitset<bits>::levels;
+
+// Equal items are indistinguishable, so min(), median(), nth() etc. return by value
+// and the iterator yields the values. Pushing an item outside of range_t throws
+// std::out_of_range. The counts take sizeof(position_t) per value of the range.
+template <typename item_t, typename range_t = sorted_flat_key_range<item_t>,
+    typename offset_t = sorted_flat_position_t>
+class sorted_flat_histogram {
+public:
+    using position_t = offset_t;
+    static const position_t position_max = static_cast<position_t>(-1);
+    using item_type = item_t;
+    using value_type = item_t;
+    using range_type = range_t;
+    static_assert(std::is_integral<item_t>::value, "sorted_flat_histogram requires an integral item_t");
+
+private:
+    static constexpr int64_t min_key() {
+        return static_cast<int64_t>(range_t::min_key);
+    }
+    static const size_t span = static_cast<size_t>(
+        static_cast<int64_t>(range_t::max_key) - static_cast<int64_t>(range_t::min_key) + 1);
+    static_assert(span <= (size_t(1) << 24), "the key range is wider than 2^24 values");
+    using bitset_t = sorted_flat_histogram_bitset<span>;
+    static const size_t npos = bitset_t::npos;
+
+public:
+    sorted_flat_histogram() : m_counts(span, 0) {
+        clear();
+    }
+    explicit sorted_flat_histogram(const position_t max_size) : m_counts(span, 0) {
+        clear();
+        set_max_size(max_size);
+    }
+
+    void set_max_size(const position_t max_size, const bool remove_from_front = true) {
+        if (max_size == this->max_size()) {
+            return;
+        }
+        if (remove_from_front) {
+            while (size() > max_size) {
+                pop_front();
+            }
+        }
+        else {
+            while (size() > max_size) {
+                pop_back();
+            }
+        }
+        // The counts keep no offsets, nothing to remap.
+        m_fifo.set_max_size(max_size, remove_from_front);
+    }
+    void clear() {
+        m_fifo.clear();
+        std::fill(m_counts.begin(), m_counts.end(), 0);
+        m_occupied.clear();
+        m_distinct = 0;
+        m_median = cursor();
+        reset_quantiles();
+    }
+    void shrink_to_fit() {
+        m_fifo.shrink_to_fit();
+    }
+    void swap(sorted_flat_histogram& other) {
+        m_fifo.swap(other.m_fifo);
+        m_counts.swap(other.m_counts);
+        std::swap(m_occupied, other.m_occupied);
+        std::swap(m_distinct, other.m_distinct);
+        std::swap(m_median, other.m_median);
+        m_quantiles.swap(other.m_quantiles);
+    }
+
+    void push_back(const item_t item) {
+        if (max_size() == 0) {
+            return;
+        }
+        const size_t bucket = bucket_of(item);
+        if (size() >= max_size()) {
+            pop_front();
+        }
+        m_fifo.push_back(item);
+        add(bucket);
+    }
+    void push_front(const item_t item) {
+        if (max_size() == 0) {
+            return;
+        }
+        const size_t bucket = bucket_of(item);
+        if (size() >= max_size()) {
+            pop_back();
+        }
+        m_fifo.push_front(item);
+        add(bucket);
+    }
+    // Same result as push_back of every item in [first, last).
+    template <typename InputIt>
+    void push_back(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            push_back(*first);
+        }
+    }
+    item_t pop_front() {
+        if (empty()) {
+            throw std::logic_error("m_fifo.empty()");
+        }
+        const item_t item = m_fifo.pop_front();
+        remove(bucket_of(item));
+        return item;
+    }
+    // Same result as count calls of pop_front().
+    void pop_front(const position_t count) {
+        if (count > size()) {
+            throw std::logic_error("count > size()");
+        }
+        for (position_t i = 0; i < count; ++i) {
+            pop_front();
+        }
+    }
+    item_t pop_back() {
+        if (empty()) {
+            throw std::logic_error("m_fifo.empty()");
+        }
+        const item_t item = m_fifo.pop_back();
+        remove(bucket_of(item));
+        return item;
+    }
+
+    const item_t& front() const {
+        return m_fifo.front();
+    }
+    const item_t& back() const {
+        return m_fifo.back();
+    }
+    item_t min() const {
+        if (empty()) {
+            throw std::logic_error("m_min == position_max");
+        }
+        return key_of(m_occupied.next(0));
+    }
+    item_t median() const {
+        if (empty()) {
+            throw std::logic_error("m_middle == position_max");
+        }
+        return key_of(m_median.bucket);
+    }
+    item_t max() const {
+        if (empty()) {
+            throw std::logic_error("m_max == position_max");
+        }
+        return key_of(m_occupied.prev(span - 1));
+    }
+    // The cursor of fraction q points to the item at position floor(q * (size() - 1)),
+    // as in sorted_flat_deque.
+    position_t add_quantile(const double fraction) {
+        if (!(fraction >= 0.0 && fraction <= 1.0)) {
+            throw std::invalid_argument("fraction is out of [0, 1]");
+        }
+        cursor added;
+        added.scale = static_cast<uint64_t>(std::ceil(fraction * 4294967296.0));
+        m_quantiles.push_back(added);
+        place(m_quantiles.back());
+        return static_cast<position_t>(m_quantiles.size() - 1);
+    }
+    void set_quantiles(const std::vector<double>& fractions) {
+        clear_quantiles();
+        for (const double fraction : fractions) {
+            add_quantile(fraction);
+        }
+    }
+    void clear_quantiles() {
+        m_quantiles.clear();
+    }
+    position_t quantiles_count() const {
+        return static_cast<position_t>(m_quantiles.size());
+    }
+    item_t quantile(const position_t index) const {
+        const cursor& found = m_quantiles.at(index);
+        if (found.bucket == npos) {
+            throw std::logic_error("quantile offset == position_max");
+        }
+        return key_of(found.bucket);
+    }
+    // nth(0) is the min, nth(size() - 1) is the max.
+    item_t nth(const position_t rank) const {
+        if (rank >= size()) {
+            throw std::out_of_range("rank >= size()");
+        }
+        size_t bucket = m_median.bucket;
+        position_t start = static_cast<position_t>(m_median.pos - m_median.index);
+        while (rank < start) {
+            bucket = m_occupied.prev(bucket - 1);
+            start -= m_counts[bucket];
+        }
+        while (rank >= start + m_counts[bucket]) {
+            start += m_counts[bucket];
+            bucket = m_occupied.next(bucket + 1);
+        }
+        return key_of(bucket);
+    }
+    // The number of items less than the item.
+    position_t count_less(const item_t item) const {
+        return count_before(item, false);
+    }
+    // The number of items not greater than the item.
+    position_t rank_of(const item_t item) const {
+        return count_before(item, true);
+    }
+
+    position_t size() const {
+        return static_cast<position_t>(m_fifo.size());
+    }
+    position_t max_size() const {
+        return static_cast<position_t>(m_fifo.max_size());
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    // The number of different values.
+    position_t distinct() const {
+        return m_distinct;
+    }
+    // The number of items equal to the item.
+    position_t count(const item_t item) const {
+        return in_range(item) ? m_counts[bucket_index(item)] : 0;
+    }
+
+    // BidirectionalIterator over the sorted values, the reference is to a copy
+    // inside the iterator.
+    class const_iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = item_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const item_t*;
+        using reference = const item_t&;
+
+        const_iterator() {}
+        const_iterator(const size_t bucket, const position_t index,
+                const sorted_flat_histogram* ptr) : m_ptr(ptr), m_bucket(bucket), m_index(index) {
+            m_value = bucket == npos ? item_t() : key_of(bucket);
+        }
+        const item_t& operator*() const {
+            return m_value;
+        }
+        const item_t* operator->() const {
+            return &m_value;
+        }
+        bool operator==(const const_iterator& other) const {
+            return (m_bucket == other.m_bucket) && (m_index == other.m_index)
+                && (m_ptr == other.m_ptr);
+        }
+        bool operator!=(const const_iterator& other) const {
+            return !(*this == other);
+        }
+
+        const_iterator& operator++() { // Prefix increment
+            if (m_bucket == npos) {
+                throw std::logic_error("m_nodeIdx == position_max");
+            }
+            if (m_index + 1 < m_ptr->m_counts[m_bucket]) {
+                m_index += 1;
+                return *this;
+            }
+            m_bucket = m_ptr->m_occupied.next(m_bucket + 1);
+            m_index = 0;
+            m_value = m_bucket == npos ? item_t() : key_of(m_bucket);
+            return *this;
+        }
+        const_iterator operator++(int) { // Postfix increment
+            const_iterator temp = *this;
+            this->operator++();
+            return temp;
+        }
+        const_iterator& operator--() { // Prefix decrement
+            if (m_index > 0) {
+                m_index -= 1;
+                return *this;
+            }
+            const size_t bucket = m_bucket == npos
+                ? m_ptr->m_occupied.prev(span - 1)
+                : m_ptr->m_occupied.prev(m_bucket - 1);
+            if (bucket == npos) {
+                throw std::logic_error("prevOffset == position_max");
+            }
+            m_bucket = bucket;
+            m_index = m_ptr->m_counts[bucket] - 1;
+            m_value = key_of(bucket);
+            return *this;
+        }
+        const_iterator operator--(int) { // Postfix decrement
+            const_iterator temp = *this;
+            this->operator--();
+            return temp;
+        }
+    private:
+        const sorted_flat_histogram* m_ptr = nullptr;
+        size_t m_bucket = npos;
+        position_t m_index = 0;
+        item_t m_value = item_t();
+    };
+    using iterator = const_iterator;
+
+    const_iterator begin() const {
+        return const_iterator(empty() ? npos : m_occupied.next(0), 0, this);
+    }
+    const_iterator median_it() const {
+        return empty() ? end() : const_iterator(m_median.bucket, m_median.index, this);
+    }
+    const_iterator end() const {
+        return const_iterator(npos, 0, this);
+    }
+    const_iterator cbegin() const {
+        return begin();
+    }
+    const_iterator cmedian_it() const {
+        return median_it();
+    }
+    const_iterator cend() const {
+        return end();
+    }
+
+private:
+    // An item of the sorted order: the value, the index among its equal items and the rank.
+    struct cursor {
+        position_t desired_pos(const position_t size) const {
+            return size ? static_cast<position_t>(((size - 1) * scale) >> 32) : 0;
+        }
+        uint64_t scale = uint64_t(1) << 31; // fraction * 2^32, the median by default
+        size_t bucket = npos;
+        position_t index = 0;
+        position_t pos = 0;
+    };
+
+    static bool in_range(const item_t item) {
+        return !(item < range_t::min_key) && !(range_t::max_key < item);
+    }
+    static size_t bucket_index(const item_t item) {
+        return static_cast<size_t>(static_cast<int64_t>(item) - min_key());
+    }
+    static size_t bucket_of(const item_t item) {
+        if (!in_range(item)) {
+            throw std::out_of_range("item is out of range_t");
+        }
+        return bucket_index(item);
+    }
+    static item_t key_of(const size_t bucket) {
+        return static_cast<item_t>(static_cast<int64_t>(bucket) + min_key());
+    }
+
+    // The new item goes after the equal ones, as in sorted_flat_deque.
+    void add(const size_t bucket) {
+        if (m_counts[bucket]++ == 0) {
+            m_occupied.set(bucket);
+            m_distinct += 1;
+        }
+        if (size() == 1) {
+            m_median.bucket = bucket;
+            m_median.index = 0;
+            m_median.pos = 0;
+            place_quantiles();
+            return;
+        }
+        added(m_median, bucket);
+        move_to(m_median, (size() - 1) >> 1);
+        for (auto& quantile : m_quantiles) {
+            added(quantile, bucket);
+            move_to(quantile, quantile.desired_pos(size()));
+        }
+    }
+    void remove(const size_t bucket) {
+        const position_t left = --m_counts[bucket];
+        if (left == 0) {
+            m_occupied.reset(bucket);
+            m_distinct -= 1;
+        }
+        if (empty()) {
+            m_median = cursor();
+            reset_quantiles();
+            return;
+        }
+        removed(m_median, bucket, left);
+        move_to(m_median, (size() - 1) >> 1);
+        for (auto& quantile : m_quantiles) {
+            removed(quantile, bucket, left);
+            move_to(quantile, quantile.desired_pos(size()));
+        }
+    }
+    void added(cursor& moved, const size_t bucket) const {
+        if (bucket < moved.bucket) {
+            moved.pos += 1;
+        }
+    }
+    // The removed item is taken as the last of its equal ones, so a cursor on it is
+    // the only one that has to move.
+    void removed(cursor& moved, const size_t bucket, const position_t left) const {
+        if (bucket < moved.bucket) {
+            moved.pos -= 1;
+        }
+        else if (bucket == moved.bucket && moved.index == left) {
+            if (left > 0) {
+                moved.index -= 1;
+                moved.pos -= 1;
+                return;
+            }
+            const size_t next = m_occupied.next(bucket + 1);
+            if (next != npos) {
+                moved.bucket = next; // the rank stays
+                moved.index = 0;
+                return;
+            }
+            moved.bucket = m_occupied.prev(bucket - 1);
+            moved.index = m_counts[moved.bucket] - 1;
+            moved.pos -= 1;
+        }
+    }
+    void move_to(cursor& moved, const position_t desiredPos) const {
+        while (moved.pos > desiredPos) { // <-
+            if (moved.index > 0) {
+                moved.index -= 1;
+            }
+            else {
+                moved.bucket = m_occupied.prev(moved.bucket - 1);
+                moved.index = m_counts[moved.bucket] - 1;
+            }
+            moved.pos -= 1;
+        }
+        while (moved.pos < desiredPos) { // ->
+            if (moved.index + 1 < m_counts[moved.bucket]) {
+                moved.index += 1;
+            }
+            else {
+                moved.bucket = m_occupied.next(moved.bucket + 1);
+                moved.index = 0;
+            }
+            moved.pos += 1;
+        }
+    }
+    // From the min, one walk over the occupied values.
+    void place(cursor& placed) const {
+        if (empty()) {
+            return;
+        }
+        const position_t desiredPos = placed.desired_pos(size());
+        size_t bucket = m_occupied.next(0);
+        position_t start = 0;
+        while (desiredPos >= start + m_counts[bucket]) {
+            start += m_counts[bucket];
+            bucket = m_occupied.next(bucket + 1);
+        }
+        placed.bucket = bucket;
+        placed.index = desiredPos - start;
+        placed.pos = desiredPos;
+    }
+    void place_quantiles() {
+        for (auto& quantile : m_quantiles) {
+            place(quantile);
+        }
+    }
+    void reset_quantiles() {
+        for (auto& quantile : m_quantiles) {
+            quantile.bucket = npos;
+            quantile.index = 0;
+            quantile.pos = 0;
+        }
+    }
+    // The items in the values before the one of the item, plus its own if inclusive,
+    // summed over the occupied values between the median and the item.
+    position_t count_before(const item_t item, const bool inclusive) const {
+        if (empty() || item < range_t::min_key) {
+            return 0;
+        }
+        if (range_t::max_key < item) {
+            return size();
+        }
+        const size_t target = bucket_index(item);
+        position_t less = static_cast<position_t>(m_median.pos - m_median.index);
+        if (target >= m_median.bucket) {
+            for (size_t bucket = m_median.bucket; bucket < target;
+                    bucket = m_occupied.next(bucket + 1)) {
+                less += m_counts[bucket];
+            }
+        }
+        else {
+            for (size_t bucket = m_occupied.prev(m_median.bucket - 1);
+                    bucket != npos && bucket >= target; bucket = m_occupied.prev(bucket - 1)) {
+                less -= m_counts[bucket];
+            }
+        }
+        return inclusive ? static_cast<position_t>(less + m_counts[target]) : less;
+    }
+
+    circular_buffer<item_t> m_fifo; // the insertion order
+    std::vector<position_t> m_counts;
+    bitset_t m_occupied;
+    position_t m_distinct = 0;
+    cursor m_median;
+    std::vector<cursor> m_quantiles;
+};
+
+template <typename item_t, typename range_t, typename offset_t>
+const typename sorted_flat_histogram<item_t, range_t, offset_t>::position_t
+    sorted_flat_histogram<item_t, range_t, offset_t>::position_max;
+template <typename item_t, typename range_t, typename offset_t>
+const size_t sorted_flat_histogram<item_t, range_t, offset_t>::span;
+template <typename item_t, typename range_t, typename offset_t>
+const size_t sorted_flat_histogram<item_t, range_t, offset_t>::npos;
@@ -0,0 +1,371 @@
+// sorted_flat_mapped
+// C++11, a sorted_flat_deque that lives in a memory-mapped file and survives a crash or
+// a restart of the process. The nodes are kept in the file at their offsets (the links are
+// offsets, so the node buffer does not depend on where it is mapped), and the cursors,
+// the front offset and the size are written through to the file after every change.
+//
+// push, pop - same as deque_t, plus O(1 + quantiles) to write the state through
+// reopen - O(1); O(n log n) after a crash in the middle of a change
+// sync - msync of the dirty pages
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#if defined(_WIN32)
+#   ifndef NOMINMAX
+#       define NOMINMAX
+#   endif
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+#include "sorted_flat_deque.hpp"
+
+// A file mapped for reading and writing, shared with the page cache.
+class sorted_flat_mapped_file {
+public:
+    sorted_flat_mapped_file() {
+    }
+    sorted_flat_mapped_file(const sorted_flat_mapped_file&) = delete;
+    sorted_flat_mapped_file& operator=(const sorted_flat_mapped_file&) = delete;
+    ~sorted_flat_mapped_file() {
+        close();
+    }
+
+    // Maps the whole file. A missing or empty file is created with size zero bytes.
+    void open(const std::string& path, const size_t size) {
+        close();
+        #if defined(_WIN32)
+        const HANDLE file = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        LARGE_INTEGER fileSize;
+        if (!::GetFileSizeEx(file, &fileSize)) {
+            ::CloseHandle(file);
+            throw std::runtime_error("cannot open " + path);
+        }
+        m_created = fileSize.QuadPart == 0;
+        const uint64_t mapSize = m_created ? size : static_cast<uint64_t>(fileSize.QuadPart);
+        // Extends a new file to mapSize.
+        const HANDLE mapping = ::CreateFileMappingA(file, nullptr, PAGE_READWRITE,
+            static_cast<DWORD>(mapSize >> 32), static_cast<DWORD>(mapSize), nullptr);
+        void* data = mapping != nullptr
+            ? ::MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0) : nullptr;
+        if (mapping != nullptr) {
+            ::CloseHandle(mapping);
+        }
+        if (data == nullptr) {
+            ::CloseHandle(file);
+            throw std::runtime_error("cannot map " + path);
+        }
+        m_file = file;
+        #else
+        const int file = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (file < 0) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        struct stat info;
+        if (::fstat(file, &info) != 0) {
+            ::close(file);
+            throw std::runtime_error("cannot open " + path);
+        }
+        m_created = info.st_size == 0;
+        if (m_created && ::ftruncate(file, static_cast<off_t>(size)) != 0) {
+            ::close(file);
+            throw std::runtime_error("cannot resize " + path);
+        }
+        const uint64_t mapSize = m_created ? size : static_cast<uint64_t>(info.st_size);
+        void* data = mapSize > 0 ? ::mmap(nullptr, static_cast<size_t>(mapSize),
+            PROT_READ | PROT_WRITE, MAP_SHARED, file, 0) : MAP_FAILED;
+        ::close(file); // the mapping keeps the file open
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("cannot map " + path);
+        }
+        #endif
+        m_data = static_cast<char*>(data);
+        m_size = static_cast<size_t>(mapSize);
+    }
+    void close() {
+        if (m_data == nullptr) {
+            return;
+        }
+        #if defined(_WIN32)
+        ::UnmapViewOfFile(m_data);
+        ::CloseHandle(m_file);
+        m_file = nullptr;
+        #else
+        ::munmap(m_data, m_size);
+        #endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+    // Writes the dirty pages to the disk; wait blocks until they are written.
+    void flush(const bool wait) {
+        if (m_data == nullptr) {
+            return;
+        }
+        #if defined(_WIN32)
+        const bool flushed = ::FlushViewOfFile(m_data, 0)
+            && (!wait || ::FlushFileBuffers(m_file));
+        #else
+        const bool flushed = ::msync(m_data, m_size, wait ? MS_SYNC : MS_ASYNC) == 0;
+        #endif
+        if (!flushed) {
+            throw std::runtime_error("the mapped file flush failed");
+        }
+    }
+
+    char* data() const {
+        return m_data;
+    }
+    size_t size() const {
+        return m_size;
+    }
+    // The last open() created the file.
+    bool created() const {
+        return m_created;
+    }
+
+private:
+    char* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_created = false;
+    #if defined(_WIN32)
+    HANDLE m_file = nullptr;
+    #endif
+};
+
+// When sorted_flat_mapped flushes the dirty pages, besides sync() and the destructor.
+struct sorted_flat_flush {
+    explicit sorted_flat_flush(const uint32_t every_changes = 0, const bool wait_written = false)
+        : every(every_changes), wait(wait_written) {
+    }
+    uint32_t every; // changes between the flushes, 0 - only sync() and the destructor
+    bool wait;      // msync(MS_SYNC) instead of MS_ASYNC
+};
+
+// The file holds a control block, two state slots (save_state() of the deque, written in
+// turn, the control block points to the last complete one) and the node storage:
+//   [control][state 0][state 1] ... [nodes (and split items), page aligned]
+// A change sets the busy flag first and clears it after the state is written. Without the
+// flag the file is a consistent snapshot for a reopen in O(1): everything written to the
+// mapping is in the page cache even if the process crashed. With the flag set the change
+// was interrupted, and the items from the last state's front offset are sorted again: the
+// interrupted change is lost, except for the items it already wrote over the evicted ones.
+// A power loss keeps what the last flush wrote; sync() after the important changes.
+// item_t has to be trivially copyable, the file is of the same instantiation and platform.
+// The comparator, the accessor and the allocator of the deque are not in the file.
+template <typename deque_t>
+class sorted_flat_mapped {
+public:
+    using deque_type = deque_t;
+    using item_type = typename deque_t::item_type;
+    using position_t = typename deque_t::position_t;
+    static_assert(std::is_trivially_copyable<item_type>::value,
+        "sorted_flat_mapped requires a trivially copyable item_t");
+
+    // A new file takes the content, max_size() and the quantiles of deque. An existing file
+    // keeps its own, deque only gives the comparator, the accessor and the allocator.
+    // A file of another instantiation or not of sorted_flat_mapped throws
+    // std::runtime_error and is left as it is.
+    explicit sorted_flat_mapped(const std::string& path, deque_t deque = deque_t(),
+            const sorted_flat_flush flush = sorted_flat_flush())
+            : m_deque(std::move(deque)), m_flush(flush) {
+        const size_t slotSize = align(m_deque.state_size(), 64);
+        const size_t storageOffset = align(sizeof(control) + 2 * slotSize, 4096);
+        m_file.open(path, storageOffset + m_deque.storage_size());
+        if (m_file.size() < sizeof(control)) {
+            throw std::runtime_error("the file is not of sorted_flat_mapped");
+        }
+        if (m_file.created()) {
+            create(slotSize, storageOffset);
+        }
+        else {
+            reopen();
+        }
+    }
+    sorted_flat_mapped(const sorted_flat_mapped&) = delete;
+    sorted_flat_mapped& operator=(const sorted_flat_mapped&) = delete;
+    ~sorted_flat_mapped() {
+        try {
+            sync();
+        }
+        catch (...) {
+        }
+    }
+
+    void push_back(const item_type& item) {
+        change_scope scope(*this);
+        m_deque.push_back(item);
+        scope.commit();
+    }
+    template <typename ForwardIt>
+    void push_back(ForwardIt first, ForwardIt last) {
+        change_scope scope(*this);
+        m_deque.push_back(first, last);
+        scope.commit();
+    }
+    void push_front(const item_type& item) {
+        change_scope scope(*this);
+        m_deque.push_front(item);
+        scope.commit();
+    }
+    item_type pop_front() {
+        change_scope scope(*this);
+        item_type item = m_deque.pop_front();
+        scope.commit();
+        return item;
+    }
+    item_type pop_back() {
+        change_scope scope(*this);
+        item_type item = m_deque.pop_back();
+        scope.commit();
+        return item;
+    }
+    void clear() {
+        change_scope scope(*this);
+        m_deque.clear();
+        scope.commit();
+    }
+    // The reads: min(), median(), quantile(), iteration.
+    const deque_t& deque() const {
+        return m_deque;
+    }
+
+    // Writes the dirty pages to the disk and waits for them.
+    void sync() {
+        m_file.flush(true);
+        m_changes = 0;
+    }
+    void set_flush(const sorted_flat_flush flush) {
+        m_flush = flush;
+    }
+    // The file was created by the constructor.
+    bool created() const {
+        return m_file.created();
+    }
+    // The file was left in the middle of a change and the items were sorted again.
+    bool recovered() const {
+        return m_recovered;
+    }
+
+private:
+    struct control {
+        uint32_t magic;
+        uint32_t version;
+        volatile uint32_t busy;
+        volatile uint32_t committed; // the state slot of the last change
+        uint64_t slotSize;
+        uint64_t storageOffset;
+        uint64_t storageSize;
+    };
+    static const uint32_t control_magic = 0x4D444653; // "SFDM"
+    static const uint32_t control_version = 1;
+
+    // Sets the busy flag for a change and writes the state through after it, also when
+    // the change throws (the deque then keeps its content).
+    struct change_scope {
+        explicit change_scope(sorted_flat_mapped& owner) : owner(owner) {
+            owner.header().busy = 1;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        }
+        ~change_scope() {
+            if (!committed) {
+                owner.write_state();
+            }
+        }
+        void commit() {
+            committed = true;
+            owner.write_state();
+            owner.flush_by_policy();
+        }
+        sorted_flat_mapped& owner;
+        bool committed = false;
+    };
+
+    static size_t align(const size_t size, const size_t alignment) {
+        return (size + alignment - 1) / alignment * alignment;
+    }
+    control& header() {
+        return *reinterpret_cast<control*>(m_file.data());
+    }
+    char* state_slot(const uint32_t slot) {
+        return m_file.data() + sizeof(control) + slot * m_slotSize;
+    }
+    void create(const size_t slotSize, const size_t storageOffset) {
+        if (m_file.size() != storageOffset + m_deque.storage_size()) {
+            throw std::runtime_error("the file is not of sorted_flat_mapped");
+        }
+        m_slotSize = slotSize;
+        control& fresh = header();
+        fresh.busy = 0;
+        fresh.committed = 0;
+        fresh.slotSize = slotSize;
+        fresh.storageOffset = storageOffset;
+        fresh.storageSize = m_deque.storage_size();
+        m_deque.use_storage(m_file.data() + storageOffset);
+        m_deque.save_state(state_slot(0), m_slotSize);
+        // The magic goes last, a file that was not created completely has none and the next
+        // open refuses it.
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        fresh.version = control_version;
+        fresh.magic = control_magic;
+        sync();
+    }
+    void reopen() {
+        const control& found = header();
+        if (found.magic != control_magic || found.version != control_version
+                || found.committed > 1 || found.slotSize > m_file.size()
+                || found.storageOffset < sizeof(control) + 2 * found.slotSize
+                || found.storageOffset > m_file.size()
+                || found.storageSize > m_file.size() - found.storageOffset) {
+            throw std::runtime_error("the file is not of sorted_flat_mapped");
+        }
+        m_slotSize = static_cast<size_t>(found.slotSize);
+        m_recovered = found.busy != 0;
+        m_deque.attach_storage(m_file.data() + found.storageOffset,
+            static_cast<size_t>(found.storageSize), state_slot(found.committed), m_slotSize,
+            m_recovered ? sorted_flat_attach::relink : sorted_flat_attach::trust);
+        if (m_recovered) {
+            write_state();
+            sync();
+        }
+    }
+    // The state goes to the other slot, so the committed one stays complete until then.
+    void write_state() {
+        control& current = header();
+        const uint32_t slot = current.committed ^ 1;
+        m_deque.save_state(state_slot(slot), m_slotSize);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        current.committed = slot;
+        current.busy = 0;
+    }
+    void flush_by_policy() {
+        if (m_flush.every > 0 && ++m_changes >= m_flush.every) {
+            m_file.flush(m_flush.wait);
+            m_changes = 0;
+        }
+    }
+
+    sorted_flat_mapped_file m_file; // outlives m_deque, which keeps the nodes in it
+    deque_t m_deque;
+    sorted_flat_flush m_flush;
+    size_t m_slotSize = 0;
+    uint32_t m_changes = 0;
+    bool m_recovered = false;
+};
@@ -0,0 +1,164 @@
+// sorted_flat_publisher
+// C++11, single writer / many readers publication of the sorted_flat_deque statistics.
+// The writer owns the deque and publishes a small snapshot (min, median, max, size
+// and up to max_quantiles quantiles) after every push or batch through a seqlock.
+// Readers never block the writer: they copy the snapshot and retry if it was torn.
+//
+// publish - O(1 + max_quantiles), wait-free
+// snapshot - O(1 + max_quantiles), retries while the writer publishes
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// A plain aggregate, copied with memcpy; value-initialize it: sorted_flat_snapshot<T> out{}.
+template <typename item_t, size_t max_quantiles = 0>
+struct sorted_flat_snapshot {
+    item_t min;
+    item_t median;
+    item_t max;
+    // The quantiles added to the deque, up to max_quantiles of them.
+    item_t quantiles[max_quantiles > 0 ? max_quantiles : 1];
+    uint32_t quantiles_count;
+    uint32_t size;
+    // The number of publish() calls before this snapshot, filled in by the reader.
+    uint64_t version;
+};
+
+// The items are copied through relaxed atomic words, so item_t has to be
+// trivially copyable. Only the writer thread may call the non-const methods.
+template <typename deque_t, size_t max_quantiles = 0>
+class sorted_flat_publisher {
+public:
+    using deque_type = deque_t;
+    using item_type = typename deque_t::item_type;
+    using snapshot_type = sorted_flat_snapshot<item_type, max_quantiles>;
+    static_assert(std::is_trivially_copyable<item_type>::value,
+        "sorted_flat_publisher requires a trivially copyable item_t");
+
+    explicit sorted_flat_publisher(deque_t deque = deque_t()) : m_deque(std::move(deque)) {
+        for (auto& word : m_words) {
+            word.store(0, std::memory_order_relaxed);
+        }
+        publish();
+    }
+    sorted_flat_publisher(const sorted_flat_publisher&) = delete;
+    sorted_flat_publisher& operator=(const sorted_flat_publisher&) = delete;
+
+    // Writer side
+
+    void push_back(const item_type& item) {
+        m_deque.push_back(item);
+        publish();
+    }
+    template <typename ForwardIt>
+    void push_back(ForwardIt first, ForwardIt last) {
+        m_deque.push_back(first, last);
+        publish();
+    }
+    void pop_front() {
+        m_deque.pop_front();
+        publish();
+    }
+    // For any other change; publish() afterwards.
+    deque_t& deque() {
+        return m_deque;
+    }
+    const deque_t& deque() const {
+        return m_deque;
+    }
+    void publish() {
+        snapshot_type snapshot{};
+        fill(snapshot);
+        uint64_t buffer[words] = {};
+        std::memcpy(buffer, &snapshot, snapshot_bytes);
+        const uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+        m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < words; ++i) {
+            m_words[i].store(buffer[i], std::memory_order_relaxed);
+        }
+        m_sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Reader side, any thread
+
+    // One attempt, false if the writer was publishing at the same time.
+    bool try_snapshot(snapshot_type& out) const {
+        const uint64_t sequence = m_sequence.load(std::memory_order_acquire);
+        if (sequence & 1) {
+            return false;
+        }
+        uint64_t buffer[words];
+        for (size_t i = 0; i < words; ++i) {
+            buffer[i] = m_words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_sequence.load(std::memory_order_relaxed) != sequence) {
+            return false;
+        }
+        std::memcpy(&out, buffer, snapshot_bytes);
+        out.version = sequence >> 1;
+        return true;
+    }
+    snapshot_type snapshot() const {
+        snapshot_type out{};
+        for (uint32_t attempt = 1; !try_snapshot(out); ++attempt) {
+            // The writer may be preempted in the middle of publish().
+            if ((attempt & 63) == 0) {
+                std::this_thread::yield();
+            }
+        }
+        return out;
+    }
+    uint64_t version() const {
+        return m_sequence.load(std::memory_order_acquire) >> 1;
+    }
+
+private:
+    // The version is not published, it comes from the sequence.
+    static_assert(std::is_trivially_copyable<snapshot_type>::value,
+        "the snapshot is copied through the words with memcpy");
+    static const size_t snapshot_bytes = offsetof(snapshot_type, version);
+    static const size_t words = (snapshot_bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    void fill(snapshot_type& snapshot) const {
+        snapshot.size = static_cast<uint32_t>(m_deque.size());
+        if (m_deque.empty()) {
+            return;
+        }
+        snapshot.min = m_deque.min();
+        snapshot.median = m_deque.median();
+        snapshot.max = m_deque.max();
+        fill_quantiles(snapshot, std::integral_constant<bool, (max_quantiles > 0)>());
+    }
+    void fill_quantiles(snapshot_type&, std::false_type) const {
+    }
+    void fill_quantiles(snapshot_type& snapshot, std::true_type) const {
+        const size_t count = m_deque.quantiles_count() < max_quantiles
+            ? m_deque.quantiles_count() : max_quantiles;
+        for (size_t i = 0; i < count; ++i) {
+            snapshot.quantiles[i] = m_deque.quantile(i);
+        }
+        snapshot.quantiles_count = static_cast<uint32_t>(count);
+    }
+
+    deque_t m_deque;
+    // Away from the deque, which the writer keeps changing.
+    alignas(64) std::atomic<uint64_t> m_sequence{ 0 };
+    std::atomic<uint64_t> m_words[words];
+};
+
+template <typename deque_t, size_t max_quantiles>
+const size_t sorted_flat_publisher<deque_t, max_quantiles>::snapshot_bytes;
+template <typename deque_t, size_t max_quantiles>
+const size_t sorted_flat_publisher<deque_t, max_quantiles>::words;
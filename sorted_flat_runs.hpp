@@ -0,0 +1,619 @@
+// sorted_flat_runs
+// C++11, the sorted_flat_deque API with run-length nodes, for streams with few distinct
+// values (quantized samples, small enums). Equal items share one run in the sorted
+// list of runs; the run keeps the count and a FIFO of its slots in the insertion order
+// buffer. The median is kept as (run, slot, index within the run).
+//
+// push - O(d/2) for d distinct values in the window
+// pop - O(1)
+// min - O(1)
+// median - O(1)
+// max - O(1)
+// rank - O(d/2)
+// nth - O(d/2 + the run length)
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "circular_buffer.hpp"
+#include "sorted_flat_deque.hpp"
+
+// Equal items (by compare_t) are kept in the insertion order, so the sorted sequence
+// is the one of sorted_flat_deque. The runs are allocated on demand and reused, the
+// memory follows the number of distinct values rather than max_size().
+template <typename item_t, typename compare_t = three_way_less<item_t>,
+    typename offset_t = sorted_flat_position_t>
+class sorted_flat_runs {
+public:
+    using position_t = offset_t;
+    static const position_t position_max = static_cast<position_t>(-1);
+    using item_type = item_t;
+    using value_type = item_t;
+    using comparator_t = compare_t;
+
+    sorted_flat_runs() {
+        clear();
+    }
+    explicit sorted_flat_runs(const position_t max_size,
+            const comparator_t comparator = comparator_t()) : m_comparator(comparator) {
+        clear();
+        set_max_size(max_size);
+    }
+
+    // The slots moved by circular_buffer::set_max_size() are remapped, O(n).
+    void set_max_size(const position_t max_size, const bool remove_from_front = true) {
+        if (max_size == this->max_size()) {
+            return;
+        }
+        if (remove_from_front) {
+            while (size() > max_size) {
+                pop_front();
+            }
+        }
+        else {
+            while (size() > max_size) {
+                pop_back();
+            }
+        }
+        const position_t oldFrontOffset = m_slots.front_offset();
+        m_slots.set_max_size(max_size, remove_from_front);
+        const position_t newFrontOffset = m_slots.front_offset();
+        if (empty() || newFrontOffset == oldFrontOffset) {
+            return;
+        }
+        const auto remap = [oldFrontOffset, newFrontOffset](position_t& offset) {
+            if (offset != position_max && offset >= oldFrontOffset) {
+                offset = newFrontOffset + (offset - oldFrontOffset);
+            }
+        };
+        for (position_t i = 0; i < m_slots.size(); ++i) {
+            slot& moved = m_slots.at(i);
+            remap(moved.olderOffset);
+            remap(moved.newerOffset);
+        }
+        for (position_t run = m_firstRun; run != position_max; run = m_runs[run].nextRun) {
+            remap(m_runs[run].oldestOffset);
+            remap(m_runs[run].newestOffset);
+        }
+        remap(m_medianOffset);
+    }
+    void clear() {
+        m_slots.clear();
+        m_runs.clear();
+        m_freeRun = position_max;
+        m_distinct = 0;
+        m_firstRun = position_max;
+        m_lastRun = position_max;
+        m_medianRun = position_max;
+        m_medianOffset = position_max;
+        m_medianIndex = 0;
+        m_medianPos = position_max;
+    }
+    void shrink_to_fit() {
+        m_slots.shrink_to_fit();
+        m_runs.shrink_to_fit();
+    }
+    void swap(sorted_flat_runs& other) {
+        std::swap(m_comparator, other.m_comparator);
+        m_slots.swap(other.m_slots);
+        m_runs.swap(other.m_runs);
+        std::swap(m_freeRun, other.m_freeRun);
+        std::swap(m_distinct, other.m_distinct);
+        std::swap(m_firstRun, other.m_firstRun);
+        std::swap(m_lastRun, other.m_lastRun);
+        std::swap(m_medianRun, other.m_medianRun);
+        std::swap(m_medianOffset, other.m_medianOffset);
+        std::swap(m_medianIndex, other.m_medianIndex);
+        std::swap(m_medianPos, other.m_medianPos);
+    }
+
+    void push_back(const item_t& item) {
+        if (max_size() == 0) {
+            return;
+        }
+        if (size() >= max_size()) {
+            pop_front();
+        }
+        m_slots.push_back(slot(item));
+        link_slot(m_slots.back_offset(), false);
+    }
+    void push_front(const item_t& item) {
+        if (max_size() == 0) {
+            return;
+        }
+        if (size() >= max_size()) {
+            pop_back();
+        }
+        m_slots.push_front(slot(item));
+        link_slot(m_slots.front_offset(), true);
+    }
+    // Same result as push_back of every item in [first, last).
+    template <typename InputIt>
+    void push_back(InputIt first, InputIt last) {
+        for (; first != last; ++first) {
+            push_back(*first);
+        }
+    }
+    item_t pop_front() {
+        if (empty()) {
+            throw std::logic_error("m_slots.empty()");
+        }
+        unlink_slot(m_slots.front_offset(), true);
+        return std::move(m_slots.pop_front().item);
+    }
+    item_t pop_back() {
+        if (empty()) {
+            throw std::logic_error("m_slots.empty()");
+        }
+        unlink_slot(m_slots.back_offset(), false);
+        return std::move(m_slots.pop_back().item);
+    }
+
+    const item_t& front() const {
+        return m_slots.front().item;
+    }
+    const item_t& back() const {
+        return m_slots.back().item;
+    }
+    const item_t& min() const {
+        if (m_firstRun == position_max) {
+            throw std::logic_error("m_firstRun == position_max");
+        }
+        return m_slots.at_offset_unchecked(m_runs[m_firstRun].oldestOffset).item;
+    }
+    const item_t& median() const {
+        if (m_medianOffset == position_max) {
+            throw std::logic_error("m_medianOffset == position_max");
+        }
+        return m_slots.at_offset_unchecked(m_medianOffset).item;
+    }
+    const item_t& max() const {
+        if (m_lastRun == position_max) {
+            throw std::logic_error("m_lastRun == position_max");
+        }
+        return m_slots.at_offset_unchecked(m_runs[m_lastRun].newestOffset).item;
+    }
+    // nth(0) is the min, nth(size() - 1) is the max.
+    const item_t& nth(const position_t rank) const {
+        if (rank >= size()) {
+            throw std::out_of_range("rank >= size()");
+        }
+        position_t run = m_medianRun;
+        position_t start = static_cast<position_t>(m_medianPos - m_medianIndex);
+        while (rank < start) {
+            run = m_runs[run].prevRun;
+            start -= m_runs[run].count;
+        }
+        while (rank >= start + m_runs[run].count) {
+            start += m_runs[run].count;
+            run = m_runs[run].nextRun;
+        }
+        // From the nearer end of the run.
+        const position_t index = rank - start;
+        position_t offset;
+        if (index < m_runs[run].count / 2) {
+            offset = m_runs[run].oldestOffset;
+            for (position_t i = 0; i < index; ++i) {
+                offset = m_slots.at_offset_unchecked(offset).newerOffset;
+            }
+        }
+        else {
+            offset = m_runs[run].newestOffset;
+            for (position_t i = m_runs[run].count - 1; i > index; --i) {
+                offset = m_slots.at_offset_unchecked(offset).olderOffset;
+            }
+        }
+        return m_slots.at_offset_unchecked(offset).item;
+    }
+    // The number of items less than the item.
+    position_t count_less(const item_t& item) const {
+        return count_before(item, 1);
+    }
+    // The number of items not greater than the item.
+    position_t rank_of(const item_t& item) const {
+        return count_before(item, 0);
+    }
+
+    position_t size() const {
+        return m_slots.size();
+    }
+    position_t max_size() const {
+        return m_slots.max_size();
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    // The number of runs, that is of distinct values.
+    position_t distinct() const {
+        return m_distinct;
+    }
+
+    // BidirectionalIterator over the sorted items, run by run.
+    class const_iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = item_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const item_t*;
+        using reference = const item_t&;
+
+        const_iterator() {}
+        const_iterator(const position_t run, const position_t offset,
+                const sorted_flat_runs* ptr) : m_ptr(ptr), m_run(run), m_offset(offset) {
+        }
+        const item_t& operator*() const {
+            return m_ptr->m_slots.at_offset(m_offset).item;
+        }
+        const item_t* operator->() const {
+            return &m_ptr->m_slots.at_offset(m_offset).item;
+        }
+        bool operator==(const const_iterator& other) const {
+            return (m_offset == other.m_offset) && (m_ptr == other.m_ptr);
+        }
+        bool operator!=(const const_iterator& other) const {
+            return (m_offset != other.m_offset) || (m_ptr != other.m_ptr);
+        }
+
+        const_iterator& operator++() { // Prefix increment
+            if (m_offset == position_max) {
+                throw std::logic_error("m_offset == position_max");
+            }
+            m_ptr->step_right(m_run, m_offset);
+            return *this;
+        }
+        const_iterator operator++(int) { // Postfix increment
+            const_iterator temp = *this;
+            this->operator++();
+            return temp;
+        }
+        const_iterator& operator--() { // Prefix decrement
+            if (m_offset == position_max) {
+                if (m_ptr->m_lastRun == position_max) {
+                    throw std::logic_error("m_offset == position_max && m_lastRun == position_max");
+                }
+                m_run = m_ptr->m_lastRun;
+                m_offset = m_ptr->m_runs[m_run].newestOffset;
+                return *this;
+            }
+            position_t run = m_run;
+            position_t offset = m_offset;
+            m_ptr->step_left(run, offset);
+            if (offset == position_max) {
+                throw std::logic_error("olderOffset == position_max");
+            }
+            m_run = run;
+            m_offset = offset;
+            return *this;
+        }
+        const_iterator operator--(int) { // Postfix decrement
+            const_iterator temp = *this;
+            this->operator--();
+            return temp;
+        }
+    private:
+        const sorted_flat_runs* m_ptr = nullptr;
+        position_t m_run = position_max;
+        position_t m_offset = position_max;
+    };
+    using iterator = const_iterator;
+
+    const_iterator begin() const {
+        return m_firstRun == position_max
+            ? end()
+            : const_iterator(m_firstRun, m_runs[m_firstRun].oldestOffset, this);
+    }
+    const_iterator median_it() const {
+        return const_iterator(m_medianRun, m_medianOffset, this);
+    }
+    const_iterator end() const {
+        return const_iterator(position_max, position_max, this);
+    }
+    const_iterator cbegin() const {
+        return begin();
+    }
+    const_iterator cmedian_it() const {
+        return median_it();
+    }
+    const_iterator cend() const {
+        return end();
+    }
+
+private:
+    // An item in the insertion order, linked to the older and newer items of its run.
+    struct slot {
+        explicit slot(const item_t& item_) : item(item_) {
+        }
+        item_t item;
+        position_t run = position_max;
+        position_t olderOffset = position_max;
+        position_t newerOffset = position_max;
+    };
+    // The free runs are chained through nextRun.
+    struct run_node {
+        explicit run_node(const item_t& key_) : key(key_) {
+        }
+        item_t key; // a copy of the first item, the walks do not touch the slots
+        position_t count = 0;
+        position_t oldestOffset = position_max;
+        position_t newestOffset = position_max;
+        position_t prevRun = position_max;
+        position_t nextRun = position_max;
+    };
+
+    // Links the slot into the run of its value, as the oldest or the newest item of it.
+    void link_slot(const position_t offset, const bool asOldest) {
+        slot& inserted = m_slots.at_offset_unchecked(offset);
+        if (m_medianRun == position_max) {
+            const position_t run = new_run(inserted.item, position_max, position_max);
+            append(run, offset, asOldest);
+            m_medianRun = run;
+            m_medianOffset = offset;
+            m_medianIndex = 0;
+            m_medianPos = 0;
+            return;
+        }
+        const int8_t cmp = m_comparator(inserted.item, m_runs[m_medianRun].key);
+        const position_t run = cmp == 0 ? m_medianRun : find_run(inserted.item, cmp < 0);
+        append(run, offset, asOldest);
+        if (cmp < 0 || (cmp == 0 && asOldest)) {
+            m_medianPos += 1;
+            if (run == m_medianRun) {
+                m_medianIndex += 1;
+            }
+        }
+        update_median_pos();
+    }
+    // The run equal to the item, or a new one in its place, walking from the median run.
+    position_t find_run(const item_t& item, const bool toLeft) {
+        position_t run = m_medianRun;
+        if (toLeft) {
+            while (true) {
+                const position_t prev = m_runs[run].prevRun;
+                if (prev == position_max) {
+                    return new_run(item, position_max, run);
+                }
+                const int8_t cmp = m_comparator(item, m_runs[prev].key);
+                if (cmp == 0) {
+                    return prev;
+                }
+                if (cmp > 0) {
+                    return new_run(item, prev, run);
+                }
+                run = prev;
+            }
+        }
+        while (true) {
+            const position_t next = m_runs[run].nextRun;
+            if (next == position_max) {
+                return new_run(item, run, position_max);
+            }
+            const int8_t cmp = m_comparator(item, m_runs[next].key);
+            if (cmp == 0) {
+                return next;
+            }
+            if (cmp < 0) {
+                return new_run(item, run, next);
+            }
+            run = next;
+        }
+    }
+    position_t new_run(const item_t& key, const position_t prev, const position_t next) {
+        position_t run;
+        if (m_freeRun != position_max) {
+            run = m_freeRun;
+            m_freeRun = m_runs[run].nextRun;
+            m_runs[run] = run_node(key);
+        }
+        else {
+            run = static_cast<position_t>(m_runs.size());
+            m_runs.push_back(run_node(key));
+        }
+        m_runs[run].prevRun = prev;
+        m_runs[run].nextRun = next;
+        if (prev == position_max) {
+            m_firstRun = run;
+        }
+        else {
+            m_runs[prev].nextRun = run;
+        }
+        if (next == position_max) {
+            m_lastRun = run;
+        }
+        else {
+            m_runs[next].prevRun = run;
+        }
+        m_distinct += 1;
+        return run;
+    }
+    void append(const position_t run, const position_t offset, const bool asOldest) {
+        run_node& target = m_runs[run];
+        slot& inserted = m_slots.at_offset_unchecked(offset);
+        inserted.run = run;
+        if (target.count == 0) {
+            target.oldestOffset = offset;
+            target.newestOffset = offset;
+        }
+        else if (asOldest) {
+            inserted.newerOffset = target.oldestOffset;
+            m_slots.at_offset_unchecked(target.oldestOffset).olderOffset = offset;
+            target.oldestOffset = offset;
+        }
+        else {
+            inserted.olderOffset = target.newestOffset;
+            m_slots.at_offset_unchecked(target.newestOffset).newerOffset = offset;
+            target.newestOffset = offset;
+        }
+        target.count += 1;
+    }
+    // The front slot is the oldest of its run, the back slot is the newest.
+    void unlink_slot(const position_t offset, const bool isOldest) {
+        if (size() == 1) {
+            clear_runs();
+            return;
+        }
+        const slot& removed = m_slots.at_offset_unchecked(offset);
+        const position_t run = removed.run;
+        if (offset == m_medianOffset) {
+            const bool hasNext = removed.newerOffset != position_max
+                || m_runs[run].nextRun != position_max;
+            if (hasNext) {
+                step_right(m_medianRun, m_medianOffset);
+                m_medianIndex = m_medianRun == run ? m_medianIndex + 1 : 0;
+                m_medianPos += 1;
+            }
+            else {
+                step_left(m_medianRun, m_medianOffset);
+                m_medianIndex = m_medianRun == run ? m_medianIndex - 1
+                    : m_runs[m_medianRun].count - 1;
+                m_medianPos -= 1;
+            }
+        }
+        const int8_t cmp = run == m_medianRun ? 0
+            : m_comparator(m_runs[run].key, m_runs[m_medianRun].key);
+        if (cmp < 0 || (cmp == 0 && isOldest)) {
+            m_medianPos -= 1;
+            if (run == m_medianRun) {
+                m_medianIndex -= 1;
+            }
+        }
+        run_node& target = m_runs[run];
+        if (removed.olderOffset == position_max) {
+            target.oldestOffset = removed.newerOffset;
+        }
+        else {
+            m_slots.at_offset_unchecked(removed.olderOffset).newerOffset = removed.newerOffset;
+        }
+        if (removed.newerOffset == position_max) {
+            target.newestOffset = removed.olderOffset;
+        }
+        else {
+            m_slots.at_offset_unchecked(removed.newerOffset).olderOffset = removed.olderOffset;
+        }
+        target.count -= 1;
+        if (target.count == 0) {
+            free_run(run);
+        }
+        update_median_pos(size() - 1);
+    }
+    void free_run(const position_t run) {
+        run_node& removed = m_runs[run];
+        if (removed.prevRun == position_max) {
+            m_firstRun = removed.nextRun;
+        }
+        else {
+            m_runs[removed.prevRun].nextRun = removed.nextRun;
+        }
+        if (removed.nextRun == position_max) {
+            m_lastRun = removed.prevRun;
+        }
+        else {
+            m_runs[removed.nextRun].prevRun = removed.prevRun;
+        }
+        removed.nextRun = m_freeRun;
+        m_freeRun = run;
+        m_distinct -= 1;
+    }
+    void clear_runs() {
+        m_runs.clear();
+        m_freeRun = position_max;
+        m_distinct = 0;
+        m_firstRun = position_max;
+        m_lastRun = position_max;
+        m_medianRun = position_max;
+        m_medianOffset = position_max;
+        m_medianIndex = 0;
+        m_medianPos = position_max;
+    }
+    // The next and the previous item in the sorted order, position_max past the ends.
+    void step_right(position_t& run, position_t& offset) const {
+        const position_t newer = m_slots.at_offset_unchecked(offset).newerOffset;
+        if (newer != position_max) {
+            offset = newer;
+            return;
+        }
+        run = m_runs[run].nextRun;
+        offset = run == position_max ? position_max : m_runs[run].oldestOffset;
+    }
+    void step_left(position_t& run, position_t& offset) const {
+        const position_t older = m_slots.at_offset_unchecked(offset).olderOffset;
+        if (older != position_max) {
+            offset = older;
+            return;
+        }
+        run = m_runs[run].prevRun;
+        offset = run == position_max ? position_max : m_runs[run].newestOffset;
+    }
+    // Moves the median by at most one item, count is the size after the change.
+    void update_median_pos() {
+        update_median_pos(size());
+    }
+    void update_median_pos(const position_t count) {
+        const position_t desiredMedianPos = (count ? count - 1 : 0) >> 1;
+        if (m_medianPos > desiredMedianPos) { // <-
+            const position_t run = m_medianRun;
+            step_left(m_medianRun, m_medianOffset);
+            m_medianIndex = m_medianRun == run ? m_medianIndex - 1
+                : m_runs[m_medianRun].count - 1;
+            m_medianPos -= 1;
+        }
+        else if (m_medianPos < desiredMedianPos) { // ->
+            const position_t run = m_medianRun;
+            step_right(m_medianRun, m_medianOffset);
+            m_medianIndex = m_medianRun == run ? m_medianIndex + 1 : 0;
+            m_medianPos += 1;
+        }
+    }
+    // The number of items x for which m_comparator(item, x) >= threshold.
+    position_t count_before(const item_t& item, const int8_t threshold) const {
+        if (empty()) {
+            return 0;
+        }
+        position_t run = m_medianRun;
+        position_t start = static_cast<position_t>(m_medianPos - m_medianIndex);
+        if (m_comparator(item, m_runs[run].key) >= threshold) { // ->
+            while (true) {
+                start += m_runs[run].count;
+                const position_t next = m_runs[run].nextRun;
+                if (next == position_max || m_comparator(item, m_runs[next].key) < threshold) {
+                    return start;
+                }
+                run = next;
+            }
+        }
+        while (true) { // <-
+            const position_t prev = m_runs[run].prevRun;
+            if (prev == position_max) {
+                return 0;
+            }
+            if (m_comparator(item, m_runs[prev].key) >= threshold) {
+                return start;
+            }
+            start -= m_runs[prev].count;
+            run = prev;
+        }
+    }
+
+    comparator_t m_comparator;
+    circular_buffer<slot> m_slots; // the insertion order
+    std::vector<run_node> m_runs;
+    position_t m_freeRun = position_max;
+    position_t m_distinct = 0;
+    position_t m_firstRun = position_max;
+    position_t m_lastRun = position_max;
+    position_t m_medianRun = position_max;
+    position_t m_medianOffset = position_max;
+    position_t m_medianIndex = 0; // of m_medianOffset in its run, from the oldest
+    position_t m_medianPos = position_max;
+};
+
+template <typename item_t, typename compare_t, typename offset_t>
+const typename sorted_flat_runs<item_t, compare_t, offset_t>::position_t
+    sorted_flat_runs<item_t, compare_t, offset_t>::position_max;
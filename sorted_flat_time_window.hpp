@@ -0,0 +1,158 @@
+// sorted_flat_time_window
+// C++11, a time-based window over sorted_flat_deque (or sorted_flat_array):
+// every item is pushed with a timestamp, and the items older than span are evicted
+// in one batch. The capacity follows the actual rate between the configured bounds.
+//
+// push - same as deque_t
+// advance_to - O(log n + k) for k evicted items, plus the deque_t batch pop_front
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include "circular_buffer.hpp"
+
+// The window keeps the items with timestamps in (now - span, now], where now is the
+// last advance_to() or push_back() timestamp. Timestamps must not decrease.
+// timestamp_t is any type with ordering and subtraction of a duration, for example
+// int64_t or std::chrono::steady_clock::time_point.
+// The capacity doubles when the window is full, up to max_capacity, and halves when
+// it is less than a quarter full, down to min_capacity. At max_capacity the oldest
+// item is evicted as in a count-based window.
+template <typename deque_t, typename timestamp_t = int64_t>
+class sorted_flat_time_window {
+public:
+    using deque_type = deque_t;
+    using item_type = typename deque_t::item_type;
+    using position_t = typename deque_t::position_t;
+    using timestamp_type = timestamp_t;
+    using duration_t = decltype(std::declval<timestamp_t>() - std::declval<timestamp_t>());
+
+    // deque gives the comparator, the quantiles and the allocator; it has to be empty,
+    // its items would have no timestamps.
+    sorted_flat_time_window(const duration_t span, const position_t min_capacity,
+            const position_t max_capacity, deque_t deque = deque_t())
+            : m_deque(std::move(deque)), m_span(span) {
+        if (!m_deque.empty()) {
+            throw std::invalid_argument("the deque is not empty");
+        }
+        set_capacity_bounds(min_capacity, max_capacity);
+    }
+
+    void set_span(const duration_t span) {
+        m_span = span;
+        if (!empty()) {
+            advance_to(m_now);
+        }
+    }
+    void set_capacity_bounds(const position_t min_capacity, const position_t max_capacity) {
+        if (min_capacity == 0 || min_capacity > max_capacity) {
+            throw std::invalid_argument("0 < min_capacity <= max_capacity");
+        }
+        m_minCapacity = min_capacity;
+        m_maxCapacity = max_capacity;
+        if (capacity() < min_capacity) {
+            set_capacity(min_capacity);
+        }
+        else if (capacity() > max_capacity) {
+            set_capacity(max_capacity);
+        }
+    }
+    void clear() {
+        m_deque.clear();
+        m_times.clear();
+        set_capacity(m_minCapacity);
+    }
+
+    void push_back(const timestamp_t& time, const item_type& item) {
+        if (!m_times.empty() && time < m_times.back()) {
+            throw std::logic_error("time < back_time()");
+        }
+        advance_to(time);
+        if (size() >= capacity() && capacity() < m_maxCapacity) {
+            set_capacity(capacity() > m_maxCapacity / 2 ? m_maxCapacity : capacity() * 2);
+        }
+        m_deque.push_back(item);
+        m_times.push_back(time);
+    }
+    // Evicts all items with timestamps not newer than now - span, with one median fix-up.
+    void advance_to(const timestamp_t& now) {
+        m_now = now;
+        const timestamp_t cutoff = now - m_span;
+        // The timestamps are sorted, binary search for the first one to keep.
+        position_t low = 0;
+        position_t high = m_times.size();
+        while (low < high) {
+            const position_t middle = low + ((high - low) >> 1);
+            if (cutoff < m_times[middle]) {
+                high = middle;
+            }
+            else {
+                low = middle + 1;
+            }
+        }
+        if (low == 0) {
+            return;
+        }
+        m_deque.pop_front(low);
+        m_times.pop_front(low);
+        if (size() < capacity() / 4 && capacity() > m_minCapacity) {
+            set_capacity(capacity() / 2 < m_minCapacity ? m_minCapacity : capacity() / 2);
+        }
+    }
+
+    const deque_t& deque() const {
+        return m_deque;
+    }
+    auto min() const -> decltype(std::declval<const deque_t&>().min()) {
+        return m_deque.min();
+    }
+    auto median() const -> decltype(std::declval<const deque_t&>().median()) {
+        return m_deque.median();
+    }
+    auto max() const -> decltype(std::declval<const deque_t&>().max()) {
+        return m_deque.max();
+    }
+    const timestamp_t& front_time() const {
+        return m_times.front();
+    }
+    const timestamp_t& back_time() const {
+        return m_times.back();
+    }
+    duration_t span() const {
+        return m_span;
+    }
+    position_t size() const {
+        return m_deque.size();
+    }
+    position_t capacity() const {
+        return m_deque.max_size();
+    }
+    position_t min_capacity() const {
+        return m_minCapacity;
+    }
+    position_t max_capacity() const {
+        return m_maxCapacity;
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+
+private:
+    void set_capacity(const position_t capacity) {
+        m_deque.set_max_size(capacity);
+        m_times.set_max_size(capacity);
+    }
+
+    deque_t m_deque;
+    // Binary searched on every advance_to(), the mask keeps the indexing cheap.
+    circular_buffer<timestamp_t, std::allocator<timestamp_t>, true> m_times;
+    duration_t m_span;
+    timestamp_t m_now = timestamp_t();
+    position_t m_minCapacity = 0;
+    position_t m_maxCapacity = 0;
+};
@@ -0,0 +1,147 @@
+// spsc_ring
+// C++11, wait-free single-producer / single-consumer ring in front of sorted_flat_deque.
+// The producer only stores the item and releases the head; the consumer drains
+// up to K items at a time into the deque with its bulk push_back(first, last).
+//
+// push - O(1), wait-free with spsc_overflow::drop
+// drain - O(K) plus the deque bulk push_back
+//
+// Author: Yurii Blok
+// License: BSL-1.0
+// https://github.com/yurablok/sorted_flat_deque
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+enum class spsc_overflow : uint8_t {
+    back_pressure, // push() waits for the consumer
+    drop,          // push() drops the item and counts it
+};
+
+// The capacity is rounded up to a power of two. The head and tail counters never
+// wrap in practice (64 bits), the slot is the counter masked by the capacity.
+template <typename T, spsc_overflow overflow = spsc_overflow::back_pressure>
+class spsc_ring {
+public:
+    using value_type = T;
+
+    explicit spsc_ring(const size_t capacity) {
+        size_t rounded = 1;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        m_slots.resize(rounded);
+        m_mask = rounded - 1;
+    }
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    // Producer side
+
+    bool try_push(const T& item) {
+        const size_t head = m_producer.head.load(std::memory_order_relaxed);
+        if (head - m_producer.cachedTail > m_mask) {
+            m_producer.cachedTail = m_consumer.tail.load(std::memory_order_acquire);
+            if (head - m_producer.cachedTail > m_mask) {
+                return false;
+            }
+        }
+        m_slots[head & m_mask] = item;
+        m_producer.head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    // False if the item was dropped.
+    bool push(const T& item) {
+        return push(item, std::integral_constant<bool, overflow == spsc_overflow::drop>());
+    }
+    // Dropped by push() so far, readable from any thread.
+    uint64_t dropped() const {
+        return m_producer.dropped.load(std::memory_order_relaxed);
+    }
+
+    // Consumer side
+
+    bool try_pop(T& out) {
+        const size_t tail = m_consumer.tail.load(std::memory_order_relaxed);
+        if (tail == m_consumer.cachedHead) {
+            m_consumer.cachedHead = m_producer.head.load(std::memory_order_acquire);
+            if (tail == m_consumer.cachedHead) {
+                return false;
+            }
+        }
+        out = m_slots[tail & m_mask];
+        m_consumer.tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    // Moves up to max_items into the deque with at most two bulk push_back calls,
+    // one per contiguous span of the ring. Returns the number of drained items.
+    template <typename deque_t>
+    size_t drain(deque_t& deque, const size_t max_items) {
+        const size_t tail = m_consumer.tail.load(std::memory_order_relaxed);
+        m_consumer.cachedHead = m_producer.head.load(std::memory_order_acquire);
+        const size_t available = m_consumer.cachedHead - tail;
+        const size_t count = available < max_items ? available : max_items;
+        if (count == 0) {
+            return 0;
+        }
+        const size_t first = tail & m_mask;
+        const size_t firstSpan = count < m_slots.size() - first ? count : m_slots.size() - first;
+        deque.push_back(m_slots.begin() + first, m_slots.begin() + first + firstSpan);
+        if (count > firstSpan) {
+            deque.push_back(m_slots.begin(), m_slots.begin() + (count - firstSpan));
+        }
+        m_consumer.tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    // Either side
+
+    size_t capacity() const {
+        return m_slots.size();
+    }
+    // Exact only when both sides are idle.
+    size_t size() const {
+        return m_producer.head.load(std::memory_order_acquire)
+            - m_consumer.tail.load(std::memory_order_acquire);
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+
+private:
+    bool push(const T& item, std::false_type) {
+        while (!try_push(item)) {
+            std::this_thread::yield();
+        }
+        return true;
+    }
+    bool push(const T& item, std::true_type) {
+        if (try_push(item)) {
+            return true;
+        }
+        m_producer.dropped.store(m_producer.dropped.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        return false;
+    }
+
+    // Each side writes only to its own cache line.
+    struct alignas(64) producer_side {
+        std::atomic<size_t> head{ 0 };
+        size_t cachedTail = 0;
+        std::atomic<uint64_t> dropped{ 0 };
+    };
+    struct alignas(64) consumer_side {
+        std::atomic<size_t> tail{ 0 };
+        size_t cachedHead = 0;
+    };
+
+    producer_side m_producer;
+    consumer_side m_consumer;
+    std::vector<T> m_slots;
+    size_t m_mask = 0;
+};
@@ -1,12 +1,38 @@
+// The checks are asserts, keep them in release builds.
+#ifdef NDEBUG
+#   undef NDEBUG
+#endif
+#include <algorithm>
 #include <iostream>
 #include <cassert>
 #include <random>
-#include <array>
 #include <vector>
+#include <deque>
+#include <cmath>
+#include <iterator>
+#include <thread>
 #include <chrono>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#if defined(__has_include)
+#   if __has_include(<memory_resource>) && __cplusplus >= 201703L
+#       include <memory_resource>
+#       define TESTS_HAVE_PMR 1
+#   endif
+#endif
 
 #include "circular_buffer.hpp"
 #include "sorted_flat_deque.hpp"
+#include "sorted_flat_array.hpp"
+#include "sorted_flat_time_window.hpp"
+#include "sorted_flat_deque_bank.hpp"
+#include "sorted_flat_publisher.hpp"
+#include "spsc_ring.hpp"
+#include "sorted_flat_executor.hpp"
+#include "sorted_flat_runs.hpp"
+#include "sorted_flat_histogram.hpp"
+#include "sorted_flat_mapped.hpp"
 
 struct data_t {
     data_t() {
@@ -47,6 +73,57 @@ struct data_t {
     uint32_t value = 0;
 };
 
+// No default constructor, counts the live instances.
+struct tracked_t {
+    static int32_t live;
+    explicit tracked_t(const int32_t value_) : value(value_) {
+        ++live;
+    }
+    tracked_t(const tracked_t& other) : value(other.value) {
+        ++live;
+    }
+    tracked_t& operator=(const tracked_t&) = default;
+    ~tracked_t() {
+        --live;
+    }
+    int32_t value;
+};
+int32_t tracked_t::live = 0;
+
+// Counts what the containers allocate from it. Like std::pmr, it does not propagate
+// on copy, move or swap.
+struct arena_t {
+    size_t allocations = 0;
+    size_t live_bytes = 0;
+};
+template <typename T>
+struct arena_allocator {
+    using value_type = T;
+
+    arena_allocator(arena_t* arena_) : arena(arena_) {}
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(const size_t count) {
+        arena->allocations += 1;
+        arena->live_bytes += count * sizeof(T);
+        return static_cast<T*>(::operator new(count * sizeof(T)));
+    }
+    void deallocate(T* pointer, const size_t count) {
+        arena->live_bytes -= count * sizeof(T);
+        ::operator delete(pointer);
+    }
+    template <typename U>
+    bool operator==(const arena_allocator<U>& other) const {
+        return arena == other.arena;
+    }
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& other) const {
+        return arena != other.arena;
+    }
+    arena_t* arena;
+};
+
 void test_circular_buffer() {
     { // basic
         circular_buffer<int32_t> buf;
@@ -182,6 +259,20 @@ void test_circular_buffer() {
         //}
         //std::cout << std::endl;
 
+        // decrease  0fxb0000 -> 0fxb00
+        buf.clear();
+        buf.set_max_size(8);
+        buf.push_back(1);
+        buf.push_back(2);
+        buf.push_back(3);
+        buf.push_back(4);
+        buf.pop_front();
+        buf.set_max_size(6);
+        assert(buf.at_offset(1) == 2);
+        assert(buf.front() == 2);
+        assert(buf.back() == 4);
+        assert(buf.size() == 3);
+
         // increase  x -> 0x
         buf.clear();
         buf.set_max_size(1);
@@ -278,7 +369,187 @@ void test_circular_buffer() {
         assert(buf.front() == 5);
         assert(buf.back() == 8);
         assert(buf.size() == 4);
+        buf.set_max_size(2); // 7 8
+        buf.push_back(9); // 9 8
+        buf.set_max_size(3); // 9 0 8
+        assert(buf.at_offset(2) == 8);
+        assert(buf.front() == 8);
+        assert(buf.back() == 9);
+        assert(buf.size() == 2);
     } // set_max_size
+
+    { // lifetime
+        {
+            circular_buffer<tracked_t> buf(4);
+            assert(tracked_t::live == 0);
+            for (int32_t i = 0; i < 6; ++i) {
+                buf.push_back(tracked_t(i)); // 4 5 2 3
+            }
+            assert(tracked_t::live == 4);
+            buf.push_front(tracked_t(9)); // 4 9 2 3
+            assert(tracked_t::live == 4);
+            assert(buf.front().value == 9);
+            assert(buf.back().value == 4);
+            assert(buf.pop_back().value == 4);
+            assert(tracked_t::live == 3);
+            buf.set_max_size(16);
+            assert(tracked_t::live == 3);
+            assert(buf.front().value == 9);
+            circular_buffer<tracked_t> copy(buf);
+            assert(tracked_t::live == 6);
+            buf.set_max_size(2);
+            assert(tracked_t::live == 5);
+            assert(buf.front().value == 2);
+            assert(buf.back().value == 3);
+            buf.discard_front();
+            assert(tracked_t::live == 4);
+            copy.clear();
+            assert(tracked_t::live == 1);
+            assert(copy.max_size() == 16);
+            copy = buf;
+            assert(tracked_t::live == 2);
+            assert(copy.max_size() == 2);
+            circular_buffer<tracked_t> moved(std::move(copy));
+            assert(tracked_t::live == 2);
+            assert(moved.front().value == 3);
+        }
+        assert(tracked_t::live == 0);
+    } // lifetime
+
+    { // power_of_two
+        circular_buffer<int32_t, std::allocator<int32_t>, true> buf(5);
+        assert(buf.max_size() == 5);
+        assert(buf.capacity() == 8);
+        for (int32_t i = 0; i < 20; ++i) {
+            buf.push_back(i);
+            assert(static_cast<int32_t>(buf.size()) == std::min<int32_t>(i + 1, 5));
+            assert(buf.front() == std::max(0, i - 4));
+            assert(buf.back() == i);
+        }
+        for (int32_t i = 0; i < 5; ++i) {
+            assert(buf[i] == 15 + i);
+        }
+        buf.push_front(3); // 3 15 16 17 18
+        assert(buf.size() == 5);
+        assert(buf.back() == 18);
+        buf.set_max_size(7); // the same storage
+        assert(buf.capacity() == 8);
+        buf.push_back(19);
+        buf.push_back(20);
+        buf.push_back(21); // 15 16 17 18 19 20 21
+        assert(buf.size() == 7);
+        assert(buf.front() == 15);
+        buf.set_max_size(9);
+        assert(buf.capacity() == 16);
+        assert(buf.size() == 7);
+        for (int32_t i = 0; i < 7; ++i) {
+            assert(buf[i] == 15 + i);
+        }
+        buf.set_max_size(1);
+        assert(buf.capacity() == 1);
+        assert(buf.front() == 21);
+        buf.push_back(22);
+        assert(buf.front() == 22 && buf.back() == 22);
+        buf.set_max_size(0);
+        assert(buf.capacity() == 0);
+        buf.push_back(23);
+        assert(buf.empty());
+    } // power_of_two
+
+    { // spans and bulk
+        circular_buffer<int32_t> buf(6);
+        assert(buf.array_one().second == 0);
+        assert(buf.array_two().second == 0);
+        const int32_t items[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+        buf.push_back(items, 4); // 1 2 3 4 0 0
+        assert(buf.array_one().first == &buf.at_offset(0));
+        assert(buf.array_one().second == 4);
+        assert(buf.array_two().second == 0);
+        buf.push_back(items + 4, 4); // 7 8 3 4 5 6
+        assert(buf.size() == 6);
+        assert(buf.front() == 3);
+        assert(buf.back() == 8);
+        std::vector<int32_t> joined(buf.array_one().first,
+            buf.array_one().first + buf.array_one().second);
+        joined.insert(joined.end(), buf.array_two().first,
+            buf.array_two().first + buf.array_two().second);
+        assert((joined == std::vector<int32_t>{ 3, 4, 5, 6, 7, 8 }));
+        buf.pop_front(size_t(3)); // 7 8 0 0 0 6
+        assert(buf.size() == 3);
+        assert(buf.front() == 6);
+        assert(buf.array_one().second == 1);
+        assert(buf.array_two().second == 2);
+        buf.push_back(items, 9); // the last 6 items
+        assert(buf.size() == 6);
+        for (int32_t i = 0; i < 6; ++i) {
+            assert(buf[i] == 4 + i);
+        }
+        bool is_throw_catched = false;
+        try {
+            buf.pop_front(size_t(7));
+        }
+        catch (const std::logic_error&) {
+            is_throw_catched = true;
+        }
+        assert(is_throw_catched == true);
+        buf.pop_front(size_t(6));
+        assert(buf.empty());
+
+        circular_buffer<int32_t, std::allocator<int32_t>, true> masked(5);
+        masked.push_back(items, 7);
+        assert(masked.size() == 5);
+        assert(masked.front() == 3);
+        masked.push_back(items, 2); // 5 6 7 1 2
+        assert(masked.front() == 5);
+        assert(masked.back() == 2);
+        assert(masked.array_one().second + masked.array_two().second == 5);
+
+        {
+            circular_buffer<tracked_t> tracked(3);
+            const tracked_t values[] = { tracked_t(1), tracked_t(2), tracked_t(3),
+                tracked_t(4) };
+            tracked.push_back(values, 2);
+            tracked.push_back(values + 2, 2);
+            assert(tracked_t::live == 4 + 3);
+            assert(tracked.front().value == 2);
+            assert(tracked.back().value == 4);
+            tracked.pop_front(size_t(2));
+            assert(tracked_t::live == 4 + 1);
+        }
+        assert(tracked_t::live == 0);
+    } // spans and bulk
+
+    { // allocator
+        arena_t first;
+        arena_t second;
+        {
+            using buffer_t = circular_buffer<int32_t, arena_allocator<int32_t>>;
+            buffer_t buf(4, arena_allocator<int32_t>(&first));
+            assert(first.allocations == 1);
+            for (int32_t i = 0; i < 6; ++i) {
+                buf.push_back(i); // 4 5 2 3
+            }
+            buf.set_max_size(6);
+            assert(buf.front() == 2);
+            assert(buf.back() == 5);
+            buffer_t copy(buf);
+            assert(copy.get_allocator().arena == &first);
+            buffer_t other(2, arena_allocator<int32_t>(&second));
+            other = buf; // keeps its own allocator
+            assert(other.get_allocator().arena == &second);
+            assert(other.size() == 4);
+            assert(other.front() == 2);
+            assert(other.back() == 5);
+            buffer_t moved(std::move(copy));
+            assert(moved.get_allocator().arena == &first);
+            assert(moved.size() == 4);
+            assert(moved.back() == 5);
+            moved.swap(buf);
+            assert(buf.back() == 5);
+        }
+        assert(first.live_bytes == 0);
+        assert(second.live_bytes == 0);
+    } // allocator
 }
 
 template <typename value_t>
@@ -302,6 +573,248 @@ void print(const deque_t& deque) {
     std::cout << std::endl;
 }
 
+// Every operation against the default layout, max_size up to 250 fits any offset_t.
+template <typename deque_t>
+void test_sorted_flat_deque_layout(const uint32_t seed) {
+    std::mt19937 rng(seed);
+    deque_t deque(100);
+    sorted_flat_deque<int32_t> reference(100);
+    deque.add_quantile(0.1);
+    reference.add_quantile(0.1);
+    std::vector<int32_t> batch;
+    for (uint32_t step = 0; step < 3000; ++step) {
+        const int32_t value = static_cast<int32_t>(rng() % 500);
+        switch (rng() % 16) {
+        case 0:
+            deque.push_front(value);
+            reference.push_front(value);
+            break;
+        case 1:
+            if (!reference.empty()) {
+                assert(deque.pop_front() == reference.pop_front());
+            }
+            break;
+        case 2:
+            if (!reference.empty()) {
+                assert(deque.pop_back() == reference.pop_back());
+            }
+            break;
+        case 3:
+            batch.resize(rng() % 40);
+            for (auto& item : batch) {
+                item = static_cast<int32_t>(rng() % 500);
+            }
+            deque.push_back(batch.begin(), batch.end());
+            reference.push_back(batch.begin(), batch.end());
+            break;
+        case 4: {
+            const uint32_t count = rng() % (reference.size() + 1);
+            deque.pop_front(static_cast<typename deque_t::position_t>(count));
+            reference.pop_front(count);
+            break;
+        }
+        case 5: {
+            const uint32_t maxSize = 1 + rng() % 250;
+            const bool fromFront = (rng() & 1) != 0;
+            deque.set_max_size(static_cast<typename deque_t::position_t>(maxSize), fromFront);
+            reference.set_max_size(maxSize, fromFront);
+            break;
+        }
+        default:
+            deque.push_back(value);
+            reference.push_back(value);
+            break;
+        }
+        assert(deque.size() == reference.size());
+        assert(deque.max_size() == reference.max_size());
+        if (reference.empty()) {
+            continue;
+        }
+        assert(deque.front() == reference.front());
+        assert(deque.back() == reference.back());
+        assert(deque.min() == reference.min());
+        assert(deque.median() == reference.median());
+        assert(deque.max() == reference.max());
+        assert(deque.quantile(0) == reference.quantile(0));
+        const uint32_t rank = rng() % reference.size();
+        assert(deque.nth(static_cast<typename deque_t::position_t>(rank)) == reference.nth(rank));
+        assert(deque.rank_of(value) == reference.rank_of(value));
+        assert(deque.count_less(value) == reference.count_less(value));
+    }
+    assert(std::equal(deque.begin(), deque.end(), reference.begin()));
+}
+
+// Saves a wrapped deque with quantiles, loads it into another one and checks that
+// both answer and evolve the same.
+template <typename deque_t>
+void test_sorted_flat_deque_snapshot(const uint32_t seed) {
+    using position_t = typename deque_t::position_t;
+    std::mt19937 rng(seed);
+    deque_t deque(100);
+    deque.set_quantiles({ 0.1, 0.75 });
+    for (uint32_t i = 0; i < 1000; ++i) {
+        const int32_t value = static_cast<int32_t>(rng() % 300);
+        if (i % 7 == 0) {
+            deque.push_front(value);
+        }
+        else {
+            deque.push_back(value);
+        }
+        if (i % 5 == 0) {
+            deque.pop_back();
+        }
+    }
+    std::stringstream stream;
+    deque.save(stream);
+    assert(stream.str().size() == deque.saved_size());
+    deque_t loaded(7);
+    loaded.add_quantile(0.5);
+    loaded.push_back(1);
+    loaded.load(stream);
+    std::vector<char> memory(deque.saved_size());
+    assert(deque.save(memory.data(), memory.size()) == memory.size());
+    deque_t copy;
+    copy.load(memory.data(), memory.size());
+    for (uint32_t i = 0; i < 300; ++i) {
+        for (const deque_t* restored : { &loaded, &copy }) {
+            assert(restored->size() == deque.size());
+            assert(restored->max_size() == deque.max_size());
+            assert(restored->quantiles_count() == 2);
+            assert(restored->front() == deque.front());
+            assert(restored->back() == deque.back());
+            assert(restored->median_it().offset() == deque.median_it().offset());
+            assert(restored->quantile(0) == deque.quantile(0));
+            assert(restored->quantile(1) == deque.quantile(1));
+            assert(restored->sum() == deque.sum());
+            assert(restored->variance() == deque.variance());
+            const position_t rank = static_cast<position_t>(rng() % deque.size());
+            assert(restored->nth(rank) == deque.nth(rank));
+        }
+        if (i % 50 == 0) {
+            assert(std::equal(deque.begin(), deque.end(), loaded.begin()));
+            assert(std::equal(deque.begin(), deque.end(), copy.begin()));
+        }
+        const int32_t value = static_cast<int32_t>(rng() % 300);
+        deque.push_back(value);
+        loaded.push_back(value);
+        copy.push_back(value);
+    }
+}
+
+// Keeps a deque in a mapped file next to a reference deque in memory, reopens the file
+// after a clean close, a crash between the changes and an interrupted change, and checks
+// that both answer and evolve the same. tear_links also garbles the first nodes before the
+// recovery, which only reads the items (split_items keeps them apart from the links).
+template <typename deque_t>
+void test_sorted_flat_mapped_of(const char* path, const uint32_t seed, const bool tear_links) {
+    using mapped_t = sorted_flat_mapped<deque_t>;
+    std::remove(path);
+    std::mt19937 rng(seed);
+    deque_t reference(100);
+    reference.set_quantiles({ 0.1, 0.75 });
+    const auto same = [&reference](const deque_t& deque) {
+        assert(deque.size() == reference.size());
+        assert(deque.max_size() == reference.max_size());
+        assert(deque.quantiles_count() == 2);
+        assert(std::equal(deque.begin(), deque.end(), reference.begin()));
+        if (!reference.empty()) {
+            assert(deque.front() == reference.front());
+            assert(deque.back() == reference.back());
+            assert(deque.median() == reference.median());
+            assert(deque.quantile(0) == reference.quantile(0));
+            assert(deque.quantile(1) == reference.quantile(1));
+            assert(deque.sum() == reference.sum());
+        }
+    };
+    const auto change = [&rng, &reference](mapped_t& mapped, const uint32_t count) {
+        for (uint32_t i = 0; i < count; ++i) {
+            const int32_t value = static_cast<int32_t>(rng() % 300);
+            if (i % 7 == 0) {
+                mapped.push_front(value);
+                reference.push_front(value);
+            }
+            else {
+                mapped.push_back(value);
+                reference.push_back(value);
+            }
+            if (i % 5 == 0) {
+                assert(mapped.pop_back() == reference.pop_back());
+            }
+        }
+    };
+    const auto set_control = [path](const std::streamoff offset, const uint32_t value) {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(offset);
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    {
+        deque_t initial(100);
+        initial.set_quantiles({ 0.1, 0.75 });
+        mapped_t mapped(path, std::move(initial), sorted_flat_flush(64));
+        assert(mapped.created() && !mapped.recovered());
+        change(mapped, 1000);
+        same(mapped.deque());
+    }
+    { // a clean close
+        mapped_t mapped(path, deque_t(7));
+        assert(!mapped.created() && !mapped.recovered());
+        same(mapped.deque());
+        change(mapped, 300);
+        std::vector<int32_t> batch(40);
+        for (auto& value : batch) {
+            value = static_cast<int32_t>(rng() % 300);
+        }
+        mapped.push_back(batch.begin(), batch.end());
+        reference.push_back(batch.begin(), batch.end());
+        same(mapped.deque());
+    }
+    { // a crash between the changes, the destructor does not run before the reopen
+        mapped_t* crashed = new mapped_t(path);
+        change(*crashed, 50);
+        mapped_t mapped(path);
+        assert(!mapped.recovered());
+        same(mapped.deque());
+        delete crashed;
+    }
+    { // an interrupted change, the busy flag stays set
+        set_control(8, 1);
+        if (tear_links) {
+            std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+            uint64_t storageOffset = 0;
+            file.seekg(24);
+            file.read(reinterpret_cast<char*>(&storageOffset), sizeof(storageOffset));
+            const std::vector<char> garbage(64, 0x5A);
+            file.seekp(static_cast<std::streamoff>(storageOffset));
+            file.write(garbage.data(), static_cast<std::streamsize>(garbage.size()));
+        }
+        mapped_t mapped(path);
+        assert(mapped.recovered());
+        same(mapped.deque());
+        change(mapped, 300);
+        same(mapped.deque());
+        mapped.clear();
+        reference.clear();
+        same(mapped.deque());
+        mapped.sync();
+    }
+    {
+        mapped_t mapped(path);
+        assert(!mapped.recovered() && mapped.deque().empty());
+        change(mapped, 10);
+        same(mapped.deque());
+    }
+    std::remove(path);
+}
+
+struct counting_less {
+    int8_t operator()(const int32_t left, const int32_t right) const {
+        ++calls;
+        return static_cast<int8_t>((right < left) - (left < right));
+    }
+    static size_t calls;
+};
+size_t counting_less::calls = 0;
+
 void test_sorted_flat_deque() {
     { // basic
         sorted_flat_deque<int32_t> sorted;
@@ -505,80 +1018,1648 @@ void test_sorted_flat_deque() {
         s.pop_front();
         s.pop_front();
     }
-}
+    { // comparator
+        struct three_way_greater {
+            int8_t operator()(const int32_t& left, const int32_t& right) const {
+                return static_cast<int8_t>((left < right) - (right < left));
+            }
+        };
+        sorted_flat_deque<int32_t, int32_t, three_way_greater> functor(3);
+        sorted_flat_deque<int32_t, int32_t, three_way_function<int32_t>> erased(3);
+        sorted_flat_deque<int32_t, int32_t, three_way_function<int32_t>> erasedDefault(3);
+        erased.set_comparator([](const int32_t& left, const int32_t& right) -> int8_t {
+            return static_cast<int8_t>((left < right) - (right < left)); });
+        for (const int32_t value : { 5, 1, 9, 7 }) {
+            functor.push_back(value);
+            erased.push_back(value);
+            erasedDefault.push_back(value);
+        }
+        assert(functor.min() == 9 && functor.median() == 7 && functor.max() == 1);
+        assert(erased.min() == 9 && erased.median() == 7 && erased.max() == 1);
+        assert(erasedDefault.min() == 1 && erasedDefault.median() == 7
+            && erasedDefault.max() == 9);
+        assert(three_way_less<double>()(1.0, 2.0) == -1);
+        assert(three_way_less<double>()(2.0, 2.0) == 0);
+        assert(three_way_less<double>()(3.0, 2.0) == 1);
+    } // comparator
+    { // skip_levels
+        std::mt19937 rng(7);
+        sorted_flat_deque<int32_t> linear;
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 4> indexed;
+        for (uint32_t max_size : { 1, 2, 3, 17, 300 }) {
+            linear.clear();
+            indexed.clear();
+            linear.set_max_size(max_size);
+            indexed.set_max_size(max_size);
+            for (uint32_t i = 0; i < 5000; ++i) {
+                const int32_t value = rng() % 50;
+                switch (rng() % 8) {
+                case 0:
+                    linear.push_front(value);
+                    indexed.push_front(value);
+                    break;
+                case 1:
+                    if (!linear.empty()) {
+                        linear.pop_front();
+                        indexed.pop_front();
+                    }
+                    break;
+                case 2:
+                    if (!linear.empty()) {
+                        linear.pop_back();
+                        indexed.pop_back();
+                    }
+                    break;
+                default:
+                    linear.push_back(value);
+                    indexed.push_back(value);
+                    break;
+                }
+                assert(linear.size() == indexed.size());
+                if (linear.empty()) {
+                    continue;
+                }
+                assert(linear.min() == indexed.min());
+                assert(linear.median() == indexed.median());
+                assert(linear.max() == indexed.max());
+                assert(std::equal(linear.begin(), linear.end(), indexed.begin()));
+            }
+        }
+        indexed.set_max_size(100);
+        assert(std::is_sorted(indexed.begin(), indexed.end()));
+    } // skip_levels
+    { // push_back(first, last)
+        // .first is the key, .second tells equal keys apart to check their order.
+        using item_t = std::pair<int32_t, uint32_t>;
+        struct compare_first {
+            int8_t operator()(const item_t& left, const item_t& right) const {
+                return three_way_less<int32_t>()(left.first, right.first);
+            }
+        };
+        std::mt19937 rng(11);
+        sorted_flat_deque<item_t, item_t, compare_first> single;
+        sorted_flat_deque<item_t, item_t, compare_first> bulk;
+        sorted_flat_deque<item_t, item_t, compare_first, 4> bulkIndexed;
+        std::vector<item_t> batch;
+        uint32_t sequence = 0;
+        for (uint32_t max_size : { 1, 2, 5, 64, 257 }) {
+            single.clear();
+            bulk.clear();
+            bulkIndexed.clear();
+            single.set_max_size(max_size);
+            bulk.set_max_size(max_size);
+            bulkIndexed.set_max_size(max_size);
+            for (uint32_t i = 0; i < 300; ++i) {
+                batch.resize(rng() % (max_size * 2 + 1));
+                for (auto& item : batch) {
+                    item = item_t(rng() % 20, sequence++);
+                }
+                for (const auto& item : batch) {
+                    single.push_back(item);
+                }
+                bulk.push_back(batch.begin(), batch.end());
+                bulkIndexed.push_back(batch.cbegin(), batch.cend());
+                if (rng() % 4 == 0 && !single.empty()) {
+                    single.pop_front();
+                    bulk.pop_front();
+                    bulkIndexed.pop_front();
+                }
+                assert(single.size() == bulk.size());
+                assert(single.size() == bulkIndexed.size());
+                if (single.empty()) {
+                    continue;
+                }
+                assert(single.median() == bulk.median());
+                assert(single.median() == bulkIndexed.median());
+                assert(std::equal(single.begin(), single.end(), bulk.begin()));
+                assert(std::equal(single.begin(), single.end(), bulkIndexed.begin()));
+                assert(static_cast<uint32_t>(std::distance(bulk.begin(), bulk.median_it()))
+                    == (bulk.size() - 1) / 2);
+            }
+        }
+    } // push_back(first, last)
+    { // quantiles
+        std::mt19937 rng(13);
+        const std::vector<double> fractions = { 0.0, 0.5, 0.9, 0.99, 0.999, 1.0 };
+        sorted_flat_deque<int32_t> sorted;
+        sorted.add_quantile(0.25);
+        sorted.set_max_size(4);
+        sorted.set_quantiles(fractions);
+        assert(sorted.quantiles_count() == fractions.size());
+        std::vector<int32_t> reference;
+        std::vector<int32_t> batch;
+        for (uint32_t max_size : { 1, 2, 3, 10, 1000 }) {
+            sorted.clear();
+            sorted.set_max_size(max_size);
+            for (uint32_t i = 0; i < 3000; ++i) {
+                switch (rng() % 10) {
+                case 0:
+                    sorted.push_front(rng() % 30);
+                    break;
+                case 1:
+                    if (!sorted.empty()) {
+                        sorted.pop_front();
+                    }
+                    break;
+                case 2:
+                    if (!sorted.empty()) {
+                        sorted.pop_back();
+                    }
+                    break;
+                case 3:
+                    batch.resize(rng() % 16);
+                    for (auto& value : batch) {
+                        value = rng() % 30;
+                    }
+                    sorted.push_back(batch.begin(), batch.end());
+                    break;
+                default:
+                    sorted.push_back(rng() % 30);
+                    break;
+                }
+                if (sorted.empty()) {
+                    continue;
+                }
+                reference.assign(sorted.begin(), sorted.end());
+                assert(sorted.quantile(1) == sorted.median());
+                assert(sorted.quantile_it(1) == sorted.median_it());
+                assert(sorted.quantile_it(0) == sorted.begin());
+                assert(*sorted.cquantile_it(5) == sorted.max());
+                for (uint32_t q = 0; q < fractions.size(); ++q) {
+                    const uint32_t pos = static_cast<uint32_t>(
+                        std::floor(fractions[q] * (reference.size() - 1) + 1e-9));
+                    assert(sorted.quantile(q) == reference[pos]);
+                    assert(static_cast<uint32_t>(std::distance(sorted.begin(),
+                        sorted.quantile_it(q))) == pos);
+                }
+            }
+        }
+    } // quantiles
+    { // sum mean variance
+        std::mt19937 rng(17);
+        sorted_flat_deque<int32_t> integral;
+        sorted_flat_deque<double> floating;
+        sorted_flat_deque<std::pair<uint16_t, uint32_t>, uint16_t> keyed(8,
+            [](const std::pair<uint16_t, uint32_t>& left,
+                    const std::pair<uint16_t, uint32_t>& right) -> int8_t {
+                return three_way_less<uint16_t>()(left.first, right.first); });
+        keyed.push_back(std::make_pair(uint16_t(1), 0u)); // no accessor yet
+        keyed.push_back(std::make_pair(uint16_t(5), 0u));
+        keyed.set_accessor([](const std::pair<uint16_t, uint32_t>& item) {
+            return item.first; });
+        assert(keyed.sum() == 6);
+        keyed.pop_front();
+        assert(keyed.sum() == 5);
+        assert(keyed.variance() == 0.0);
 
-int main() {
-    test_circular_buffer();
-    test_sorted_flat_deque();
-    std::cout << "success" << std::endl;
+        integral.set_max_size(100);
+        floating.set_max_size(100);
+        std::vector<double> batch;
+        for (uint32_t i = 0; i < 20000; ++i) {
+            const double value = 1e6 + static_cast<int32_t>(rng() % 2001) - 1000
+                + (rng() % 1000) / 1000.0;
+            switch (rng() % 8) {
+            case 0:
+                if (!integral.empty()) {
+                    integral.pop_back();
+                    floating.pop_back();
+                }
+                break;
+            case 1:
+                batch.assign(rng() % 20, value);
+                integral.push_back(batch.begin(), batch.end());
+                floating.push_back(batch.begin(), batch.end());
+                break;
+            case 2:
+                integral.push_front(static_cast<int32_t>(value));
+                floating.push_front(value);
+                break;
+            default:
+                integral.push_back(static_cast<int32_t>(value));
+                floating.push_back(value);
+                break;
+            }
+            if (integral.empty()) {
+                continue;
+            }
+            int64_t integralSum = 0;
+            double floatingSum = 0.0;
+            double floatingM2 = 0.0;
+            for (const auto value : integral) {
+                integralSum += value;
+            }
+            for (const auto value : floating) {
+                floatingSum += value;
+            }
+            const double floatingMean = floatingSum / floating.size();
+            for (const auto value : floating) {
+                floatingM2 += (value - floatingMean) * (value - floatingMean);
+            }
+            assert(integral.sum() == integralSum);
+            assert(std::abs(integral.mean() - double(integralSum) / integral.size()) < 1e-6);
+            assert(std::abs(floating.sum() - floatingSum) < 1e-6);
+            assert(std::abs(floating.mean() - floatingMean) < 1e-6);
+            assert(std::abs(floating.variance() - floatingM2 / floating.size()) < 1e-4);
+            assert(std::abs(floating.stddev() - std::sqrt(floatingM2 / floating.size())) < 1e-4);
+        }
+    } // sum mean variance
+    { // order statistics
+        std::mt19937 rng(19);
+        sorted_flat_deque<int32_t> linear;
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 3> indexed;
+        linear.add_quantile(0.9);
+        std::vector<int32_t> reference;
+        std::vector<int32_t> batch;
+        for (uint32_t max_size : { 1, 2, 7, 100, 700 }) {
+            linear.clear();
+            indexed.clear();
+            linear.set_max_size(max_size);
+            indexed.set_max_size(max_size);
+            for (uint32_t i = 0; i < 2000; ++i) {
+                const int32_t value = rng() % 40;
+                switch (rng() % 10) {
+                case 0:
+                    linear.push_front(value);
+                    indexed.push_front(value);
+                    break;
+                case 1:
+                    if (!linear.empty()) {
+                        linear.pop_front();
+                        indexed.pop_front();
+                    }
+                    break;
+                case 2:
+                    if (!linear.empty()) {
+                        linear.pop_back();
+                        indexed.pop_back();
+                    }
+                    break;
+                case 3:
+                    batch.resize(rng() % 30);
+                    for (auto& item : batch) {
+                        item = rng() % 40;
+                    }
+                    linear.push_back(batch.begin(), batch.end());
+                    indexed.push_back(batch.begin(), batch.end());
+                    break;
+                case 4:
+                    if (rng() % 20 == 0) {
+                        linear.set_max_size(max_size + 1);
+                        indexed.set_max_size(max_size + 1);
+                        linear.set_max_size(max_size);
+                        indexed.set_max_size(max_size);
+                    }
+                    break;
+                default:
+                    linear.push_back(value);
+                    indexed.push_back(value);
+                    break;
+                }
+                reference.assign(linear.begin(), linear.end());
+                for (uint32_t rank = 0; rank < reference.size(); ++rank) {
+                    assert(linear.nth(rank) == reference[rank]);
+                    assert(indexed.nth(rank) == reference[rank]);
+                }
+                const int32_t probe = static_cast<int32_t>(rng() % 44) - 2;
+                const auto less = static_cast<uint32_t>(std::lower_bound(
+                    reference.begin(), reference.end(), probe) - reference.begin());
+                const auto notGreater = static_cast<uint32_t>(std::upper_bound(
+                    reference.begin(), reference.end(), probe) - reference.begin());
+                assert(linear.count_less(probe) == less);
+                assert(indexed.count_less(probe) == less);
+                assert(linear.rank_of(probe) == notGreater);
+                assert(indexed.rank_of(probe) == notGreater);
+                assert(std::lower_bound(indexed.rank_begin(), indexed.rank_end(), probe)
+                    - indexed.rank_begin() == less);
+                assert(std::upper_bound(linear.rank_begin(), linear.rank_end(), probe)
+                    - linear.rank_begin() == notGreater);
+                assert(indexed.rank_end() - indexed.rank_begin() == indexed.size());
+                if (!reference.empty()) {
+                    assert(indexed.nth_it(reference.size() - 1).offset()
+                        == std::prev(indexed.end()).offset());
+                    assert(indexed.rank_begin()[(reference.size() - 1) / 2] == indexed.median());
+                    assert(*--indexed.rank_end() == indexed.max());
+                }
+            }
+        }
+        bool is_throw_catched = false;
+        try {
+            indexed.nth(indexed.size());
+        }
+        catch (const std::out_of_range&) {
+            is_throw_catched = true;
+        }
+        assert(is_throw_catched == true);
+    } // order statistics
 
-    std::mt19937 rng;
-    constexpr uint32_t maxSize = 2048;
-    constexpr uint32_t maxSeeds = 50;
-    constexpr uint32_t reps = 10000;
-    std::chrono::high_resolution_clock::time_point begin, end;
-    std::array<int32_t, reps> chsums;
-    int64_t minDurationA_mcs = INT64_MAX;
-    int64_t minDurationB_mcs = INT64_MAX;
-    for (uint32_t seed = 0; seed < maxSeeds; ++seed) {
-        int32_t chsumA = 0;
-        {
-            rng.seed(seed);
+    { // pop_front(count)
+        std::mt19937 rng(23);
+        sorted_flat_deque<int32_t> batched;
+        sorted_flat_deque<int32_t> single;
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 4> indexed;
+        batched.set_quantiles({ 0.1, 0.9 });
+        single.set_quantiles({ 0.1, 0.9 });
+        batched.set_max_size(300);
+        single.set_max_size(300);
+        indexed.set_max_size(300);
+        for (uint32_t i = 0; i < 300; ++i) {
+            const int32_t value = rng() % 30;
+            batched.push_back(value);
+            single.push_back(value);
+            indexed.push_back(value);
+        }
+        while (!single.empty()) {
+            const uint32_t count = std::min<uint32_t>(rng() % 40, single.size());
+            batched.pop_front(count);
+            indexed.pop_front(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                single.pop_front();
+            }
+            assert(batched.size() == single.size());
+            assert(std::equal(single.begin(), single.end(), batched.begin()));
+            assert(std::equal(single.begin(), single.end(), indexed.begin()));
+            if (!single.empty()) {
+                assert(batched.median_it().offset() == single.median_it().offset());
+                assert(indexed.median() == single.median());
+                assert(batched.quantile(0) == single.quantile(0));
+                assert(batched.quantile(1) == single.quantile(1));
+                assert(batched.sum() == single.sum());
+                assert(indexed.nth(single.size() - 1) == single.max());
+            }
+            const uint32_t refill = rng() % 30;
+            for (uint32_t i = 0; i < refill; ++i) {
+                const int32_t value = rng() % 30;
+                batched.push_back(value);
+                single.push_back(value);
+                indexed.push_back(value);
+            }
+        }
+        bool is_throw_catched = false;
+        try {
+            batched.pop_front(batched.size() + 1);
+        }
+        catch (const std::logic_error&) {
+            is_throw_catched = true;
+        }
+        assert(is_throw_catched == true);
+    } // pop_front(count)
 
-            std::array<int32_t, maxSize> temp = { 0 };
-            circular_buffer<int32_t> testA;
-            testA.set_max_size(maxSize);
+    { // push_back into a full window
+        struct keyed_t {
+            int32_t key;
+            int32_t seq;
+        };
+        struct key_less {
+            int8_t operator()(const keyed_t& left, const keyed_t& right) const {
+                return static_cast<int8_t>((right.key < left.key) - (left.key < right.key));
+            }
+        };
+        const auto same_seq = [](const keyed_t& left, const keyed_t& right) {
+            return left.seq == right.seq;
+        };
+        std::mt19937 rng(29);
+        sorted_flat_deque<keyed_t, keyed_t, key_less> linear;
+        sorted_flat_deque<keyed_t, keyed_t, key_less, 3> indexed;
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 0,
+            identity_value<int32_t>, std::allocator<int32_t>, true> pow2;
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 3> reference;
+        linear.set_quantiles({ 0.0, 0.2, 0.9, 1.0 });
+        indexed.set_quantiles({ 0.0, 0.2, 0.9, 1.0 });
+        pow2.set_quantiles({ 0.2, 0.9 });
+        reference.set_quantiles({ 0.2, 0.9 });
+        int32_t seq = 0;
+        for (uint32_t max_size : { 1, 2, 3, 10, 100 }) {
+            linear.clear();
+            indexed.clear();
+            pow2.clear();
+            reference.clear();
+            linear.set_max_size(max_size);
+            indexed.set_max_size(max_size);
+            pow2.set_max_size(max_size);
+            reference.set_max_size(max_size);
+            for (uint32_t i = 0; i < 3000; ++i) {
+                // Random keys, then a slow drift, then a sawtooth.
+                const int32_t key = i < 1000 ? static_cast<int32_t>(rng() % 16)
+                    : i < 2000 ? static_cast<int32_t>(i / 8 + rng() % 4)
+                    : static_cast<int32_t>(i % 7);
+                const keyed_t item = { key, seq++ };
+                linear.push_back(item);
+                indexed.push_back(item);
+                pow2.push_back(key);
+                reference.push_back(key);
+                assert(linear.size() == std::min(i + 1, max_size));
+                assert(same_seq(linear.min(), indexed.min()));
+                assert(same_seq(linear.median(), indexed.median()));
+                assert(same_seq(linear.max(), indexed.max()));
+                for (uint32_t q = 0; q < 4; ++q) {
+                    assert(same_seq(linear.quantile(q), indexed.quantile(q)));
+                }
+                assert(pow2.median() == reference.median());
+                assert(pow2.quantile(0) == reference.quantile(0));
+                assert(pow2.quantile(1) == reference.quantile(1));
+                assert(pow2.sum() == reference.sum());
+                if (i % 16 == 0) {
+                    assert(std::equal(linear.begin(), linear.end(), indexed.begin(), same_seq));
+                    assert(std::equal(pow2.begin(), pow2.end(), reference.begin()));
+                    const uint32_t rank = rng() % linear.size();
+                    assert(same_seq(linear.nth(rank), indexed.nth(rank)));
+                }
+            }
+            assert(linear.front().seq == seq - static_cast<int32_t>(max_size));
+            assert(linear.back().seq == seq - 1);
+        }
+    } // push_back into a full window
 
-            begin = std::chrono::high_resolution_clock::now();
+    { // nearest start and hints
+        // A ramp starts from the max (or the min), a few comparisons per push at any size.
+        sorted_flat_deque<int32_t, int32_t, counting_less> ramp(1000);
+        ramp.set_quantiles({ 0.1, 0.9 });
+        for (int32_t i = 0; i < 3000; ++i) {
+            const size_t calls = counting_less::calls;
+            ramp.push_back(i < 1500 ? i : 3000 - i);
+            assert(counting_less::calls - calls <= 16);
+        }
+        assert(ramp.min() == 1 && ramp.max() == 1000 && ramp.median() == 500);
+        for (int32_t i = 0; i < 500; ++i) {
+            const size_t calls = counting_less::calls;
+            ramp.push_front(-i);
+            assert(counting_less::calls - calls <= 16);
+        }
+        assert(ramp.min() == -499 && ramp.front() == -499 && ramp.back() == 501);
 
-            for (uint32_t i = 0; i < reps; ++i) {
-                int32_t newValue = rng() % 200 - 100;
-                testA.push_back(newValue);
-                for (uint32_t n = 0; n < testA.size(); ++n) {
-                    temp[n] = testA[n];
+        std::mt19937 rng(31);
+        sorted_flat_deque<int32_t> linear;
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 3> indexed;
+        linear.set_quantiles({ 0.25, 0.75 });
+        indexed.set_quantiles({ 0.25, 0.75 });
+        for (uint32_t max_size : { 1, 2, 5, 64, 300 }) {
+            linear.clear();
+            indexed.clear();
+            linear.set_max_size(max_size);
+            indexed.set_max_size(max_size);
+            int32_t walk = 0;
+            for (uint32_t i = 0; i < 3000; ++i) {
+                walk += static_cast<int32_t>(rng() % 9) - 4;
+                const int32_t value = i % 1000 < 500 ? walk : static_cast<int32_t>(rng() % 100);
+                switch (rng() % 8) {
+                case 0: {
+                    // Any node or end() is a valid hint, a good one only saves the walk.
+                    const uint32_t rank = rng() % (linear.size() + 1);
+                    linear.push_back(rank == linear.size() ? linear.cend() : linear.nth_it(rank),
+                        value);
+                    indexed.push_back(value);
+                    break;
+                }
+                case 1:
+                    linear.push_back(linear.median_it(), value);
+                    indexed.push_back(value);
+                    break;
+                case 2:
+                    linear.push_front(value);
+                    indexed.push_front(value);
+                    break;
+                case 3:
+                    if (!linear.empty()) {
+                        assert(linear.pop_back() == indexed.pop_back());
+                    }
+                    break;
+                default:
+                    linear.push_back(value);
+                    indexed.push_back(value);
+                    break;
+                }
+                assert(linear.size() == indexed.size());
+                if (linear.empty()) {
+                    continue;
+                }
+                assert(linear.median_it().offset() == indexed.median_it().offset());
+                assert(linear.quantile_it(0).offset() == indexed.quantile_it(0).offset());
+                assert(linear.quantile_it(1).offset() == indexed.quantile_it(1).offset());
+                assert(linear.begin().offset() == indexed.begin().offset());
+                if (i % 16 == 0) {
+                    assert(std::equal(linear.begin(), linear.end(), indexed.begin()));
                 }
-                std::sort(temp.begin(), temp.begin() + testA.size());
-                chsumA += temp[(testA.size() - 1) >> 1];
-                chsums[i] = chsumA;
             }
+        }
+    } // nearest start and hints
 
-            end = std::chrono::high_resolution_clock::now();
+    { // set_max_size keeps the insertion order
+        sorted_flat_deque<int32_t> deque(4);
+        deque.push_back(5);
+        deque.push_back(1);
+        deque.push_back(3);
+        deque.set_max_size(3);
+        assert(deque.max_size() == 3);
+        assert(deque.front() == 5);
+        assert(deque.back() == 3);
+        deque.set_max_size(8);
+        deque.push_back(2);
+        assert(deque.pop_front() == 5);
+        assert(deque.pop_back() == 2);
+        assert(deque.median() == 1);
+    } // set_max_size keeps the insertion order
 
-            const int64_t durationA_mcs = std::chrono::duration_cast<
-                std::chrono::microseconds>(end - begin).count();
-            minDurationA_mcs = std::min(minDurationA_mcs, durationA_mcs);
-            std::cout << "TestA: seed=" << seed << " time="
-                << durationA_mcs << " mcs, chsum=" << chsumA << std::endl;
+    { // allocator
+        using deque_t = sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 2,
+            identity_value<int32_t>, arena_allocator<int32_t>>;
+        arena_t first;
+        arena_t second;
+        {
+            deque_t deque(16, three_way_less<int32_t>(), arena_allocator<int32_t>(&first));
+            deque.add_quantile(0.9);
+            sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 2> reference(16);
+            reference.add_quantile(0.9);
+            std::mt19937 rng(43);
+            for (int32_t i = 0; i < 200; ++i) {
+                const int32_t value = static_cast<int32_t>(rng() % 50);
+                deque.push_back(value);
+                reference.push_back(value);
+            }
+            assert(std::equal(deque.begin(), deque.end(), reference.begin()));
+            assert(deque.quantile(0) == reference.quantile(0));
+            deque.set_max_size(24);
+            assert(deque.get_allocator().arena == &first);
+            assert(deque.front() == reference.front());
+            deque_t copy(deque);
+            assert(copy.get_allocator().arena == &first);
+            deque_t other(4, three_way_less<int32_t>(), arena_allocator<int32_t>(&second));
+            other = deque; // keeps its own allocator
+            assert(other.get_allocator().arena == &second);
+            assert(other.median() == deque.median());
+            deque_t moved(std::move(copy));
+            assert(moved.get_allocator().arena == &first);
+            assert(moved.median() == deque.median());
+            moved.swap(deque);
+            assert(deque.size() == 16);
         }
-        int32_t chsumB = 0;
+        assert(first.allocations > 0);
+        assert(first.live_bytes == 0);
+        assert(second.live_bytes == 0);
+    } // allocator
+
+    { // set_max_size remaps the offsets
+        using deque_t = sorted_flat_deque<int32_t, int32_t, counting_less, 3>;
+        std::mt19937 rng(53);
+        const uint32_t sizes[] = { 50, 80, 33, 1, 64, 200, 7, 0, 12 };
+        deque_t deque(40);
+        deque.add_quantile(0.25);
+        deque.add_quantile(0.9);
+        std::deque<int32_t> model; // the insertion order
+        uint32_t maxSize = 40;
+        for (const uint32_t newSize : sizes) {
+            // A different front offset and wrap before every resize.
+            const uint32_t count = rng() % 150;
+            for (uint32_t i = 0; i < count; ++i) {
+                const int32_t value = static_cast<int32_t>(rng() % 60);
+                deque.push_back(value);
+                model.push_back(value);
+                if (model.size() > maxSize) {
+                    model.pop_front();
+                }
+            }
+            const bool fromFront = (rng() & 1) != 0;
+            // Only the dropped items are compared, the kept ones are not reinserted.
+            const bool drops = deque.size() > newSize;
+            const size_t calls = counting_less::calls;
+            deque.set_max_size(newSize, fromFront);
+            assert(drops || counting_less::calls == calls);
+            maxSize = newSize;
+            while (model.size() > maxSize) {
+                if (fromFront) {
+                    model.pop_front();
+                }
+                else {
+                    model.pop_back();
+                }
+            }
+            assert(deque.max_size() == newSize);
+            assert(deque.size() == model.size());
+            if (model.empty()) {
+                continue;
+            }
+            sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 3> reference(newSize);
+            reference.add_quantile(0.25);
+            reference.add_quantile(0.9);
+            for (const int32_t value : model) {
+                reference.push_back(value);
+            }
+            assert(std::equal(deque.begin(), deque.end(), reference.begin()));
+            assert(deque.front() == model.front());
+            assert(deque.back() == model.back());
+            assert(deque.min() == reference.min());
+            assert(deque.median() == reference.median());
+            assert(deque.max() == reference.max());
+            assert(deque.quantile(0) == reference.quantile(0));
+            assert(deque.quantile(1) == reference.quantile(1));
+            for (uint32_t rank = 0; rank < model.size(); ++rank) {
+                assert(deque.nth(rank) == reference.nth(rank));
+            }
+        }
+        while (!model.empty()) {
+            assert(deque.pop_front() == model.front());
+            model.pop_front();
+        }
+        assert(deque.empty());
+    } // set_max_size remaps the offsets
+
+    { // power_of_two
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 0, identity_value<int32_t>,
+            std::allocator<int32_t>, true> deque(100);
+        assert(deque.max_size() == 100);
+        sorted_flat_deque<int32_t> reference(100);
+        std::mt19937 rng(47);
+        for (int32_t i = 0; i < 1000; ++i) {
+            const int32_t value = static_cast<int32_t>(rng() % 300);
+            if (i % 7 == 3) {
+                deque.push_front(value);
+                reference.push_front(value);
+            }
+            else {
+                deque.push_back(value);
+                reference.push_back(value);
+            }
+            assert(deque.size() == reference.size());
+            assert(deque.median() == reference.median());
+        }
+        assert(std::equal(deque.begin(), deque.end(), reference.begin()));
+        assert(deque.front() == reference.front());
+        assert(deque.back() == reference.back());
+        deque.set_max_size(30);
+        reference.set_max_size(30);
+        assert(std::equal(deque.begin(), deque.end(), reference.begin()));
+        assert(deque.pop_back() == reference.pop_back());
+    } // power_of_two
+
+    { // offset_t and split_items
+        static_assert(std::is_same<sorted_flat_offset_t<254>, uint8_t>::value, "");
+        static_assert(std::is_same<sorted_flat_offset_t<1000>, uint16_t>::value, "");
+        static_assert(std::is_same<sorted_flat_offset_t<65535>, uint32_t>::value, "");
+        test_sorted_flat_deque_layout<sorted_flat_deque<int32_t, int32_t,
+            three_way_less<int32_t>, 0, identity_value<int32_t>, std::allocator<int32_t>, false,
+            uint8_t>>(61);
+        test_sorted_flat_deque_layout<sorted_flat_deque<int32_t, int32_t,
+            three_way_less<int32_t>, 3, identity_value<int32_t>, std::allocator<int32_t>, false,
+            uint16_t>>(62);
+        test_sorted_flat_deque_layout<sorted_flat_deque<int32_t, int32_t,
+            three_way_less<int32_t>, 0, identity_value<int32_t>, std::allocator<int32_t>, false,
+            uint32_t, true>>(63);
+        test_sorted_flat_deque_layout<sorted_flat_deque<int32_t, int32_t,
+            three_way_less<int32_t>, 3, identity_value<int32_t>, std::allocator<int32_t>, true,
+            uint16_t, true>>(64);
+
+        // The node buffer of an int16_t window halves with uint16_t links.
+        using wide_t = sorted_flat_deque<int16_t, int16_t, three_way_less<int16_t>, 0,
+            identity_value<int16_t>, arena_allocator<int16_t>>;
+        using narrow_t = sorted_flat_deque<int16_t, int16_t, three_way_less<int16_t>, 0,
+            identity_value<int16_t>, arena_allocator<int16_t>, false, sorted_flat_offset_t<1000>>;
+        arena_t wide;
+        arena_t narrow;
         {
-            rng.seed(seed);
+            wide_t wideDeque(1000, three_way_less<int16_t>(), arena_allocator<int16_t>(&wide));
+            narrow_t narrowDeque(1000, three_way_less<int16_t>(), arena_allocator<int16_t>(&narrow));
+            assert(narrow.live_bytes == 1000 * 3 * sizeof(int16_t));
+            assert(wide.live_bytes == 2 * narrow.live_bytes);
+        }
+        assert(narrow.live_bytes == 0);
 
-            sorted_flat_deque<int32_t> testB;
-            testB.set_max_size(maxSize);
+        // A split deque constructs only the pushed items, item_t needs no default constructor.
+        struct tracked_less {
+            int8_t operator()(const tracked_t& left, const tracked_t& right) const {
+                return static_cast<int8_t>((right.value < left.value) - (left.value < right.value));
+            }
+        };
+        {
+            sorted_flat_deque<tracked_t, tracked_t, tracked_less, 2, identity_value<tracked_t>,
+                std::allocator<tracked_t>, false, uint16_t, true> deque(8);
+            for (int32_t i = 0; i < 20; ++i) {
+                deque.push_back(tracked_t((i * 7) % 10));
+            } // 4 1 8 5 2 9 6 3
+            assert(tracked_t::live == 8);
+            assert(deque.median().value == 4);
+            assert(deque.pop_front().value == 4); // 1 8 5 2 9 6 3
+            deque.set_max_size(4, false);
+            assert(tracked_t::live == 4);
+            assert(deque.back().value == 2); // 1 8 5 2
+            auto copy = deque;
+            assert(tracked_t::live == 8);
+            assert(copy.min().value == 1 && copy.max().value == 8);
+        }
+        assert(tracked_t::live == 0);
 
-            begin = std::chrono::high_resolution_clock::now();
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 0, identity_value<int32_t>,
+            std::allocator<int32_t>, true, uint8_t> pow2;
+        pow2.set_max_size(128);
+        bool thrown = false;
+        try {
+            pow2.set_max_size(129);
+        }
+        catch (const std::length_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+    } // offset_t and split_items
+
+    { // snapshot
+        test_sorted_flat_deque_snapshot<sorted_flat_deque<int32_t>>(65);
+        test_sorted_flat_deque_snapshot<sorted_flat_deque<int32_t, int32_t,
+            three_way_less<int32_t>, 4>>(66);
+        test_sorted_flat_deque_snapshot<sorted_flat_deque<int32_t, int32_t,
+            three_way_less<int32_t>, 3, identity_value<int32_t>, std::allocator<int32_t>, true,
+            uint8_t, true>>(67);
 
-            for (uint32_t i = 0; i < reps; ++i) {
-                int32_t newValue = rng() % 200 - 100;
-                testB.push_back(newValue);
-                chsumB += testB.median();
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 2> deque(50);
+        for (int32_t i = 0; i < 80; ++i) {
+            deque.push_back(i * 7 % 31);
+        }
+        std::vector<char> memory(deque.saved_size());
+        deque.save(memory.data(), memory.size());
+        const auto load_fails = [](sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 2>&
+                target, const std::vector<char>& bytes) {
+            try {
+                target.load(bytes.data(), bytes.size());
+            }
+            catch (const std::runtime_error&) {
+                assert(target.empty() && target.begin() == target.end());
+                return true;
+            }
+            return false;
+        };
+        sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 2> target(10);
+        target.push_back(3);
+        std::vector<char> corrupted(memory.begin(), memory.end() - 1);
+        assert(load_fails(target, corrupted)); // truncated
+        corrupted = memory;
+        corrupted[4] += 1;
+        assert(load_fails(target, corrupted)); // version
+        // The nodes end the snapshot, each one ends with prevOffset and nextOffset.
+        auto shorter = deque;
+        shorter.pop_front();
+        const size_t nodeSize = memory.size() - shorter.saved_size();
+        for (const size_t node : { 0, 1, 20, 49 }) {
+            const size_t end = memory.size() - node * nodeSize;
+            for (const size_t at : { end - 1, end - 2 * sizeof(uint32_t) }) {
+                corrupted = memory;
+                corrupted[at] ^= 0x40;
+                assert(load_fails(target, corrupted));
             }
+        }
+        assert(!load_fails(target, memory));
+        assert(std::equal(deque.begin(), deque.end(), target.begin()));
 
-            end = std::chrono::high_resolution_clock::now();
+        // The first quantile scale follows the 104-byte header: a fraction above 1 is refused.
+        auto withQuantile = deque;
+        withQuantile.add_quantile(1.0);
+        std::vector<char> quantileMemory(withQuantile.saved_size());
+        withQuantile.save(quantileMemory.data(), quantileMemory.size());
+        uint64_t scale = 0;
+        std::memcpy(&scale, quantileMemory.data() + 104, sizeof(scale));
+        assert(scale == uint64_t(1) << 32);
+        assert(!load_fails(target, quantileMemory));
+        // The cursor pos (after the scale and the offset) agrees with the scale, rank 73 of 50.
+        scale = (uint64_t(3) << 31) + 1;
+        const uint32_t pos = static_cast<uint32_t>(((withQuantile.size() - 1) * scale) >> 32);
+        std::memcpy(&quantileMemory[104], &scale, sizeof(scale));
+        std::memcpy(&quantileMemory[104 + sizeof(scale) + sizeof(uint32_t)], &pos, sizeof(pos));
+        assert(load_fails(target, quantileMemory));
 
-            const int64_t durationB_mcs = std::chrono::duration_cast<
-                std::chrono::microseconds>(end - begin).count();
-            minDurationB_mcs = std::min(minDurationB_mcs, durationB_mcs);
-            std::cout << "TestB: seed=" << seed << " time="
-                << durationB_mcs << " mcs, chsum=" << chsumB << std::endl;
+        // Another item type or mode is refused by the header.
+        std::stringstream stream;
+        deque.save(stream);
+        sorted_flat_deque<int32_t> linear;
+        bool is_throw_catched = false;
+        try {
+            linear.load(stream);
+        }
+        catch (const std::runtime_error&) {
+            is_throw_catched = true;
+        }
+        assert(is_throw_catched == true);
+
+        // An empty window and a zero max_size round trip as well.
+        sorted_flat_deque<int32_t> empty(5);
+        empty.add_quantile(0.5);
+        memory.resize(empty.saved_size());
+        empty.save(memory.data(), memory.size());
+        linear.push_back(1);
+        linear.load(memory.data(), memory.size());
+        assert(linear.empty() && linear.max_size() == 5 && linear.quantiles_count() == 1);
+        linear.push_back(4);
+        assert(linear.quantile(0) == 4);
+        sorted_flat_deque<int32_t> zero;
+        memory.resize(zero.saved_size());
+        zero.save(memory.data(), memory.size());
+        linear.load(memory.data(), memory.size());
+        assert(linear.max_size() == 0 && linear.quantiles_count() == 0);
+    } // snapshot
+
+#ifdef TESTS_HAVE_PMR
+    { // std::pmr
+        using deque_t = sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 0,
+            identity_value<int32_t>, std::pmr::polymorphic_allocator<int32_t>>;
+        // Throws if anything in the window is allocated outside of the arena.
+        alignas(64) char storage[1 << 14];
+        std::pmr::monotonic_buffer_resource resource(storage, sizeof(storage),
+            std::pmr::null_memory_resource());
+        deque_t deque(64, three_way_less<int32_t>(), &resource);
+        deque.add_quantile(0.5);
+        sorted_flat_deque<int32_t> reference(64);
+        for (int32_t i = 0; i < 1000; ++i) {
+            deque.push_back(i * 7919 % 1000);
+            reference.push_back(i * 7919 % 1000);
+        }
+        assert(std::equal(deque.begin(), deque.end(), reference.begin()));
+        assert(deque.quantile(0) == reference.median());
+        deque.set_max_size(128);
+        assert(deque.get_allocator().resource() == &resource);
+        assert(deque.median() == reference.median());
+    } // std::pmr
+#endif
+}
+
+void test_sorted_flat_time_window() {
+    { // advance_to
+        sorted_flat_time_window<sorted_flat_deque<int32_t>> window(10, 2, 64);
+        assert(window.capacity() == 2);
+        for (int64_t time = 0; time < 10; ++time) {
+            window.push_back(time, static_cast<int32_t>(time));
+        }
+        assert(window.size() == 10);
+        assert(window.capacity() == 16);
+        assert(window.median() == 4);
+        window.advance_to(14); // keeps (4, 14]
+        assert(window.size() == 5);
+        assert(window.front_time() == 5);
+        assert(window.min() == 5);
+        assert(window.median() == 7);
+        window.advance_to(18); // keeps 9, a quarter of the capacity is not reached
+        assert(window.size() == 1);
+        assert(window.capacity() == 8);
+        window.advance_to(30);
+        assert(window.empty());
+        assert(window.capacity() == 4);
+        window.push_back(30, 7);
+        window.push_back(30, 8);
+        assert(window.median() == 7);
+
+        bool is_throw_catched = false;
+        try {
+            window.push_back(29, 1);
+        }
+        catch (const std::logic_error&) {
+            is_throw_catched = true;
+        }
+        assert(is_throw_catched == true);
+    } // advance_to
+
+    { // max_capacity
+        sorted_flat_time_window<sorted_flat_array<int32_t>> window(1000, 1, 6);
+        for (int32_t i = 0; i < 20; ++i) {
+            window.push_back(i, i);
+        }
+        assert(window.capacity() == 6);
+        assert(window.size() == 6);
+        assert(window.min() == 14);
+        assert(window.front_time() == 14);
+        window.set_span(3);
+        assert(window.size() == 3);
+        assert(window.min() == 17);
+    } // max_capacity
+
+    { // rate change
+        using clock = std::chrono::steady_clock;
+        std::mt19937 rng(29);
+        sorted_flat_time_window<sorted_flat_deque<int32_t, int32_t, three_way_less<int32_t>, 3>,
+            clock::time_point> window(std::chrono::seconds(30), 16, 1 << 16);
+        std::vector<std::pair<clock::time_point, int32_t>> reference;
+        clock::time_point now = clock::time_point();
+        for (uint32_t phase = 0; phase < 4; ++phase) {
+            // 100 samples per second, then 1 sample per second
+            const auto step = phase & 1 ? std::chrono::milliseconds(1000)
+                : std::chrono::milliseconds(10);
+            for (uint32_t i = 0; i < 4000; ++i) {
+                now += step;
+                const int32_t value = rng() % 1000;
+                window.push_back(now, value);
+                reference.emplace_back(now, value);
+                if (i % 50 == 0) {
+                    std::vector<int32_t> values;
+                    for (const auto& sample : reference) {
+                        if (now - sample.first < std::chrono::seconds(30)) {
+                            values.push_back(sample.second);
+                        }
+                    }
+                    std::sort(values.begin(), values.end());
+                    assert(window.size() == values.size());
+                    assert(window.median() == values[(values.size() - 1) / 2]);
+                    assert(window.capacity() < 4 * values.size()
+                        || window.capacity() == window.min_capacity());
+                }
+            }
+        }
+    } // rate change
+
+    { // a deque with items
+        sorted_flat_deque<int32_t> deque(8);
+        deque.push_back(1);
+        bool thrown = false;
+        try {
+            sorted_flat_time_window<sorted_flat_deque<int32_t>> window(10, 2, 64, deque);
+        }
+        catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+        deque.clear();
+        sorted_flat_time_window<sorted_flat_deque<int32_t>> window(10, 2, 64, deque);
+        window.push_back(0, 5);
+        assert(window.size() == 1 && window.median() == 5);
+    } // a deque with items
+}
+
+template <typename item_t>
+void test_sorted_flat_array_isa(const sorted_flat_array_isa isa) {
+    if (!sorted_flat_array<item_t>::set_isa(isa)) {
+        return;
+    }
+    assert(sorted_flat_array<item_t>::isa() == isa);
+    std::mt19937 rng(isa == sorted_flat_array_isa::avx2 ? 7 : 3);
+    sorted_flat_deque<item_t> deque;
+    sorted_flat_array<item_t> array;
+    std::vector<item_t> batch;
+    for (uint32_t max_size : { 0, 1, 2, 7, 65, 300 }) {
+        deque.clear();
+        array.clear();
+        deque.set_max_size(max_size);
+        array.set_max_size(max_size);
+        for (uint32_t i = 0; i < 3000; ++i) {
+            const item_t value = static_cast<item_t>(static_cast<int32_t>(rng() % 50) - 25);
+            switch (rng() % 10) {
+            case 0:
+                deque.push_front(value);
+                array.push_front(value);
+                break;
+            case 1:
+                if (!deque.empty()) {
+                    assert(deque.pop_front() == array.pop_front());
+                }
+                break;
+            case 2:
+                if (!deque.empty()) {
+                    assert(deque.pop_back() == array.pop_back());
+                }
+                break;
+            case 3:
+                batch.resize(rng() % 40);
+                for (auto& item : batch) {
+                    item = static_cast<item_t>(static_cast<int32_t>(rng() % 50) - 25);
+                }
+                deque.push_back(batch.begin(), batch.end());
+                array.push_back(batch.begin(), batch.end());
+                break;
+            default:
+                deque.push_back(value);
+                array.push_back(value);
+                break;
+            }
+            assert(deque.size() == array.size());
+            assert(std::equal(deque.begin(), deque.end(), array.begin()));
+            if (!deque.empty()) {
+                assert(deque.min() == array.min());
+                assert(deque.median() == array.median());
+                assert(deque.max() == array.max());
+                assert(deque.front() == array.front());
+                assert(deque.back() == array.back());
+                assert(*array.median_it() == deque.median());
+            }
+            const item_t probe = static_cast<item_t>(static_cast<int32_t>(rng() % 54) - 27);
+            assert(deque.count_less(probe) == array.count_less(probe));
+            assert(deque.rank_of(probe) == array.rank_of(probe));
+        }
+    }
+}
+
+void test_sorted_flat_array() {
+    { // simd
+        for (auto isa : { sorted_flat_array_isa::scalar, sorted_flat_array_isa::sse2,
+                sorted_flat_array_isa::avx2 }) {
+            test_sorted_flat_array_isa<int32_t>(isa);
+            test_sorted_flat_array_isa<float>(isa);
+            test_sorted_flat_array_isa<double>(isa);
+        }
+        test_sorted_flat_array_isa<int16_t>(sorted_flat_array_isa::scalar);
+        assert(sorted_flat_array<int16_t>::set_isa(sorted_flat_array_isa::sse2) == false);
+        assert(sorted_flat_array<int16_t>::isa() == sorted_flat_array_isa::scalar);
+    } // simd
+    { // limits
+        sorted_flat_array<int32_t> array(4);
+        for (int32_t value : { INT32_MAX, INT32_MIN, 0, INT32_MAX, INT32_MIN }) {
+            array.push_back(value);
+        }
+        assert(array.min() == INT32_MIN);
+        assert(array.max() == INT32_MAX);
+        assert(array.rank_of(INT32_MAX) == 4);
+        assert(array.count_less(INT32_MAX) == 3);
+        assert(array.count_less(INT32_MIN) == 0);
+        array.set_max_size(2);
+        assert(array.size() == 2);
+        assert(array.front() == INT32_MAX);
+        assert(array.min() == INT32_MIN);
+        array.set_max_size(3, false);
+        array.push_front(5);
+        array.set_max_size(2, false);
+        assert(array.front() == 5);
+        assert(array.back() == INT32_MAX);
+        assert(array.median() == 5);
+        bool is_throw_catched = false;
+        try {
+            array.nth(4);
+        }
+        catch (const std::out_of_range&) {
+            is_throw_catched = true;
+        }
+        assert(is_throw_catched == true);
+    } // limits
+}
+
+template <typename item_t>
+void test_sorted_flat_deque_bank_of(const size_t series_count, const uint32_t max_size,
+        const uint32_t range) {
+    std::mt19937 rng(static_cast<uint32_t>(series_count * 31 + max_size));
+    sorted_flat_deque_bank<item_t> bank(series_count, max_size);
+    std::vector<sorted_flat_deque<item_t>> deques(series_count);
+    for (auto& deque : deques) {
+        deque.set_max_size(max_size);
+    }
+    std::vector<item_t> values(series_count);
+    std::vector<item_t> medians(series_count);
+    std::vector<item_t> mins(series_count);
+    std::vector<item_t> maxs(series_count);
+    std::vector<item_t> sorted;
+    for (uint32_t step = 0; step < 600; ++step) {
+        if (rng() % 8 == 0 && !bank.empty()) {
+            bank.pop_front_all();
+            for (auto& deque : deques) {
+                deque.pop_front();
+            }
+        }
+        else {
+            for (auto& value : values) {
+                value = static_cast<item_t>(rng() % range);
+            }
+            bank.push_all(values.data());
+            for (size_t series = 0; series < series_count; ++series) {
+                deques[series].push_back(values[series]);
+            }
+        }
+        assert(bank.size() == deques[0].size());
+        if (bank.empty()) {
+            continue;
+        }
+        bank.medians(medians.data());
+        bank.mins(mins.data());
+        bank.maxs(maxs.data());
+        for (size_t series = 0; series < series_count; ++series) {
+            assert(medians[series] == deques[series].median());
+            assert(mins[series] == deques[series].min());
+            assert(maxs[series] == deques[series].max());
+            sorted.clear();
+            bank.copy_sorted(series, std::back_inserter(sorted));
+            assert(std::equal(sorted.begin(), sorted.end(), deques[series].begin()));
         }
-        //if (chsumA != chsumB) {
-        //    [] {};
-        //}
-        assert(chsumA == chsumB);
     }
-    std::cout << "minDurationA=" << minDurationA_mcs
-        << " minDurationB=" << minDurationB_mcs << std::endl;
-    system("pause");
+}
+
+void test_sorted_flat_deque_bank() {
+    { // push_all
+        test_sorted_flat_deque_bank_of<float>(1, 1, 4);
+        test_sorted_flat_deque_bank_of<float>(7, 2, 4);
+        test_sorted_flat_deque_bank_of<float>(33, 9, 5);
+        test_sorted_flat_deque_bank_of<int32_t>(17, 64, 1000);
+        test_sorted_flat_deque_bank_of<int32_t>(5, 101, 3);
+    } // push_all
+
+    { // empty
+        sorted_flat_deque_bank<double> bank(3, 4);
+        bool is_throw_catched = false;
+        try {
+            bank.pop_front_all();
+        }
+        catch (const std::logic_error&) {
+            is_throw_catched = true;
+        }
+        assert(is_throw_catched == true);
+        const double values[] = { 3.0, 1.0, 2.0 };
+        bank.push_all(values);
+        bank.clear();
+        assert(bank.empty());
+        bank.push_all(values);
+        assert(bank.median(1) == 1.0);
+        assert(bank.series_count() == 3);
+    } // empty
+}
+
+void test_sorted_flat_runs() {
+    { // against sorted_flat_deque
+        std::mt19937 rng(71);
+        sorted_flat_runs<int32_t> runs(300);
+        sorted_flat_deque<int32_t> reference(300);
+        std::vector<int32_t> batch;
+        std::vector<int32_t> reversed;
+        for (uint32_t step = 0; step < 20000; ++step) {
+            const int32_t value = static_cast<int32_t>(rng() % 13) - 6;
+            switch (rng() % 24) {
+            case 0:
+                runs.push_front(value);
+                reference.push_front(value);
+                break;
+            case 1:
+                if (!reference.empty()) {
+                    assert(runs.pop_front() == reference.pop_front());
+                }
+                break;
+            case 2:
+                if (!reference.empty()) {
+                    assert(runs.pop_back() == reference.pop_back());
+                }
+                break;
+            case 3:
+                batch.resize(rng() % 50);
+                for (auto& item : batch) {
+                    item = static_cast<int32_t>(rng() % 13) - 6;
+                }
+                runs.push_back(batch.begin(), batch.end());
+                reference.push_back(batch.begin(), batch.end());
+                break;
+            case 4: {
+                const uint32_t maxSize = rng() % 400;
+                const bool fromFront = (rng() & 1) != 0;
+                runs.set_max_size(maxSize, fromFront);
+                reference.set_max_size(maxSize, fromFront);
+                break;
+            }
+            default:
+                runs.push_back(value);
+                reference.push_back(value);
+                break;
+            }
+            assert(runs.size() == reference.size());
+            assert(runs.rank_of(value) == reference.rank_of(value));
+            assert(runs.count_less(value) == reference.count_less(value));
+            if (reference.empty()) {
+                assert(runs.begin() == runs.end());
+                assert(runs.distinct() == 0);
+                continue;
+            }
+            assert(runs.front() == reference.front());
+            assert(runs.back() == reference.back());
+            assert(runs.min() == reference.min());
+            assert(runs.median() == reference.median());
+            assert(*runs.median_it() == reference.median());
+            assert(runs.max() == reference.max());
+            const uint32_t rank = rng() % reference.size();
+            assert(runs.nth(rank) == reference.nth(rank));
+            if (step % 64 == 0) {
+                assert(std::equal(runs.begin(), runs.end(), reference.begin()));
+                reversed.clear();
+                for (auto it = runs.end(); it != runs.begin(); ) {
+                    reversed.push_back(*--it);
+                }
+                assert(std::equal(reversed.rbegin(), reversed.rend(), reference.begin()));
+                std::sort(reversed.begin(), reversed.end());
+                const auto distinct = std::unique(reversed.begin(), reversed.end()) - reversed.begin();
+                assert(runs.distinct() == static_cast<uint32_t>(distinct));
+            }
+        }
+    } // against sorted_flat_deque
+
+    { // insertion order within a run
+        struct keyed_t {
+            int32_t key;
+            int32_t seq;
+        };
+        struct key_less {
+            int8_t operator()(const keyed_t& left, const keyed_t& right) const {
+                return static_cast<int8_t>((right.key < left.key) - (left.key < right.key));
+            }
+        };
+        std::mt19937 rng(73);
+        sorted_flat_runs<keyed_t, key_less, uint16_t> runs(64);
+        sorted_flat_deque<keyed_t, keyed_t, key_less> reference(64);
+        for (int32_t seq = 0; seq < 2000; ++seq) {
+            const keyed_t item = { static_cast<int32_t>(rng() % 4), seq };
+            if (seq % 5 == 4) {
+                assert(runs.pop_back().seq == reference.pop_back().seq);
+            }
+            runs.push_back(item);
+            reference.push_back(item);
+            assert(runs.median().seq == reference.median().seq);
+            assert(runs.min().seq == reference.min().seq);
+            assert(runs.max().seq == reference.max().seq);
+            const uint16_t rank = static_cast<uint16_t>(rng() % reference.size());
+            assert(runs.nth(rank).seq == reference.nth(rank).seq);
+        }
+        assert(runs.distinct() == 4);
+        assert(std::equal(runs.begin(), runs.end(), reference.begin(),
+            [](const keyed_t& left, const keyed_t& right) { return left.seq == right.seq; }));
+        sorted_flat_runs<keyed_t, key_less, uint16_t> copy(runs);
+        runs.clear();
+        assert(runs.empty() && runs.distinct() == 0);
+        copy.swap(runs);
+        assert(runs.median().seq == reference.median().seq);
+    } // insertion order within a run
+}
+
+void test_sorted_flat_histogram() {
+    { // against sorted_flat_deque
+        std::mt19937 rng(79);
+        sorted_flat_histogram<int16_t, sorted_flat_key_range<int16_t, -100, 99>> histogram(300);
+        sorted_flat_deque<int16_t> reference(300);
+        histogram.set_quantiles({ 0.1, 0.9 });
+        reference.set_quantiles({ 0.1, 0.9 });
+        std::vector<int16_t> batch;
+        std::vector<int16_t> reversed;
+        for (uint32_t step = 0; step < 20000; ++step) {
+            // Narrow values in the first half, for the duplicates.
+            const int16_t value = static_cast<int16_t>(
+                step < 10000 ? rng() % 200 - 100 : rng() % 9 - 4);
+            switch (rng() % 24) {
+            case 0:
+                histogram.push_front(value);
+                reference.push_front(value);
+                break;
+            case 1:
+                if (!reference.empty()) {
+                    assert(histogram.pop_front() == reference.pop_front());
+                }
+                break;
+            case 2:
+                if (!reference.empty()) {
+                    assert(histogram.pop_back() == reference.pop_back());
+                }
+                break;
+            case 3:
+                batch.resize(rng() % 50);
+                for (auto& item : batch) {
+                    item = static_cast<int16_t>(rng() % 200 - 100);
+                }
+                histogram.push_back(batch.begin(), batch.end());
+                reference.push_back(batch.begin(), batch.end());
+                break;
+            case 4: {
+                const uint32_t maxSize = rng() % 400;
+                const bool fromFront = (rng() & 1) != 0;
+                histogram.set_max_size(maxSize, fromFront);
+                reference.set_max_size(maxSize, fromFront);
+                break;
+            }
+            case 5: {
+                const uint32_t count = reference.empty() ? 0 : rng() % reference.size();
+                histogram.pop_front(count);
+                reference.pop_front(count);
+                break;
+            }
+            default:
+                histogram.push_back(value);
+                reference.push_back(value);
+                break;
+            }
+            assert(histogram.size() == reference.size());
+            assert(histogram.rank_of(value) == reference.rank_of(value));
+            assert(histogram.count_less(value) == reference.count_less(value));
+            if (reference.empty()) {
+                assert(histogram.begin() == histogram.end());
+                assert(histogram.distinct() == 0);
+                continue;
+            }
+            assert(histogram.front() == reference.front());
+            assert(histogram.back() == reference.back());
+            assert(histogram.min() == reference.min());
+            assert(histogram.median() == reference.median());
+            assert(*histogram.median_it() == reference.median());
+            assert(histogram.max() == reference.max());
+            assert(histogram.quantile(0) == reference.quantile(0));
+            assert(histogram.quantile(1) == reference.quantile(1));
+            const uint32_t rank = rng() % reference.size();
+            assert(histogram.nth(rank) == reference.nth(rank));
+            if (step % 64 == 0) {
+                assert(std::equal(histogram.begin(), histogram.end(), reference.begin()));
+                reversed.clear();
+                for (auto it = histogram.end(); it != histogram.begin(); ) {
+                    reversed.push_back(*--it);
+                }
+                assert(std::equal(reversed.rbegin(), reversed.rend(), reference.begin()));
+                std::sort(reversed.begin(), reversed.end());
+                const auto distinct = std::unique(reversed.begin(), reversed.end()) - reversed.begin();
+                assert(histogram.distinct() == static_cast<uint32_t>(distinct));
+            }
+        }
+        assert(histogram.rank_of(-101) == 0);
+        assert(histogram.count_less(100) == histogram.size());
+    } // against sorted_flat_deque
+
+    { // full range, out of range
+        sorted_flat_histogram<uint8_t, sorted_flat_key_range<uint8_t>, uint16_t> bytes(5);
+        for (const uint8_t item : { 255, 0, 7, 255, 128, 7 }) {
+            bytes.push_back(item);
+        }
+        assert(bytes.size() == 5);
+        assert(bytes.front() == 0 && bytes.back() == 7);
+        assert(bytes.min() == 0 && bytes.median() == 7 && bytes.max() == 255);
+        assert(bytes.count(7) == 2 && bytes.count(255) == 1 && bytes.distinct() == 4);
+        assert(bytes.nth(2) == 7 && bytes.nth(3) == 128);
+        sorted_flat_histogram<uint8_t, sorted_flat_key_range<uint8_t>, uint16_t> copy(bytes);
+        bytes.clear();
+        assert(bytes.empty() && bytes.distinct() == 0 && bytes.max_size() == 5);
+        copy.swap(bytes);
+        assert(bytes.median() == 7);
+
+        sorted_flat_histogram<int32_t, sorted_flat_key_range<int32_t, 0, 1023>> bounded(4);
+        bounded.push_back(1023);
+        bool thrown = false;
+        try {
+            bounded.push_back(1024);
+        }
+        catch (const std::out_of_range&) {
+            thrown = true;
+        }
+        assert(thrown);
+        assert(bounded.size() == 1 && bounded.median() == 1023);
+    } // full range, out of range
+}
+
+void test_sorted_flat_publisher() {
+    { // snapshot
+        sorted_flat_deque<int32_t> deque(8);
+        deque.set_quantiles({ 0.25, 0.75, 1.0 });
+        sorted_flat_publisher<sorted_flat_deque<int32_t>, 2> publisher(std::move(deque));
+        auto snapshot = publisher.snapshot();
+        assert(snapshot.size == 0);
+        assert(snapshot.version == 1);
+        for (int32_t i = 1; i <= 10; ++i) {
+            publisher.push_back(i);
+        }
+        snapshot = publisher.snapshot();
+        assert(snapshot.version == 11);
+        assert(snapshot.size == 8);
+        assert(snapshot.min == 3);
+        assert(snapshot.median == 6);
+        assert(snapshot.max == 10);
+        assert(snapshot.quantiles_count == 2);
+        assert(snapshot.quantiles[0] == publisher.deque().quantile(0));
+        assert(snapshot.quantiles[1] == publisher.deque().quantile(1));
+        publisher.pop_front();
+        assert(publisher.snapshot().min == 4);
+    } // snapshot
+
+    { // concurrent readers
+        const int32_t windowSize = 64;
+        const int32_t pushes = 100000;
+        sorted_flat_array<int32_t> array(windowSize);
+        sorted_flat_publisher<sorted_flat_array<int32_t>> publisher(std::move(array));
+        std::atomic<bool> done(false);
+        std::atomic<uint32_t> torn(0);
+        std::vector<std::thread> readers;
+        for (uint32_t i = 0; i < 3; ++i) {
+            readers.emplace_back([&] {
+                uint64_t version = 0;
+                while (!done.load()) {
+                    const auto snapshot = publisher.snapshot();
+                    // A ramp: every consistent snapshot is a run of consecutive numbers.
+                    if (snapshot.version < version || (snapshot.size > 0
+                            && (snapshot.max - snapshot.min
+                                    != static_cast<int32_t>(snapshot.size) - 1
+                                || snapshot.median != snapshot.min
+                                    + (static_cast<int32_t>(snapshot.size) - 1) / 2))) {
+                        torn += 1;
+                    }
+                    version = snapshot.version;
+                }
+            });
+        }
+        for (int32_t i = 0; i < pushes; ++i) {
+            publisher.push_back(i);
+        }
+        done = true;
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        assert(torn == 0);
+        assert(publisher.snapshot().max == pushes - 1);
+        assert(publisher.version() == pushes + 1);
+    } // concurrent readers
+}
+
+void test_spsc_ring() {
+    { // drop
+        spsc_ring<int32_t, spsc_overflow::drop> ring(5);
+        assert(ring.capacity() == 8);
+        for (int32_t i = 0; i < 10; ++i) {
+            assert(ring.push(i) == (i < 8));
+        }
+        assert(ring.dropped() == 2);
+        assert(ring.size() == 8);
+        sorted_flat_deque<int32_t> deque(16);
+        assert(ring.drain(deque, 3) == 3);
+        assert(deque.size() == 3);
+        assert(deque.back() == 2);
+        int32_t item = 0;
+        assert(ring.try_pop(item) && item == 3);
+        // 4..7 and 8..10 wrap around the end of the ring
+        assert(ring.push(8) && ring.push(9) && ring.push(10));
+        assert(ring.drain(deque, 100) == 7);
+        assert(deque.size() == 10);
+        assert(deque.front() == 0);
+        assert(deque.back() == 10);
+        assert(deque.max() == 10);
+        assert(!ring.try_pop(item));
+        assert(ring.drain(deque, 100) == 0);
+    } // drop
+
+    { // back_pressure
+        const int32_t pushes = 50000;
+        std::vector<int32_t> values(pushes);
+        std::mt19937 rng(37);
+        for (auto& value : values) {
+            value = rng() % 1000;
+        }
+        spsc_ring<int32_t> ring(64);
+        std::thread producer([&] {
+            for (const int32_t value : values) {
+                ring.push(value);
+            }
+        });
+        sorted_flat_deque<int32_t> drained(100);
+        size_t count = 0;
+        while (count < values.size()) {
+            const size_t batch = ring.drain(drained, 37);
+            if (batch == 0) {
+                std::this_thread::yield();
+            }
+            count += batch;
+        }
+        producer.join();
+        assert(ring.dropped() == 0);
+        sorted_flat_deque<int32_t> reference(100);
+        for (const int32_t value : values) {
+            reference.push_back(value);
+        }
+        assert(std::equal(reference.begin(), reference.end(), drained.begin()));
+        assert(reference.front() == drained.front());
+        assert(reference.back() == drained.back());
+    } // back_pressure
+}
+
+void test_sorted_flat_executor() {
+    { // keyed windows
+        const uint32_t keys = 300;
+        std::vector<std::pair<uint64_t, int32_t>> entries(20000);
+        std::mt19937 rng(41);
+        for (auto& entry : entries) {
+            entry.first = rng() % keys;
+            entry.second = static_cast<int32_t>(rng() % 1000);
+        }
+        sorted_flat_executor<sorted_flat_deque<int32_t>> executor(
+            sorted_flat_deque<int32_t>(17), 4, 16);
+        assert(executor.worker_count() == 4);
+        assert(executor.shard_count() == 16);
+        for (size_t i = 0; i < entries.size(); i += 1000) {
+            executor.submit(entries.begin() + i, entries.begin() + i + 1000);
+        }
+        executor.wait();
+        std::vector<sorted_flat_deque<int32_t>> reference(keys, sorted_flat_deque<int32_t>(17));
+        for (const auto& entry : entries) {
+            reference[entry.first].push_back(entry.second);
+        }
+        assert(executor.window_count() == keys);
+        for (uint64_t key = 0; key < keys; ++key) {
+            const sorted_flat_deque<int32_t>* window = executor.find(key);
+            assert(window != nullptr);
+            assert(window->size() == reference[key].size());
+            assert(std::equal(window->begin(), window->end(), reference[key].begin()));
+            assert(window->front() == reference[key].front());
+            assert(window->back() == reference[key].back());
+            assert(window->median() == reference[key].median());
+        }
+        assert(executor.find(keys) == nullptr);
+        size_t visited = 0;
+        executor.for_each([&](const uint64_t key, const sorted_flat_deque<int32_t>& window) {
+            assert(window.median() == reference[key].median());
+            ++visited;
+        });
+        assert(visited == keys);
+    } // keyed windows
+
+    { // skewed
+        // Every key goes to the shard 0 of the worker 0, the other workers may only steal.
+        sorted_flat_executor<sorted_flat_deque<int32_t>> executor(
+            sorted_flat_deque<int32_t>(8), 3, 6);
+        sorted_flat_deque<int32_t> reference(8);
+        for (int32_t i = 0; i < 5000; ++i) {
+            executor.submit(std::make_pair(uint64_t(12), i % 97));
+            reference.push_back(i % 97);
+        }
+        executor.wait();
+        assert(executor.window_count() == 1);
+        const sorted_flat_deque<int32_t>* window = executor.find(12);
+        assert(window != nullptr);
+        assert(std::equal(window->begin(), window->end(), reference.begin()));
+        assert(window->back() == reference.back());
+        // submit() after wait() keeps going
+        executor.submit(std::make_pair(uint64_t(18), 5));
+        executor.wait();
+        assert(executor.window_count() == 2);
+        assert(executor.find(18)->median() == 5);
+    } // skewed
+}
+
+void test_sorted_flat_mapped() {
+    const char* path = "sorted_flat_mapped_test.bin";
+    { // persistence
+        test_sorted_flat_mapped_of<sorted_flat_deque<int32_t>>(path, 81, false);
+        test_sorted_flat_mapped_of<sorted_flat_deque<int32_t, int32_t,
+            three_way_less<int32_t>, 4>>(path, 82, false);
+        test_sorted_flat_mapped_of<sorted_flat_deque<int32_t, int32_t,
+            three_way_less<int32_t>, 3, identity_value<int32_t>, std::allocator<int32_t>, true,
+            uint8_t, true>>(path, 83, true);
+    } // persistence
+
+    { // foreign files
+        std::remove(path);
+        {
+            std::ofstream file(path, std::ios::binary);
+            file << "not a window, but long enough to have a control block of its own";
+        }
+        bool thrown = false;
+        try {
+            sorted_flat_mapped<sorted_flat_deque<int32_t>> mapped(path);
+        }
+        catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        {
+            std::ifstream file(path, std::ios::binary);
+            std::string text;
+            std::getline(file, text);
+            assert(text.compare(0, 12, "not a window") == 0);
+        }
+        std::remove(path);
+        {
+            sorted_flat_mapped<sorted_flat_deque<int32_t>> mapped(path,
+                sorted_flat_deque<int32_t>(16));
+            mapped.push_back(5);
+        }
+        thrown = false;
+        try { // another instantiation
+            sorted_flat_mapped<sorted_flat_deque<double>> mapped(path);
+        }
+        catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        sorted_flat_mapped<sorted_flat_deque<int32_t>> mapped(path);
+        assert(mapped.deque().size() == 1 && mapped.deque().median() == 5);
+        assert(mapped.deque().max_size() == 16);
+
+        // Zeros of exactly the size of a new file are not taken for an unfinished one.
+        const char* zerosPath = "sorted_flat_mapped_zeros.bin";
+        std::ifstream created(path, std::ios::binary | std::ios::ate);
+        const std::vector<char> zeros(static_cast<size_t>(created.tellg()), 0);
+        {
+            std::ofstream file(zerosPath, std::ios::binary);
+            file.write(zeros.data(), static_cast<std::streamsize>(zeros.size()));
+        }
+        thrown = false;
+        try {
+            sorted_flat_mapped<sorted_flat_deque<int32_t>> reclaimed(zerosPath,
+                sorted_flat_deque<int32_t>(16));
+        }
+        catch (const std::runtime_error&) {
+            thrown = true;
+        }
+        assert(thrown);
+        std::ifstream file(zerosPath, std::ios::binary);
+        const std::vector<char> kept((std::istreambuf_iterator<char>(file)),
+            std::istreambuf_iterator<char>());
+        assert(kept == zeros);
+        file.close();
+        std::remove(zerosPath);
+    } // foreign files
+    std::remove(path);
+}
+
+int main() {
+    test_circular_buffer();
+    test_sorted_flat_deque();
+    test_sorted_flat_array();
+    test_sorted_flat_time_window();
+    test_sorted_flat_deque_bank();
+    test_sorted_flat_runs();
+    test_sorted_flat_histogram();
+    test_sorted_flat_publisher();
+    test_spsc_ring();
+    test_sorted_flat_executor();
+    test_sorted_flat_mapped();
+    std::cout << "success" << std::endl;
+    return 0;
 }
@@ -41,4 +41,13 @@ SOURCES += \
 
 HEADERS += \
     circular_buffer.hpp \
-    sorted_flat_deque.hpp
+    sorted_flat_array.hpp \
+    sorted_flat_deque.hpp \
+    sorted_flat_deque_bank.hpp \
+    sorted_flat_executor.hpp \
+    sorted_flat_histogram.hpp \
+    sorted_flat_mapped.hpp \
+    sorted_flat_publisher.hpp \
+    sorted_flat_runs.hpp \
+    sorted_flat_time_window.hpp \
+    spsc_ring.hpp